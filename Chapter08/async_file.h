@@ -0,0 +1,617 @@
+//
+// Copyright (C) 2018 Rian Quinn <rianquinn@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef ASYNC_FILE_H
+#define ASYNC_FILE_H
+
+#include <deque>
+#include <mutex>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <stdexcept>
+#include <functional>
+#include <initializer_list>
+#include <condition_variable>
+
+#include <cstdint>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// -----------------------------------------------------------------------------
+// io_uring
+// -----------------------------------------------------------------------------
+
+// A minimal io_uring, set up directly with the io_uring_setup() and
+// io_uring_enter() system calls, so that nothing here depends on liburing.
+// The submission queue array is filled in once at start up, as slot i of
+// the array always refers to SQE i.
+//
+// Submitting is not thread safe, and neither is completing, but one thread
+// may submit while another one waits for completions.
+
+class uring
+{
+public:
+
+    explicit uring(unsigned entries)
+    {
+        io_uring_params params{};
+
+        auto fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (fd == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        m_fd = static_cast<int>(fd);
+
+        m_sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        m_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+        m_sq = map(m_sq_size, IORING_OFF_SQ_RING);
+        m_cq = map(m_cq_size, IORING_OFF_CQ_RING);
+        m_sqes = static_cast<io_uring_sqe *>(map(m_sqes_size, IORING_OFF_SQES));
+
+        auto sq = static_cast<char *>(m_sq);
+        auto cq = static_cast<char *>(m_cq);
+
+        m_sq_tail = reinterpret_cast<uint32_t *>(sq + params.sq_off.tail);
+        m_sq_mask = *reinterpret_cast<uint32_t *>(sq + params.sq_off.ring_mask);
+        m_cq_head = reinterpret_cast<uint32_t *>(cq + params.cq_off.head);
+        m_cq_tail = reinterpret_cast<uint32_t *>(cq + params.cq_off.tail);
+        m_cq_mask = *reinterpret_cast<uint32_t *>(cq + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+        auto array = reinterpret_cast<uint32_t *>(sq + params.sq_off.array);
+        for (uint32_t i = 0; i < params.sq_entries; i++) {
+            array[i] = i;
+        }
+    }
+
+    ~uring()
+    {
+        munmap(m_sqes, m_sqes_size);
+        munmap(m_cq, m_cq_size);
+        munmap(m_sq, m_sq_size);
+        ::close(m_fd);
+    }
+
+    uring(const uring &) = delete;
+    uring &operator=(const uring &) = delete;
+
+    // Returns true if the kernel supports every one of the given opcodes.
+    // The probe itself only exists since Linux 5.6, and so do IORING_OP_READ
+    // and IORING_OP_WRITE, so an older kernel (where the ring can be set up,
+    // but every read and write fails with EINVAL) supports none of them.
+
+    bool supports(std::initializer_list<uint8_t> opcodes) const
+    {
+        constexpr unsigned num = 256;
+
+        std::vector<char> buf(sizeof(io_uring_probe) + num * sizeof(io_uring_probe_op));
+        auto probe = reinterpret_cast<io_uring_probe *>(buf.data());
+
+        if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PROBE, probe, num) == -1) {
+            return false;
+        }
+
+        for (auto opcode : opcodes) {
+            if (opcode >= probe->ops_len || (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED) == 0) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void read(int fd, void *buf, std::size_t len, std::size_t offset, uint64_t data)
+    {
+        auto sqe = prepare(IORING_OP_READ, fd, data);
+
+        sqe->addr = reinterpret_cast<uint64_t>(buf);
+        sqe->len = static_cast<uint32_t>(len);
+        sqe->off = offset;
+
+        push();
+    }
+
+    void write(int fd, const void *buf, std::size_t len, std::size_t offset, uint64_t data)
+    {
+        auto sqe = prepare(IORING_OP_WRITE, fd, data);
+
+        sqe->addr = reinterpret_cast<uint64_t>(buf);
+        sqe->len = static_cast<uint32_t>(len);
+        sqe->off = offset;
+
+        push();
+    }
+
+    void fsync(int fd, bool datasync, uint64_t data)
+    {
+        auto sqe = prepare(IORING_OP_FSYNC, fd, data);
+        sqe->fsync_flags = datasync ? IORING_FSYNC_DATASYNC : 0;
+
+        push();
+    }
+
+    // Note that for a fallocate, io_uring takes the length in addr and the
+    // mode in len.
+
+    void fallocate(int fd, int mode, std::size_t offset, std::size_t len, uint64_t data)
+    {
+        auto sqe = prepare(IORING_OP_FALLOCATE, fd, data);
+
+        sqe->addr = len;
+        sqe->len = static_cast<uint32_t>(mode);
+        sqe->off = offset;
+
+        push();
+    }
+
+    void nop(uint64_t data)
+    {
+        prepare(IORING_OP_NOP, -1, data);
+        push();
+    }
+
+    // Submits everything queued since the last call without waiting. If
+    // the kernel refuses to take them, they are removed from the queue
+    // again before the error is thrown, so that the caller can clean up
+    // after them without a later call submitting them after all.
+
+    void submit()
+    {
+        flush(0, 0);
+    }
+
+    // Submits everything queued since the last call, waits for at least
+    // one completion, and calls func(user_data, result) for each one.
+
+    template<typename FUNC>
+    void complete(FUNC func)
+    {
+        flush(1, IORING_ENTER_GETEVENTS);
+        reap(func);
+    }
+
+    // Waits for at least one completion without submitting anything, so
+    // that one thread can wait for completions while another submits.
+
+    template<typename FUNC>
+    void wait(FUNC func)
+    {
+        enter(0, 1, IORING_ENTER_GETEVENTS);
+        reap(func);
+    }
+
+private:
+
+    io_uring_sqe *prepare(uint8_t opcode, int fd, uint64_t data)
+    {
+        auto sqe = &m_sqes[*m_sq_tail & m_sq_mask];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->user_data = data;
+
+        return sqe;
+    }
+
+    void push()
+    {
+        __atomic_store_n(m_sq_tail, *m_sq_tail + 1, __ATOMIC_RELEASE);
+        m_pending++;
+    }
+
+    void flush(unsigned min_complete, unsigned flags)
+    {
+        try {
+            enter(m_pending, min_complete, flags);
+        }
+        catch (...) {
+            __atomic_store_n(m_sq_tail, *m_sq_tail - m_pending, __ATOMIC_RELEASE);
+            m_pending = 0;
+
+            throw;
+        }
+
+        m_pending = 0;
+    }
+
+    void enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+    {
+        while (syscall(__NR_io_uring_enter, m_fd, to_submit, min_complete, flags, nullptr, 0) == -1) {
+            if (errno != EINTR) {
+                throw std::runtime_error(strerror(errno));
+            }
+        }
+    }
+
+    template<typename FUNC>
+    void reap(FUNC &func)
+    {
+        auto head = *m_cq_head;
+        while (head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) {
+            auto cqe = m_cqes[head & m_cq_mask];
+            __atomic_store_n(m_cq_head, ++head, __ATOMIC_RELEASE);
+
+            func(cqe.user_data, cqe.res);
+        }
+    }
+
+    void *map(std::size_t size, off_t offset)
+    {
+        auto ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, offset);
+        if (ptr == MAP_FAILED) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        return ptr;
+    }
+
+private:
+
+    int m_fd{-1};
+    unsigned m_pending{};
+
+    void *m_sq{};
+    void *m_cq{};
+    io_uring_sqe *m_sqes{};
+
+    std::size_t m_sq_size{};
+    std::size_t m_cq_size{};
+    std::size_t m_sqes_size{};
+
+    uint32_t *m_sq_tail{};
+    uint32_t m_sq_mask{};
+    uint32_t *m_cq_head{};
+    uint32_t *m_cq_tail{};
+    uint32_t m_cq_mask{};
+    io_uring_cqe *m_cqes{};
+};
+
+// -----------------------------------------------------------------------------
+// Async File
+// -----------------------------------------------------------------------------
+
+// An open file that reads, writes, syncs and allocates asynchronously. Each
+// operation either takes a callback, which is given the result the way the
+// system call would return it (a byte count, or -errno on failure), or
+// returns a future that holds the byte count or throws.
+//
+// Operations go to an io_uring when the kernel has one, and are completed
+// by a thread of the file's own that waits on the completion queue, so that
+// a single thread can keep as many operations in flight as the ring has
+// entries without ever blocking on one of them. When io_uring is not
+// available (or the thread backend is asked for), the same operations are
+// handed to a pool of threads that make ordinary blocking system calls,
+// which needs one thread per operation in flight to reach the same depth.
+//
+// Callbacks run on the completion (or pool) thread, so they should be
+// short. Once depth operations are in flight, starting another one blocks
+// until one of them completes, except from a callback: a callback may start
+// another operation, for example to keep the queue depth constant, and as
+// the thread it runs on is the one that completes operations, that
+// operation is always started straight away, even if it takes the file
+// past depth. The file waits for all of its operations to complete before
+// it is closed.
+
+#define ASYNC_FILE_DEPTH 128
+
+class async_file
+{
+public:
+
+    using callback_t = std::function<void(int)>;
+
+    enum class backend
+    {
+        automatic,
+        uring,
+        threads
+    };
+
+    explicit async_file(
+        const std::string &path, int flags = O_RDONLY, mode_t mode = 0644,
+        unsigned depth = ASYNC_FILE_DEPTH, backend type = backend::automatic
+    ) :
+        m_depth{depth}
+    {
+        if (m_fd = ::open(path.c_str(), flags | O_CLOEXEC, mode); m_fd == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        if (type != backend::threads) {
+            try {
+                m_ring = std::make_unique<uring>(depth);
+
+                if (!m_ring->supports({IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_FALLOCATE})) {
+                    throw std::runtime_error("io_uring does not support file reads and writes");
+                }
+            }
+            catch (const std::runtime_error &) {
+                m_ring.reset();
+
+                if (type == backend::uring) {
+                    ::close(m_fd);
+                    throw;
+                }
+            }
+        }
+
+        if (m_ring) {
+            m_threads.emplace_back(&async_file::reap, this);
+        }
+        else {
+            for (unsigned i = 0; i < depth; i++) {
+                m_threads.emplace_back(&async_file::work, this);
+            }
+        }
+    }
+
+    ~async_file()
+    {
+        {
+            std::unique_lock lock(m_mutex);
+            m_cond.wait(lock, [&] { return m_inflight == 0 && m_callbacks == 0; });
+
+            m_stopping = true;
+
+            if (m_ring) {
+                m_ring->nop(0);
+                m_ring->submit();
+            }
+        }
+
+        m_cond.notify_all();
+
+        for (auto &t : m_threads) {
+            t.join();
+        }
+
+        ::close(m_fd);
+    }
+
+    async_file(const async_file &) = delete;
+    async_file &operator=(const async_file &) = delete;
+
+    void read_at(void *buf, std::size_t len, off_t offset, callback_t func)
+    {
+        start(std::move(func),
+            [&](uint64_t data) { m_ring->read(m_fd, buf, len, static_cast<std::size_t>(offset), data); },
+            [=, fd = m_fd] { return pread(fd, buf, len, offset); }
+        );
+    }
+
+    void write_at(const void *buf, std::size_t len, off_t offset, callback_t func)
+    {
+        start(std::move(func),
+            [&](uint64_t data) { m_ring->write(m_fd, buf, len, static_cast<std::size_t>(offset), data); },
+            [=, fd = m_fd] { return pwrite(fd, buf, len, offset); }
+        );
+    }
+
+    void fsync(bool datasync, callback_t func)
+    {
+        start(std::move(func),
+            [&](uint64_t data) { m_ring->fsync(m_fd, datasync, data); },
+            [=, fd = m_fd] { return datasync ? ::fdatasync(fd) : ::fsync(fd); }
+        );
+    }
+
+    void fallocate(int mode, off_t offset, off_t len, callback_t func)
+    {
+        start(std::move(func),
+            [&](uint64_t data) {
+                m_ring->fallocate(m_fd, mode, static_cast<std::size_t>(offset), static_cast<std::size_t>(len), data);
+            },
+            [=, fd = m_fd] { return ::fallocate(fd, mode, offset, len); }
+        );
+    }
+
+    std::future<std::size_t> read_at(void *buf, std::size_t len, off_t offset)
+    { return future([&](auto func) { read_at(buf, len, offset, std::move(func)); }); }
+
+    std::future<std::size_t> write_at(const void *buf, std::size_t len, off_t offset)
+    { return future([&](auto func) { write_at(buf, len, offset, std::move(func)); }); }
+
+    std::future<std::size_t> fsync(bool datasync = false)
+    { return future([&](auto func) { fsync(datasync, std::move(func)); }); }
+
+    std::future<std::size_t> fallocate(int mode, off_t offset, off_t len)
+    { return future([&](auto func) { fallocate(mode, offset, len, std::move(func)); }); }
+
+    bool uses_uring() const
+    { return m_ring != nullptr; }
+
+    int fd() const
+    { return m_fd; }
+
+private:
+
+    // With io_uring, the callback is moved to the heap and its address is
+    // the operation's user data; the NOP sent by the destructor has user
+    // data 0, which tells the completion thread to stop. With the thread
+    // pool, the blocking system call and the callback are queued together.
+    //
+    // An operation is only counted as in flight once it has been queued,
+    // so that if queuing it throws, nothing is left for the destructor to
+    // wait on. It cannot complete before it is counted, as completing it
+    // takes the lock that is held here.
+    //
+    // A callback of this file never waits for the depth to drop, since on
+    // the io_uring backend nothing else would reap the completion it is
+    // waiting for, and on the thread pool every worker could be waiting.
+
+    template<typename URING, typename SYSCALL>
+    void start(callback_t func, URING uring_op, SYSCALL syscall_op)
+    {
+        std::unique_lock lock(m_mutex);
+
+        if (t_completing != this) {
+            m_cond.wait(lock, [&] { return m_inflight < m_depth; });
+        }
+
+        if (m_ring) {
+            auto data = std::make_unique<callback_t>(std::move(func));
+
+            uring_op(reinterpret_cast<uint64_t>(data.get()));
+            m_ring->submit();
+
+            data.release();
+            m_inflight++;
+
+            return;
+        }
+
+        m_queue.push_back({
+            [syscall_op] {
+                auto ret = syscall_op();
+                return ret == -1 ? -errno : static_cast<int>(ret);
+            },
+            std::move(func)
+        });
+
+        m_inflight++;
+        lock.unlock();
+        m_cond.notify_all();
+    }
+
+    template<typename START>
+    std::future<std::size_t> future(START start_op)
+    {
+        auto promise = std::make_shared<std::promise<std::size_t>>();
+        auto result = promise->get_future();
+
+        start_op([promise](int res) {
+            if (res < 0) {
+                promise->set_exception(std::make_exception_ptr(std::runtime_error(strerror(-res))));
+                return;
+            }
+
+            promise->set_value(static_cast<std::size_t>(res));
+        });
+
+        return result;
+    }
+
+    // An operation stops counting as in flight before its callback runs, so
+    // that the callback can start another one even when the queue is full.
+    // The callback itself is counted instead until it returns, so that the
+    // destructor cannot miss an operation a callback is about to start.
+
+    void finish(callback_t &func, int res)
+    {
+        {
+            std::lock_guard lock(m_mutex);
+
+            m_inflight--;
+            m_callbacks++;
+        }
+
+        m_cond.notify_all();
+
+        auto completing = std::exchange(t_completing, this);
+        func(res);
+        t_completing = completing;
+
+        {
+            std::lock_guard lock(m_mutex);
+            m_callbacks--;
+        }
+
+        m_cond.notify_all();
+    }
+
+    void reap()
+    {
+        auto running = true;
+
+        while (running) {
+            m_ring->wait([&](uint64_t data, int res) {
+                if (data == 0) {
+                    running = false;
+                    return;
+                }
+
+                auto func = std::unique_ptr<callback_t>(reinterpret_cast<callback_t *>(data));
+                finish(*func, res);
+            });
+        }
+    }
+
+    void work()
+    {
+        while (true) {
+            std::unique_lock lock(m_mutex);
+            m_cond.wait(lock, [&] { return m_stopping || !m_queue.empty(); });
+
+            if (m_queue.empty()) {
+                return;
+            }
+
+            auto job = std::move(m_queue.front());
+            m_queue.pop_front();
+
+            lock.unlock();
+
+            finish(job.func, job.op());
+        }
+    }
+
+private:
+
+    struct job {
+        std::function<int()> op;
+        callback_t func;
+    };
+
+    int m_fd{-1};
+    unsigned m_depth;
+
+    std::unique_ptr<uring> m_ring;
+    std::vector<std::thread> m_threads;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+
+    unsigned m_inflight{};
+    unsigned m_callbacks{};
+    bool m_stopping{};
+
+    std::deque<job> m_queue;
+
+    static inline thread_local const async_file *t_completing{};
+};
+
+#endif
@@ -0,0 +1,272 @@
+//
+// Copyright (C) 2018 Rian Quinn <rianquinn@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef BINARY_LOG_H
+#define BINARY_LOG_H
+
+#include <array>
+#include <mutex>
+#include <tuple>
+#include <chrono>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <string_view>
+#include <type_traits>
+
+#include <fstream>
+
+#include <string.h>
+
+// -----------------------------------------------------------------------------
+// Binary Log Format
+// -----------------------------------------------------------------------------
+
+// log.bin is a sequence of records, each starting with a record_header. A
+// program that logs in binary first writes a dictionary record holding every
+// format string it could ever log, and each log record after it refers to
+// its format string by its index in that dictionary. The dictionary payload
+// is, for each format, its level, followed by the format string and its
+// type string, each as a uint32_t length and the characters.
+//
+// A log record's payload is its arguments as raw bytes, one per character of
+// the format's type string:
+//
+// - i: int64_t
+// - u: uint64_t
+// - d: double
+// - c: char
+// - b: bool
+// - s: uint32_t length, followed by the characters
+//
+// Each {} in a format string is replaced by the next argument when the log
+// is decoded.
+
+struct record_header
+{
+    uint32_t id;
+    uint32_t size;
+    uint64_t timestamp;
+};
+
+constexpr uint32_t DICTIONARY_ID = 0xFFFFFFFF;
+constexpr std::size_t MAX_RECORD = 0x400;
+
+// -----------------------------------------------------------------------------
+// Binary Log Encoding
+// -----------------------------------------------------------------------------
+
+// Every BLOG() call site defines its format in the "log_formats" section,
+// so the linker gathers all of them into a single array, which it marks with
+// the __start_log_formats and __stop_log_formats symbols. A format's ID is
+// simply its index in that array, so nothing has to be registered at run
+// time, and the hot path never touches a format string. The formats are
+// explicitly aligned to 8 bytes, as the compiler would otherwise be free to
+// align them further, leaving gaps in the array.
+
+struct alignas(8) log_format
+{
+    std::size_t level;
+    const char *fmt;
+    const char *types;
+};
+
+extern const log_format __start_log_formats[] __attribute__((weak));
+extern const log_format __stop_log_formats[] __attribute__((weak));
+
+template<typename T>
+constexpr char type_code()
+{
+    if constexpr (std::is_same_v<T, bool>) {
+        return 'b';
+    }
+    else if constexpr (std::is_same_v<T, char>) {
+        return 'c';
+    }
+    else if constexpr (std::is_integral_v<T>) {
+        return std::is_signed_v<T> ? 'i' : 'u';
+    }
+    else if constexpr (std::is_floating_point_v<T>) {
+        return 'd';
+    }
+    else {
+        static_assert(std::is_convertible_v<T, std::string_view>, "unsupported log argument");
+        return 's';
+    }
+}
+
+template<typename T>
+struct type_string;
+
+template<typename... Args>
+struct type_string<std::tuple<Args...>>
+{
+    static constexpr char value[] = {type_code<Args>()..., '\0'};
+};
+
+// Strings are the only arguments whose size is not known at compile time,
+// so they are truncated to fit whatever room the rest of the record leaves.
+
+template<typename T>
+constexpr std::size_t fixed_size()
+{
+    switch (type_code<T>()) {
+        case 'i':
+        case 'u':
+        case 'd':
+            return 8;
+
+        case 's':
+            return sizeof(uint32_t);
+
+        default:
+            return 1;
+    }
+}
+
+template<typename T>
+void encode(char *&ptr, std::size_t &room, const T &arg)
+{
+    auto put = [&ptr](const auto &val) {
+        memcpy(ptr, &val, sizeof(val));
+        ptr += sizeof(val);
+    };
+
+    if constexpr (type_code<T>() == 'i') {
+        put(static_cast<int64_t>(arg));
+    }
+    else if constexpr (type_code<T>() == 'u') {
+        put(static_cast<uint64_t>(arg));
+    }
+    else if constexpr (type_code<T>() == 'd') {
+        put(static_cast<double>(arg));
+    }
+    else if constexpr (type_code<T>() == 's') {
+        std::string_view str = arg;
+        auto len = std::min(str.size(), room);
+
+        put(static_cast<uint32_t>(len));
+        memcpy(ptr, str.data(), len);
+
+        ptr += len;
+        room -= len;
+    }
+    else {
+        put(arg);
+    }
+}
+
+// Encodes a whole record (header and arguments) into buf, returning its
+// size.
+
+template<typename... Args>
+std::size_t
+encode_record(std::array<char, MAX_RECORD> &buf, const log_format &format, const Args &... args)
+{
+    constexpr auto fixed = sizeof(record_header) + (fixed_size<Args>() + ... + 0);
+    static_assert(fixed <= MAX_RECORD, "too many log arguments");
+
+    auto ptr = buf.data() + sizeof(record_header);
+    auto room = MAX_RECORD - fixed;
+
+    (encode(ptr, room, args), ...);
+
+    auto size = static_cast<std::size_t>(ptr - buf.data());
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+
+    record_header hdr{
+        static_cast<uint32_t>(&format - __start_log_formats),
+        static_cast<uint32_t>(size - sizeof(record_header)),
+        static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count())
+    };
+
+    memcpy(buf.data(), &hdr, sizeof(hdr));
+    return size;
+}
+
+// Returns the dictionary record (header and payload) for every format in the
+// program.
+
+inline std::string
+log_dictionary()
+{
+    std::string payload;
+
+    auto put = [&payload](const auto &val) {
+        payload.append(reinterpret_cast<const char *>(&val), sizeof(val));
+    };
+
+    for (auto format = __start_log_formats; format != __stop_log_formats; ++format) {
+        put(static_cast<uint32_t>(format->level));
+
+        for (std::string_view str : {format->fmt, format->types}) {
+            put(static_cast<uint32_t>(str.size()));
+            payload.append(str);
+        }
+    }
+
+    record_header hdr{DICTIONARY_ID, static_cast<uint32_t>(payload.size()), 0};
+    return std::string(reinterpret_cast<const char *>(&hdr), sizeof(hdr)) + payload;
+}
+
+// -----------------------------------------------------------------------------
+// Binary Log File
+// -----------------------------------------------------------------------------
+
+// Appends records to a binary log file, starting with the dictionary. Each
+// record is encoded on the caller's stack and then written under a lock, so
+// that records from different threads never interleave.
+
+class binary_log
+{
+public:
+
+    explicit binary_log(const char *path) :
+        m_file{path, std::ios::out | std::ios::app | std::ios::binary}
+    {
+        auto dictionary = log_dictionary();
+        m_file.write(dictionary.data(), static_cast<std::streamsize>(dictionary.size()));
+    }
+
+    template<typename... Args>
+    void write(const log_format &format, const Args &... args)
+    {
+        std::array<char, MAX_RECORD> buf;
+        auto size = encode_record(buf, format, args...);
+
+        write(buf.data(), size);
+    }
+
+    void write(const char *buf, std::size_t size)
+    {
+        std::lock_guard lock(m_mutex);
+        m_file.write(buf, static_cast<std::streamsize>(size));
+    }
+
+private:
+
+    std::mutex m_mutex;
+    std::fstream m_file;
+};
+
+#endif
@@ -0,0 +1,366 @@
+//
+// Copyright (C) 2018 Rian Quinn <rianquinn@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef DURABLE_FILE_H
+#define DURABLE_FILE_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <stdexcept>
+#include <string_view>
+#include <condition_variable>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define DURABLE_FILE_MAX_BYTES 0x100000
+
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+// Writes all of buf, retrying short writes and interrupted calls. Returns
+// false with errno set if the write fails.
+
+inline bool
+write_all(int fd, const char *buf, std::size_t len)
+{
+    while (len > 0) {
+        auto ret = ::write(fd, buf, len);
+
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return false;
+        }
+
+        buf += ret;
+        len -= static_cast<std::size_t>(ret);
+    }
+
+    return true;
+}
+
+// Syncs the directory that contains path. Creating, renaming or deleting a
+// file only changes its directory, so until the directory itself has been
+// synced, a crash can undo the change even though the file's own data is
+// already on disk.
+
+inline void
+sync_dir(const std::string &path)
+{
+    auto pos = path.rfind('/');
+    auto dir = pos == std::string::npos ? std::string(".") : path.substr(0, pos == 0 ? 1 : pos);
+
+    auto fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        throw std::runtime_error(strerror(errno));
+    }
+
+    auto ret = ::fsync(fd);
+    auto error = errno;
+
+    ::close(fd);
+
+    if (ret == -1) {
+        throw std::runtime_error(strerror(error));
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Atomic Replace
+// -----------------------------------------------------------------------------
+
+// Replaces the contents of a file so that, even if the machine crashes part
+// way through, the file holds either all of the old contents or all of the
+// new ones. Writing over the file in place cannot promise this, as a crash
+// can leave it truncated or half written.
+//
+// The new contents are written to a temporary file next to the original
+// (rename() only works within a file system), synced with fdatasync(), and
+// then renamed over the original, which POSIX guarantees is atomic. Lastly
+// the directory is synced, so that the rename itself survives a crash. If
+// anything fails before the rename, the temporary file is removed and the
+// original is left as it was. An existing file keeps its permissions.
+
+inline void
+atomic_replace(const std::string &path, std::string_view data, mode_t mode = 0644)
+{
+    if (struct stat st{}; ::stat(path.c_str(), &st) == 0) {
+        mode = st.st_mode & 07777;
+    }
+
+    auto tmp = path + ".XXXXXX";
+    auto fd = ::mkostemp(tmp.data(), O_CLOEXEC);
+
+    if (fd == -1) {
+        throw std::runtime_error(strerror(errno));
+    }
+
+    auto error = 0;
+
+    if (::fchmod(fd, mode) == -1 || !write_all(fd, data.data(), data.size()) || ::fdatasync(fd) == -1) {
+        error = errno;
+    }
+
+    if (::close(fd) == -1 && error == 0) {
+        error = errno;
+    }
+
+    if (error == 0 && ::rename(tmp.c_str(), path.c_str()) == -1) {
+        error = errno;
+    }
+
+    if (error != 0) {
+        ::unlink(tmp.c_str());
+        throw std::runtime_error(strerror(error));
+    }
+
+    sync_dir(path);
+}
+
+// -----------------------------------------------------------------------------
+// Durable Appender
+// -----------------------------------------------------------------------------
+
+// Appending to a file durably means calling fdatasync() after each write,
+// and a sync costs as much for one small record as it does for a megabyte,
+// so a writer that syncs every record is limited by the latency of the disk
+// rather than its bandwidth. The appender commits records in groups
+// instead: writers copy their records into a shared buffer, and a
+// background thread writes out the whole buffer and syncs it once, which
+// makes every record in it durable at the same time (group commit).
+//
+// The sync thread starts a commit as soon as max_bytes are pending, or once
+// max_delay has passed since the first record of the group was added. With
+// no delay, a commit starts as soon as the previous one has finished, and
+// the group is whatever arrived while that one was running, so the groups
+// grow by themselves as load increases. A delay trades latency for fewer,
+// larger commits.
+
+struct group_commit
+{
+    std::size_t max_bytes{DURABLE_FILE_MAX_BYTES};
+    std::chrono::microseconds max_delay{0};
+};
+
+// append() returns once the record is on disk. write() only adds the record
+// to the next group and returns its sequence number (the number of bytes
+// written through the appender up to the end of the record), which can be
+// passed to wait() later, so that a writer can keep working while its
+// records are being committed. sync() waits for everything written so far.
+// The destructor commits whatever is still pending.
+//
+// So that writers that never wait cannot fill memory while the disk falls
+// behind, write() blocks while twice max_bytes are already pending, until
+// the commit in progress has finished. A record is always accepted into an
+// empty group, so with a max_bytes of 0, records are committed one at a time.
+//
+// If a write or sync fails, the state of the data on disk is unknown (a
+// failed fdatasync() may have dropped the dirty pages it could not write,
+// so trying again is not safe), and every call that follows throws.
+
+class durable_appender
+{
+public:
+
+    explicit durable_appender(const std::string &path, group_commit policy = {}) :
+        m_policy{policy}
+    {
+        if (m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644); m_fd == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        // The file may have just been created, in which case it only
+        // survives a crash once its directory has been synced as well.
+
+        try {
+            if (::fsync(m_fd) == -1) {
+                throw std::runtime_error(strerror(errno));
+            }
+
+            sync_dir(path);
+        }
+        catch (...) {
+            ::close(m_fd);
+            throw;
+        }
+
+        m_thread = std::thread(&durable_appender::run, this);
+    }
+
+    ~durable_appender()
+    {
+        {
+            std::unique_lock lock(m_mutex);
+            m_stop = true;
+        }
+
+        m_pending.notify_one();
+        m_thread.join();
+
+        ::close(m_fd);
+    }
+
+    std::uint64_t write(std::string_view data)
+    {
+        std::unique_lock lock(m_mutex);
+
+        m_committed.wait(lock, [&] {
+            return m_buf.empty() || m_buf.size() < m_policy.max_bytes * 2 || m_error != 0;
+        });
+        check();
+
+        if (m_buf.empty()) {
+            m_first = std::chrono::steady_clock::now();
+        }
+
+        m_buf.append(data);
+        m_written += data.size();
+
+        m_pending.notify_one();
+        return m_written;
+    }
+
+    void wait(std::uint64_t seq)
+    {
+        std::unique_lock lock(m_mutex);
+
+        m_committed.wait(lock, [&] { return m_synced >= seq || m_error != 0; });
+        check();
+    }
+
+    void append(std::string_view data)
+    {
+        wait(write(data));
+    }
+
+    void sync()
+    {
+        std::uint64_t seq{};
+
+        {
+            std::unique_lock lock(m_mutex);
+            seq = m_written;
+        }
+
+        wait(seq);
+    }
+
+    std::size_t syncs()
+    {
+        std::unique_lock lock(m_mutex);
+        return m_syncs;
+    }
+
+    durable_appender(const durable_appender &) = delete;
+    durable_appender &operator=(const durable_appender &) = delete;
+
+private:
+
+    void check()
+    {
+        if (m_error != 0) {
+            throw std::runtime_error(strerror(m_error));
+        }
+    }
+
+    void run()
+    {
+        std::string buf;
+
+        while (true) {
+            std::uint64_t seq{};
+
+            {
+                std::unique_lock lock(m_mutex);
+
+                m_pending.wait(lock, [&] { return !m_buf.empty() || m_stop; });
+                if (m_buf.empty() || m_error != 0) {
+                    return;
+                }
+
+                m_pending.wait_until(lock, m_first + m_policy.max_delay, [&] {
+                    return m_buf.size() >= m_policy.max_bytes || m_stop;
+                });
+
+                buf.swap(m_buf);
+                seq = m_written;
+            }
+
+            auto error = 0;
+
+            if (!write_all(m_fd, buf.data(), buf.size()) || ::fdatasync(m_fd) == -1) {
+                error = errno;
+            }
+
+            buf.clear();
+
+            {
+                std::unique_lock lock(m_mutex);
+
+                if (error != 0) {
+                    m_error = error;
+                }
+                else {
+                    m_synced = seq;
+                    m_syncs++;
+                }
+            }
+
+            m_committed.notify_all();
+        }
+    }
+
+private:
+
+    int m_fd{-1};
+    group_commit m_policy;
+
+    std::mutex m_mutex;
+    std::condition_variable m_pending;
+    std::condition_variable m_committed;
+
+    std::string m_buf;
+    std::chrono::steady_clock::time_point m_first;
+
+    std::uint64_t m_written{};
+    std::uint64_t m_synced{};
+    std::size_t m_syncs{};
+
+    int m_error{};
+    bool m_stop{};
+
+    std::thread m_thread;
+};
+
+#endif
@@ -19,10 +19,35 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <array>
+#include <tuple>
+#include <string>
+#include <vector>
+#include <utility>
+#include <string_view>
+#include <type_traits>
+
 #include <sstream>
 #include <fstream>
 #include <iostream>
 
+#include <string.h>
+
+#include "binary_log.h"
+
+#ifndef DECODER
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <charconv>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
 #ifdef DEBUG_LEVEL
 constexpr auto g_debug_level = DEBUG_LEVEL;
 #else
@@ -35,11 +60,64 @@ constexpr auto g_ndebug = true;
 constexpr auto g_ndebug = false;
 #endif
 
+#ifdef LOG_LEVEL
+constexpr std::size_t g_initial_log_level = LOG_LEVEL;
+#else
+constexpr std::size_t g_initial_log_level = 0;
+#endif
+
 std::fstream g_log{"log.txt", std::ios::out | std::ios::app};
 
+// -----------------------------------------------------------------------------
+// Log Levels
+// -----------------------------------------------------------------------------
+
+// g_debug_level is a ceiling: log calls above it are removed at compile
+// time, exactly as before. Calls at or below it are also checked against
+// g_log_level, which can be changed while the program is running. That check
+// is a relaxed load and a compare, so a disabled call costs one branch,
+// which is always predicted correctly for as long as the level stays put.
+
+std::atomic<std::size_t> g_log_level{g_initial_log_level};
+
+template<std::size_t LEVEL>
+bool log_enabled()
+{ return LEVEL <= g_log_level.load(std::memory_order_relaxed); }
+
+// SIGUSR1 raises the runtime level by one, up to the compile-time ceiling,
+// and SIGUSR2 lowers it by one (for example, "kill -USR1 <pid>"). Lock-free
+// atomics are safe to use from a signal handler.
+
+extern "C" void
+adjust_log_level(int sig)
+{
+    auto level = g_log_level.load(std::memory_order_relaxed);
+
+    if (sig == SIGUSR1 && level < g_debug_level) {
+        level++;
+    }
+
+    if (sig == SIGUSR2 && level > 0) {
+        level--;
+    }
+
+    g_log_level.store(level, std::memory_order_relaxed);
+}
+
+void
+install_log_signals()
+{
+    ::signal(SIGUSR1, adjust_log_level);
+    ::signal(SIGUSR2, adjust_log_level);
+}
+
 template <std::size_t LEVEL>
 constexpr void log(void(*func)()) {
     if constexpr (!g_ndebug && (LEVEL <= g_debug_level)) {
+        if (!log_enabled<LEVEL>()) {
+            return;
+        }
+
         std::stringstream buf;
 
         auto g_buf = std::clog.rdbuf();
@@ -57,6 +135,580 @@ constexpr void log(void(*func)()) {
     };
 }
 
+// -----------------------------------------------------------------------------
+// Fast Logging
+// -----------------------------------------------------------------------------
+
+// log<LEVEL>(FMT("...{}..."), args...) produces the same output as the log
+// above, without a std::stringstream, without swapping std::clog's rdbuf
+// and without a single heap allocation. The format string is turned into
+// a type by the FMT() macro, so the position of each {} placeholder is
+// worked out at compile time, as is whether the number of arguments
+// matches. At run time, the line is assembled in a preallocated,
+// thread-local buffer, and is then written to std::clog and the log file
+// with one call each. Lines that do not fit in the buffer are truncated.
+
+constexpr std::size_t MAX_LINE = 0x400;
+constexpr std::string_view g_prefix = "\033[1;32mDEBUG\033[0m: ";
+
+template<char... Cs>
+struct format_string
+{
+    static constexpr char str[] = {Cs..., '\0'};
+    static constexpr std::size_t len = sizeof...(Cs);
+
+    static constexpr std::size_t count()
+    {
+        std::size_t num{};
+
+        for (std::size_t i = 0; i + 1 < len; i++) {
+            if (str[i] == '{' && str[i + 1] == '}') {
+                num++;
+                i++;
+            }
+        }
+
+        return num;
+    }
+
+    // The offset of every placeholder, followed by the length of the string.
+
+    static constexpr auto placeholders()
+    {
+        std::array<std::size_t, count() + 1> pos{};
+        std::size_t num{};
+
+        for (std::size_t i = 0; i + 1 < len; i++) {
+            if (str[i] == '{' && str[i + 1] == '}') {
+                pos[num++] = i;
+                i++;
+            }
+        }
+
+        pos[num] = len;
+        return pos;
+    }
+};
+
+// A string literal cannot be passed as a template argument, and the literal
+// operator template that would turn one into a character pack directly
+// ("..."_fmt) is a GNU extension. Instead, FMT() wraps the literal in a
+// local type whose get() returns it, and each character is then read out
+// of get() in a constant expression.
+
+template<typename S, std::size_t... Is>
+constexpr auto make_format_string(S, std::index_sequence<Is...>)
+{ return format_string<S::get()[Is]...>{}; }
+
+#define FMT(s) make_format_string([]{                                       \
+        struct literal { static constexpr std::string_view get() { return s; } }; \
+        return literal{};                                                   \
+    }(), std::make_index_sequence<sizeof(s) - 1>{})
+
+class line_buffer
+{
+public:
+
+    void clear()
+    { m_len = 0; }
+
+    void append(const char *str, std::size_t len)
+    {
+        len = std::min(len, m_buf.size() - m_len);
+
+        memcpy(m_buf.data() + m_len, str, len);
+        m_len += len;
+    }
+
+    template<typename T>
+    void append_arg(const T &arg)
+    {
+        if constexpr (std::is_same_v<T, bool>) {
+            append_arg(arg ? "true" : "false");
+        }
+        else if constexpr (std::is_same_v<T, char>) {
+            append(&arg, 1);
+        }
+        else if constexpr (std::is_arithmetic_v<T>) {
+            auto [ptr, ec] = std::to_chars(m_buf.data() + m_len, m_buf.data() + m_buf.size(), arg);
+
+            if (ec == std::errc{}) {
+                m_len = static_cast<std::size_t>(ptr - m_buf.data());
+            }
+        }
+        else {
+            std::string_view str = arg;
+            append(str.data(), str.size());
+        }
+    }
+
+    const char *data() const
+    { return m_buf.data(); }
+
+    std::size_t size() const
+    { return m_len; }
+
+private:
+
+    std::array<char, MAX_LINE> m_buf;
+    std::size_t m_len{};
+};
+
+thread_local line_buffer t_line;
+
+template <char... Cs, typename... Args>
+line_buffer &format_line(format_string<Cs...> fmt, const Args &... args) {
+    constexpr auto pos = fmt.placeholders();
+
+    auto &line = t_line;
+    line.clear();
+    line.append(g_prefix.data(), g_prefix.size());
+
+    std::size_t start{};
+    std::size_t index{};
+
+    [[maybe_unused]] auto segment = [&](const auto &arg) {
+        line.append(fmt.str + start, pos[index] - start);
+        line.append_arg(arg);
+
+        start = pos[index++] + 2;
+    };
+
+    (segment(args), ...);
+    line.append(fmt.str + start, fmt.len - start);
+
+    return line;
+}
+
+template <std::size_t LEVEL, char... Cs, typename... Args>
+void log(format_string<Cs...> fmt, const Args &... args) {
+    static_assert(fmt.count() == sizeof...(Args), "wrong number of log arguments");
+
+    if constexpr (!g_ndebug && (LEVEL <= g_debug_level)) {
+        if (!log_enabled<LEVEL>()) {
+            return;
+        }
+
+        auto &line = format_line(fmt, args...);
+
+        std::clog.write(line.data(), static_cast<std::streamsize>(line.size()));
+        g_log.write(line.data(), static_cast<std::streamsize>(line.size()));
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Asynchronous Logging
+// -----------------------------------------------------------------------------
+
+// log_async<LEVEL>() formats a line just like log<LEVEL>(), but instead of
+// writing it, pushes it onto a ring buffer owned by the calling thread. Each
+// ring has a single producer (its thread) and a single consumer (the flusher
+// thread), so pushing a line takes no lock and touches nothing shared with
+// other logging threads. The flusher repeatedly drains every ring, merging
+// the lines it finds by timestamp, and writes them to log.txt and stderr.
+// A thread that finds its ring full waits for the flusher to catch up, or
+// if no flusher is running (before start() or after stop()), drops the line
+// and counts it in g_async_dropped rather than waiting forever.
+//
+// Rings are never freed. When a thread exits, its ring is handed to the next
+// thread that needs one, so the number of rings is bounded by the number of
+// threads logging at the same time. Since the list of rings only ever
+// grows, it can be walked without a lock, which lets the crash handler
+// flush whatever is still pending without locking or allocating.
+
+constexpr std::size_t RING_SIZE = 0x10000;
+constexpr std::size_t MAX_RINGS = 0x100;
+
+class log_ring
+{
+public:
+
+    struct header
+    {
+        uint64_t timestamp;
+        uint32_t len;
+        uint32_t reserved;
+    };
+
+    // Producer only. Returns false if the ring is full. A record that would
+    // run past the end of the ring is written at the start instead, after a
+    // padding record that tells the consumer to skip to the start as well.
+
+    bool push(uint64_t timestamp, const char *buf, std::size_t len)
+    {
+        auto size = record_size(len);
+        auto head = m_head.load(std::memory_order_relaxed);
+        auto tail = m_tail.load(std::memory_order_acquire);
+
+        auto offset = head % RING_SIZE;
+        auto pad = offset + size > RING_SIZE ? RING_SIZE - offset : 0;
+
+        if (head + pad + size - tail > RING_SIZE) {
+            return false;
+        }
+
+        if (pad != 0) {
+            header hdr{0, PAD, 0};
+            memcpy(m_buf.data() + offset, &hdr, sizeof(hdr));
+
+            offset = 0;
+        }
+
+        header hdr{timestamp, static_cast<uint32_t>(len), 0};
+
+        memcpy(m_buf.data() + offset, &hdr, sizeof(hdr));
+        memcpy(m_buf.data() + offset + sizeof(hdr), buf, len);
+
+        m_head.store(head + pad + size, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Returns the oldest record in the ring, or nullptr if
+    // the ring is empty.
+
+    const header *peek()
+    {
+        auto tail = m_tail.load(std::memory_order_relaxed);
+        auto head = m_head.load(std::memory_order_acquire);
+
+        if (tail == head) {
+            return nullptr;
+        }
+
+        auto hdr = reinterpret_cast<const header *>(m_buf.data() + tail % RING_SIZE);
+
+        if (hdr->len == PAD) {
+            tail += RING_SIZE - tail % RING_SIZE;
+            m_tail.store(tail, std::memory_order_release);
+
+            if (tail == head) {
+                return nullptr;
+            }
+
+            hdr = reinterpret_cast<const header *>(m_buf.data());
+        }
+
+        return hdr;
+    }
+
+    // Consumer only. Removes the record returned by peek().
+
+    void pop(const header *hdr)
+    {
+        auto tail = m_tail.load(std::memory_order_relaxed);
+        m_tail.store(tail + record_size(hdr->len), std::memory_order_release);
+    }
+
+    bool try_acquire()
+    {
+        auto owned = false;
+        return m_owned.compare_exchange_strong(owned, true, std::memory_order_acquire);
+    }
+
+    void release()
+    { m_owned.store(false, std::memory_order_release); }
+
+private:
+
+    static constexpr uint32_t PAD = 0xFFFFFFFF;
+
+    static constexpr std::size_t record_size(std::size_t len)
+    { return (sizeof(header) + len + 15) & ~std::size_t(15); }
+
+    alignas(64) std::atomic<std::size_t> m_head{};
+    alignas(64) std::atomic<std::size_t> m_tail{};
+    alignas(64) std::atomic<bool> m_owned{};
+
+    alignas(16) std::array<char, RING_SIZE> m_buf;
+};
+
+std::array<std::atomic<log_ring *>, MAX_RINGS> g_rings{};
+std::atomic<std::size_t> g_num_rings{};
+
+std::atomic<int> g_async_fd{-1};
+std::atomic<std::size_t> g_async_dropped{};
+
+// Each ring has a single consumer, so only one thread may drain them at a
+// time. The flusher holds g_draining while it drains, and stops draining
+// once g_crashing is set, so that the crash handler can take over.
+
+std::atomic<bool> g_draining{};
+std::atomic<bool> g_crashing{};
+
+bool
+try_drain_lock()
+{ return !g_draining.exchange(true, std::memory_order_acquire); }
+
+void
+drain_unlock()
+{ g_draining.store(false, std::memory_order_release); }
+
+log_ring *
+acquire_ring()
+{
+    auto num = std::min(g_num_rings.load(), MAX_RINGS);
+
+    for (std::size_t i = 0; i < num; i++) {
+        if (auto ring = g_rings[i].load(); ring != nullptr && ring->try_acquire()) {
+            return ring;
+        }
+    }
+
+    auto index = g_num_rings++;
+    if (index >= MAX_RINGS) {
+        throw std::runtime_error("too many threads logging at once");
+    }
+
+    auto ring = new log_ring;
+    ring->try_acquire();
+
+    g_rings[index].store(ring);
+    return ring;
+}
+
+struct ring_owner
+{
+    ring_owner() :
+        ring{acquire_ring()}
+    { }
+
+    ~ring_owner()
+    { ring->release(); }
+
+    log_ring *ring;
+};
+
+thread_local ring_owner t_ring;
+
+void
+write_all(int fd, const char *buf, std::size_t len)
+{
+    while (len != 0) {
+        auto ret = ::write(fd, buf, len);
+
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return;
+        }
+
+        buf += ret;
+        len -= static_cast<std::size_t>(ret);
+    }
+}
+
+// Writes out every record that is currently in the rings, oldest first,
+// using buf to batch them into as few writes as possible. Returns the number
+// of records written. The caller must hold the drain lock. Neither locks nor
+// allocates, as the crash handler calls it from a signal handler.
+
+std::size_t
+drain(char *buf, std::size_t size)
+{
+    std::size_t len{};
+    std::size_t num{};
+
+    auto flush = [&] {
+        if (len != 0) {
+            write_all(g_async_fd, buf, len);
+            write_all(STDERR_FILENO, buf, len);
+        }
+
+        len = 0;
+    };
+
+    while (true) {
+        log_ring *oldest{};
+        const log_ring::header *oldest_hdr{};
+
+        auto rings = std::min(g_num_rings.load(), MAX_RINGS);
+
+        for (std::size_t i = 0; i < rings; i++) {
+            if (auto ring = g_rings[i].load(); ring != nullptr) {
+                if (auto hdr = ring->peek(); hdr != nullptr) {
+                    if (oldest_hdr == nullptr || hdr->timestamp < oldest_hdr->timestamp) {
+                        oldest = ring;
+                        oldest_hdr = hdr;
+                    }
+                }
+            }
+        }
+
+        if (oldest == nullptr) {
+            break;
+        }
+
+        if (len + oldest_hdr->len > size) {
+            flush();
+        }
+
+        memcpy(buf + len, oldest_hdr + 1, oldest_hdr->len);
+        len += oldest_hdr->len;
+
+        oldest->pop(oldest_hdr);
+        num++;
+    }
+
+    flush();
+    return num;
+}
+
+// Flushes whatever is still in the rings when the program crashes, and then
+// lets the signal take its course. If the flusher is in the middle of a
+// drain, the handler waits for it to finish (for up to 100ms, in case the
+// flusher itself is the thread that crashed). The drain lock is never given
+// back, as the process is about to exit.
+
+extern "C" void
+flush_on_crash(int sig)
+{
+    static std::array<char, MAX_LINE> buf;
+
+    if (g_async_fd != -1) {
+        g_crashing = true;
+
+        for (auto i = 0; i < 10000; i++) {
+            if (try_drain_lock()) {
+                drain(buf.data(), buf.size());
+                break;
+            }
+
+            struct timespec ts{0, 10000};
+            ::nanosleep(&ts, nullptr);
+        }
+    }
+
+    ::signal(sig, SIG_DFL);
+    ::raise(sig);
+}
+
+class log_flusher
+{
+public:
+
+    void start()
+    {
+        if (g_async_fd = ::open("log.txt", O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644); g_async_fd == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        ::signal(SIGSEGV, flush_on_crash);
+        ::signal(SIGABRT, flush_on_crash);
+
+        m_running = true;
+        m_thread = std::thread{[this]{ run(); }};
+    }
+
+    // Stops the flusher once it has written out everything that was logged
+    // before stop() was called.
+
+    void stop()
+    {
+        if (m_thread.joinable()) {
+            m_stop = true;
+            m_thread.join();
+        }
+
+        m_running = false;
+    }
+
+    bool running() const
+    { return m_running.load(std::memory_order_relaxed); }
+
+    ~log_flusher()
+    {
+        stop();
+    }
+
+private:
+
+    void run()
+    {
+        while (!m_stop) {
+            if (drain_once() == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+
+        drain_once();
+    }
+
+    std::size_t drain_once()
+    {
+        if (g_crashing || !try_drain_lock()) {
+            return 0;
+        }
+
+        auto num = drain(m_buf.data(), m_buf.size());
+        drain_unlock();
+
+        return num;
+    }
+
+    std::thread m_thread;
+    std::atomic<bool> m_stop{};
+    std::atomic<bool> m_running{};
+    std::array<char, RING_SIZE> m_buf;
+};
+
+log_flusher g_flusher;
+
+template <std::size_t LEVEL, char... Cs, typename... Args>
+void log_async(format_string<Cs...> fmt, const Args &... args) {
+    static_assert(fmt.count() == sizeof...(Args), "wrong number of log arguments");
+
+    if constexpr (!g_ndebug && (LEVEL <= g_debug_level)) {
+        if (!log_enabled<LEVEL>()) {
+            return;
+        }
+
+        auto &line = format_line(fmt, args...);
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        auto timestamp = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count());
+
+        while (!t_ring.ring->push(timestamp, line.data(), line.size())) {
+            if (!g_flusher.running()) {
+                g_async_dropped++;
+                return;
+            }
+
+            std::this_thread::yield();
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Binary Logging
+// -----------------------------------------------------------------------------
+
+// The binary log is only opened the first time BLOG() is called, so a run
+// that never logs in binary does not create log.bin. See binary_log.h for
+// how the formats are gathered and the records encoded.
+
+binary_log &
+blog()
+{
+    static binary_log log{"log.bin"};
+    return log;
+}
+
+#define BLOG(LEVEL, FMT, ...)                                                   \
+    do {                                                                        \
+        if constexpr (!g_ndebug && ((LEVEL) <= g_debug_level)) {                \
+            using types = type_string<decltype(std::make_tuple(__VA_ARGS__))>;  \
+            static const log_format format                                      \
+                __attribute__((section("log_formats"), aligned(8), used)) =     \
+                {(LEVEL), FMT, types::value};                                   \
+            if (log_enabled<(LEVEL)>()) {                                       \
+                blog().write(format, ##__VA_ARGS__);                            \
+            }                                                                   \
+        }                                                                       \
+    } while (0)
+
+#ifndef BENCHMARK
+
 int
 protected_main(int argc, char** argv)
 {
@@ -67,11 +719,389 @@ protected_main(int argc, char** argv)
         std::clog << "Hello World\n";
     });
 
+    log<0>(FMT("Hello {}\n"), "World");
+
+    BLOG(0, "Hello {}", "World");
+    BLOG(0, "argc: {}, pi: {}", argc, 3.14159);
+
+    // Level 1 is only logged once the runtime level has been raised, and
+    // only if the program was built with a DEBUG_LEVEL of at least 1.
+
+    install_log_signals();
+
+    log<1>(FMT("level: {}\n"), g_log_level.load());
+    ::raise(SIGUSR1);
+    log<1>(FMT("level: {}\n"), g_log_level.load());
+
+    // Lines logged asynchronously from several threads are merged by the
+    // flusher in timestamp order. Running "example1 crash" aborts while
+    // lines may still be pending, which the crash handler then flushes.
+
+    g_flusher.start();
+
+    std::array<std::thread, 4> threads;
+    for (std::size_t i = 0; i < threads.size(); i++) {
+        threads[i] = std::thread{[i] {
+            log_async<0>(FMT("Hello from thread {}\n"), i);
+        }};
+    }
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    if (argc > 1 && std::string_view(argv[1]) == "crash") {
+        log_async<0>(FMT("about to crash\n"));
+        ::abort();
+    }
+
+    g_flusher.stop();
+
     std::clog << "Hello World\n";
 
     return EXIT_SUCCESS;
 }
 
+#else
+
+// -----------------------------------------------------------------------------
+// Benchmark
+// -----------------------------------------------------------------------------
+
+#include <new>
+#include <mutex>
+#include <iomanip>
+#include <functional>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Every heap allocation is counted, so that the benchmark can show that the
+// fast path makes none.
+
+std::size_t g_allocations{};
+
+void *
+operator new (std::size_t size)
+{
+    g_allocations++;
+
+    if (auto ptr = malloc(size)) {
+        return ptr;
+    }
+
+    throw std::bad_alloc();
+}
+
+template<typename FUNC>
+void
+report(const char *name, std::size_t num, FUNC func)
+{
+    using namespace std::chrono;
+
+    auto allocations = g_allocations;
+    auto stime = high_resolution_clock::now();
+
+    for (std::size_t i = 0; i < num; i++) {
+        func(i);
+    }
+
+    auto etime = high_resolution_clock::now();
+    auto elapsed = duration_cast<nanoseconds>(etime - stime).count();
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << std::setw(24) << std::left << name
+              << std::setw(12) << std::right << static_cast<double>(elapsed) / static_cast<double>(num) << " ns/call"
+              << std::setw(12) << static_cast<double>(g_allocations - allocations) / static_cast<double>(num) << " allocs/call\n";
+}
+
+// Runs func num times on each of the given number of threads at once, and
+// reports the time per call across all of them. done, if given, is called
+// once every thread has finished and is included in the time, so that
+// asynchronous logging can be charged for writing out what it queued.
+
+std::mutex g_mutex;
+
+template<typename FUNC>
+void
+report_threads(const char *name, std::size_t num_threads, std::size_t num, FUNC func,
+               const std::function<void()> &done = {})
+{
+    using namespace std::chrono;
+
+    auto stime = high_resolution_clock::now();
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < num_threads; i++) {
+        threads.emplace_back([num, func] {
+            for (std::size_t j = 0; j < num; j++) {
+                func(j);
+            }
+        });
+    }
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    if (done) {
+        done();
+    }
+
+    auto etime = high_resolution_clock::now();
+    auto elapsed = duration_cast<nanoseconds>(etime - stime).count();
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << std::setw(24) << std::left << name
+              << std::setw(12) << std::right << static_cast<double>(elapsed) / static_cast<double>(num * num_threads) << " ns/call\n";
+}
+
+int
+protected_main(int argc, char** argv)
+{
+    std::size_t num = argc > 1 ? std::stoul(argv[1]) : 1000000;
+
+    // Enabled logs still write to std::clog, which is sent to /dev/null so
+    // that the terminal does not become the bottleneck. The benchmark's own
+    // output goes to std::cout.
+
+    if (auto fd = ::open("/dev/null", O_WRONLY); fd != -1) {
+        ::dup2(fd, STDERR_FILENO);
+        ::close(fd);
+    }
+
+    report("stringstream (enabled)", num, [](std::size_t i) {
+        log<0>([]{ std::clog << "Hello World from the benchmark\n"; });
+        (void) i;
+    });
+
+    report("fast (enabled)", num, [](std::size_t i) {
+        log<0>(FMT("Hello World from the benchmark {}\n"), i);
+    });
+
+    report("binary (enabled)", num, [](std::size_t i) {
+        BLOG(0, "Hello World from the benchmark {}", i);
+    });
+
+    report("stringstream (disabled)", num, [](std::size_t i) {
+        log<g_debug_level + 1>([]{ std::clog << "Hello World from the benchmark\n"; });
+        (void) i;
+    });
+
+    report("fast (disabled)", num, [](std::size_t i) {
+        log<g_debug_level + 1>(FMT("Hello World from the benchmark {}\n"), i);
+    });
+
+    // Levels that are compiled in, but disabled at run time, are only
+    // available when the benchmark is built with a DEBUG_LEVEL above 0.
+
+    if constexpr (g_debug_level > 0) {
+        g_log_level = 0;
+
+        report("stringstream (runtime)", num, [](std::size_t i) {
+            log<1>([]{ std::clog << "Hello World from the benchmark\n"; });
+            (void) i;
+        });
+
+        report("fast (runtime)", num, [](std::size_t i) {
+            log<1>(FMT("Hello World from the benchmark {}\n"), i);
+        });
+
+        report("binary (runtime)", num, [](std::size_t i) {
+            BLOG(1, "Hello World from the benchmark {}", i);
+        });
+    }
+
+    report_threads("mutex (32 threads)", 32, num / 32, [](std::size_t i) {
+        std::lock_guard lock(g_mutex);
+        log<0>(FMT("Hello World from the benchmark {}\n"), i);
+    });
+
+    // The flusher is stopped inside the timed region, which waits for it to
+    // write out every queued line, so the rings are compared with the mutex
+    // on the same amount of work rather than on enqueueing alone.
+
+    g_flusher.start();
+
+    report_threads("rings (32 threads)", 32, num / 32, [](std::size_t i) {
+        log_async<0>(FMT("Hello World from the benchmark {}\n"), i);
+    }, []{ g_flusher.stop(); });
+
+    return EXIT_SUCCESS;
+}
+
+#endif
+
+#else
+
+// -----------------------------------------------------------------------------
+// Decoder
+// -----------------------------------------------------------------------------
+
+#include <ctime>
+#include <iomanip>
+
+struct format
+{
+    uint32_t level;
+    std::string fmt;
+    std::string types;
+};
+
+// Reads a value from a record's payload, throwing if the record is too short
+// to hold it.
+
+class reader
+{
+public:
+
+    explicit reader(const std::string &buf) :
+        m_buf{buf}
+    { }
+
+    template<typename T>
+    T get()
+    {
+        T val;
+        memcpy(&val, take(sizeof(val)), sizeof(val));
+
+        return val;
+    }
+
+    std::string_view get_string()
+    {
+        auto len = get<uint32_t>();
+        return {take(len), len};
+    }
+
+private:
+
+    const char *take(std::size_t len)
+    {
+        if (len > m_buf.size() - m_pos) {
+            throw std::runtime_error("truncated record");
+        }
+
+        auto ptr = m_buf.data() + m_pos;
+        m_pos += len;
+
+        return ptr;
+    }
+
+    const std::string &m_buf;
+    std::size_t m_pos{};
+};
+
+std::vector<format>
+decode_dictionary(const std::string &payload)
+{
+    reader r{payload};
+    std::vector<format> formats;
+
+    for (std::size_t left = payload.size(); left != 0;) {
+        format f;
+
+        f.level = r.get<uint32_t>();
+        f.fmt = r.get_string();
+        f.types = r.get_string();
+
+        left -= sizeof(uint32_t) * 3 + f.fmt.size() + f.types.size();
+        formats.push_back(std::move(f));
+    }
+
+    return formats;
+}
+
+void
+decode_record(const format &f, const record_header &hdr, const std::string &payload)
+{
+    reader r{payload};
+    std::stringstream args;
+
+    auto secs = static_cast<time_t>(hdr.timestamp / 1000000000);
+    auto nsecs = hdr.timestamp % 1000000000;
+
+    struct tm tm{};
+    localtime_r(&secs, &tm);
+
+    std::cout << std::put_time(&tm, "%F %T") << '.'
+              << std::setw(9) << std::setfill('0') << nsecs << ' ';
+
+    std::cout << "\033[1;32mDEBUG\033[0m: ";
+
+    std::size_t pos = 0;
+    for (auto type : f.types) {
+        auto next = f.fmt.find("{}", pos);
+        if (next == std::string::npos) {
+            break;
+        }
+
+        std::cout << std::string_view(f.fmt).substr(pos, next - pos);
+        pos = next + 2;
+
+        switch (type) {
+            case 'i': std::cout << r.get<int64_t>(); break;
+            case 'u': std::cout << r.get<uint64_t>(); break;
+            case 'd': std::cout << r.get<double>(); break;
+            case 'c': std::cout << r.get<char>(); break;
+            case 'b': std::cout << std::boolalpha << r.get<bool>(); break;
+            case 's': std::cout << r.get_string(); break;
+
+            default:
+                throw std::runtime_error("unknown argument type");
+        }
+    }
+
+    std::cout << std::string_view(f.fmt).substr(pos) << '\n';
+}
+
+int
+protected_main(int argc, char** argv)
+{
+    // usage: example1_decoder [file] [max level]
+
+    auto path = argc > 1 ? argv[1] : "log.bin";
+    auto max_level = argc > 2 ? std::stoul(argv[2]) : ~0UL;
+
+    std::fstream file{path, std::ios::in | std::ios::binary};
+    if (!file) {
+        throw std::runtime_error(std::string("unable to open ") + path);
+    }
+
+    std::vector<format> formats;
+
+    record_header hdr;
+    std::string payload;
+
+    while (file.read(reinterpret_cast<char *>(&hdr), sizeof(hdr))) {
+        payload.resize(hdr.size);
+
+        if (!file.read(payload.data(), hdr.size)) {
+            throw std::runtime_error("truncated record");
+        }
+
+        // Each run of a program starts with its own dictionary, as the
+        // format IDs can change whenever the program is rebuilt.
+
+        if (hdr.id == DICTIONARY_ID) {
+            formats = decode_dictionary(payload);
+            continue;
+        }
+
+        if (hdr.id >= formats.size()) {
+            throw std::runtime_error("unknown format ID");
+        }
+
+        if (formats[hdr.id].level <= max_level) {
+            decode_record(formats[hdr.id], hdr, payload);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+#endif
+
 int
 main(int argc, char** argv)
 {
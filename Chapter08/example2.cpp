@@ -19,20 +19,471 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <string.h>
 
+#include <array>
+#include <string>
+#include <vector>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <optional>
+#include <algorithm>
+#include <string_view>
+#include <unordered_map>
 
 #include <gsl/gsl>
 using namespace gsl;
 
-constexpr auto mode = std::ios::in | std::ios::ate;
+#include "line_reader.h"
+
+#define BUF_SIZE 0x10000
+
+// -----------------------------------------------------------------------------
+// Followed Files
+// -----------------------------------------------------------------------------
+
+// A followed file is read in large chunks with a line_reader, and only
+// whole lines are handed on; anything after the last newline is kept until
+// the rest of the line arrives. The file is identified by its device and
+// inode, so that a new file showing up under the same name (log rotation)
+// can be told apart from the one currently open.
+
+class follower
+{
+public:
+
+    explicit follower(std::string path) :
+        m_path{std::move(path)}
+    {
+        auto pos = m_path.rfind('/');
+
+        m_dir = pos == std::string::npos ? "." : m_path.substr(0, pos + 1);
+        m_name = pos == std::string::npos ? m_path : m_path.substr(pos + 1);
+    }
+
+    ~follower()
+    { close(); }
+
+    follower(follower &&) = delete;
+    follower &operator=(follower &&) = delete;
+
+    bool open(bool from_end)
+    {
+        if (m_fd = ::open(m_path.c_str(), O_RDONLY | O_CLOEXEC); m_fd == -1) {
+            if (errno == ENOENT) {
+                return false;
+            }
+
+            throw std::runtime_error(strerror(errno));
+        }
+
+        struct stat st{};
+        if (fstat(m_fd, &st) == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        m_dev = st.st_dev;
+        m_ino = st.st_ino;
+        m_reader.emplace(m_fd, BUF_SIZE);
+
+        if (lseek(m_fd, from_end ? st.st_size : 0, SEEK_SET) == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        return true;
+    }
+
+    void close()
+    {
+        if (m_fd != -1) {
+            ::close(m_fd);
+            m_fd = -1;
+        }
+    }
+
+    // Returns true when the path no longer names the file that is open,
+    // either because it was removed or because something else replaced it.
+
+    bool rotated() const
+    {
+        struct stat st{};
+        if (stat(m_path.c_str(), &st) == -1) {
+            return true;
+        }
+
+        return st.st_dev != m_dev || st.st_ino != m_ino;
+    }
+
+    template<typename FUNC>
+    void read(FUNC func)
+    {
+        if (m_fd == -1) {
+            return;
+        }
+
+        struct stat st{};
+        if (fstat(m_fd, &st) == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        if (st.st_size < lseek(m_fd, 0, SEEK_CUR)) {
+            std::cerr << m_path << ": file truncated\n";
+
+            lseek(m_fd, 0, SEEK_SET);
+            m_reader->reset();
+        }
+
+        for (std::string_view line; m_reader->next(line);) {
+            func(*this, line);
+        }
+    }
+
+    const std::string &path() const
+    { return m_path; }
+
+    const std::string &dir() const
+    { return m_dir; }
+
+    const std::string &name() const
+    { return m_name; }
+
+    bool is_open() const
+    { return m_fd != -1; }
+
+    int fd() const
+    { return m_fd; }
+
+private:
+
+    std::string m_path;
+    std::string m_dir;
+    std::string m_name;
+
+    int m_fd{-1};
+    dev_t m_dev{};
+    ino_t m_ino{};
+
+    std::optional<line_reader> m_reader;
+};
+
+// -----------------------------------------------------------------------------
+// Tail
+// -----------------------------------------------------------------------------
+
+// Every followed file gets an inotify watch on the open file itself, so
+// that writes wake the tail up right away instead of on the next poll, and
+// a watch on its directory, so that a rotated file is picked up as soon as
+// it is created or moved into place. Since a watch follows the inode and
+// not the name, a file that is renamed away is drained to the end before
+// the tail switches over to the new file.
+
+constexpr auto file_events = IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF;
+constexpr auto dir_events = IN_CREATE | IN_MOVED_TO;
+
+class tail
+{
+public:
+
+    tail()
+    {
+        if (m_fd = inotify_init1(IN_CLOEXEC); m_fd == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+    }
+
+    ~tail()
+    {
+        ::close(m_fd);
+    }
+
+    void add(const std::string &path)
+    {
+        auto &f = m_followers.emplace_back(std::make_unique<follower>(path));
+
+        if (!m_dirs.count(f->dir())) {
+            auto wd = inotify_add_watch(m_fd, f->dir().c_str(), dir_events);
+            if (wd == -1) {
+                throw std::runtime_error(strerror(errno));
+            }
+
+            m_dirs[f->dir()] = wd;
+            m_wds[wd] = nullptr;
+        }
+
+        if (!f->open(true)) {
+            std::cerr << path << ": waiting for file to appear\n";
+            return;
+        }
+
+        watch(*f);
+    }
+
+    template<typename FUNC>
+    void run(FUNC func)
+    {
+        alignas(struct inotify_event) std::array<char, BUF_SIZE> buf;
+
+        m_running = true;
+        while (m_running) {
+            auto bytes = ::read(m_fd, buf.data(), buf.size());
+            if (bytes == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                throw std::runtime_error(strerror(errno));
+            }
+
+            for (auto ptr = buf.data(); ptr < buf.data() + bytes; ) {
+                auto event = reinterpret_cast<struct inotify_event *>(ptr);
+                ptr += sizeof(struct inotify_event) + event->len;
+
+                auto iter = m_wds.find(event->wd);
+                if (iter == m_wds.end()) {
+                    continue;
+                }
+
+                if (auto f = iter->second) {
+                    file_event(*f, event->mask, func);
+                }
+                else if (event->len != 0) {
+                    dir_event(event->wd, event->name, func);
+                }
+            }
+        }
+    }
+
+    void stop()
+    { m_running = false; }
+
+private:
+
+    void watch(follower &f)
+    {
+        auto wd = inotify_add_watch(m_fd, f.path().c_str(), file_events);
+        if (wd == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        m_wds[wd] = &f;
+    }
+
+    void unwatch(follower &f)
+    {
+        for (auto iter = m_wds.begin(); iter != m_wds.end(); ++iter) {
+            if (iter->second == &f) {
+                inotify_rm_watch(m_fd, iter->first);
+                m_wds.erase(iter);
+                break;
+            }
+        }
+    }
+
+    template<typename FUNC>
+    void reopen(follower &f, FUNC &func)
+    {
+        f.read(func);
+
+        unwatch(f);
+        f.close();
+
+        if (f.open(false)) {
+            std::cerr << f.path() << ": following new file\n";
+
+            watch(f);
+            f.read(func);
+        }
+    }
+
+    template<typename FUNC>
+    void file_event(follower &f, uint32_t mask, FUNC &func)
+    {
+        if (mask & IN_IGNORED) {
+            return;
+        }
+
+        f.read(func);
+
+        if ((mask & (IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)) && f.rotated()) {
+            reopen(f, func);
+        }
+    }
+
+    template<typename FUNC>
+    void dir_event(int wd, const char *name, FUNC &func)
+    {
+        for (const auto &f : m_followers) {
+            if (m_dirs[f->dir()] != wd || f->name() != name) {
+                continue;
+            }
+
+            if (!f->is_open() || f->rotated()) {
+                reopen(*f, func);
+            }
+        }
+    }
+
+private:
+
+    int m_fd{-1};
+    bool m_running{};
+
+    std::vector<std::unique_ptr<follower>> m_followers;
+    std::unordered_map<std::string, int> m_dirs;
+    std::unordered_map<int, follower *> m_wds;
+};
+
+#ifndef BENCHMARK
+
+// -----------------------------------------------------------------------------
+// Main
+// -----------------------------------------------------------------------------
+
+int
+protected_main(int argc, char **argv)
+{
+    tail t;
+    auto args = make_span(argv, argc);
+
+    if (args.size() < 2) {
+        std::string filename;
+        std::cin >> filename;
+
+        t.add(filename);
+    }
+    else {
+        for (const auto &arg : args.subspan(1)) {
+            t.add(ensure_z(arg).data());
+        }
+    }
+
+    const follower *last = nullptr;
+    auto headers = args.size() > 2;
+
+    t.run([&](const follower &f, std::string_view line) {
+        if (headers && last != &f) {
+            std::cout << (last ? "\n" : "") << "==> " << f.path() << " <==\n";
+            last = &f;
+        }
+
+        std::cout << line << std::endl;
+    });
+
+    return EXIT_SUCCESS;
+}
+
+#else
 
-[[noreturn]] void
-tail(std::fstream &file)
+// -----------------------------------------------------------------------------
+// Benchmark
+// -----------------------------------------------------------------------------
+
+#include <chrono>
+#include <random>
+#include <thread>
+#include <numeric>
+#include <iomanip>
+
+// A writer thread appends lines carrying the time they were written at
+// random intervals, and the tail reports how long each one took to show up.
+// The polling tail is the fstream/sleep(1) loop this example used before.
+
+#define FILENAME "example2_benchmark.txt"
+
+uint64_t
+now()
+{
+    using namespace std::chrono;
+    return static_cast<uint64_t>(
+        duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count()
+    );
+}
+
+std::thread
+writer(std::size_t num)
+{
+    return std::thread{[num] {
+        std::mt19937 gen{42};
+        std::uniform_int_distribution<int> dist{10, 100};
+
+        auto fd = ::open(FILENAME, O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd == -1) {
+            std::cerr << "failed to open " FILENAME "\n";
+            return;
+        }
+
+        for (std::size_t i = 0; i < num; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(dist(gen)));
+
+            auto line = std::to_string(now()) + '\n';
+            if (::write(fd, line.data(), line.size()) == -1) {
+                std::cerr << "failed to write " FILENAME "\n";
+            }
+        }
+
+        ::close(fd);
+    }};
+}
+
+void
+record(std::vector<uint64_t> &latencies, std::string_view line)
+{
+    latencies.push_back(now() - std::stoull(std::string(line)));
+}
+
+void
+report(const char *name, std::vector<uint64_t> &latencies)
+{
+    std::sort(latencies.begin(), latencies.end());
+
+    auto avg = std::accumulate(latencies.begin(), latencies.end(), uint64_t{}) / latencies.size();
+    auto p99 = latencies[latencies.size() * 99 / 100];
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << std::setw(12) << std::left << name
+              << std::setw(12) << std::right << static_cast<double>(latencies.front()) / 1000.0 << " us min"
+              << std::setw(12) << static_cast<double>(avg) / 1000.0 << " us avg"
+              << std::setw(12) << static_cast<double>(p99) / 1000.0 << " us p99"
+              << std::setw(12) << static_cast<double>(latencies.back()) / 1000.0 << " us max\n";
+}
+
+void
+benchmark_inotify(std::size_t num)
 {
-    while (true) {
+    std::ofstream{FILENAME, std::ios::trunc};
+    std::vector<uint64_t> latencies;
+
+    tail t;
+    t.add(FILENAME);
+
+    auto w = writer(num);
+    t.run([&](const follower &, std::string_view line) {
+        record(latencies, line);
+        if (latencies.size() == num) {
+            t.stop();
+        }
+    });
+
+    w.join();
+    report("inotify", latencies);
+}
+
+void
+benchmark_poll(std::size_t num)
+{
+    std::ofstream{FILENAME, std::ios::trunc};
+    std::vector<uint64_t> latencies;
+
+    auto w = writer(num);
+    auto file = std::fstream(FILENAME, std::ios::in | std::ios::ate);
+
+    while (latencies.size() < num) {
         file.peek();
         while(!file.eof()) {
             auto pos = file.tellg();
@@ -45,36 +496,36 @@ tail(std::fstream &file)
                 break;
             }
 
-            std::cout << buf << '\n';
+            record(latencies, buf);
         }
 
-        sleep(1);
+        if (latencies.size() < num) {
+            sleep(1);
+        }
 
         file.clear();
         file.sync();
     }
+
+    w.join();
+    report("sleep(1)", latencies);
 }
 
 int
 protected_main(int argc, char **argv)
 {
-    std::string filename;
     auto args = make_span(argv, argc);
+    std::size_t num = args.size() > 1 ? std::stoul(ensure_z(args[1]).data()) : 50;
 
-    if (args.size() < 2) {
-        std::cin >> filename;
-    }
-    else {
-        filename = ensure_z(args[1]).data();
-    }
+    benchmark_inotify(num);
+    benchmark_poll(num);
 
-    if (auto file = std::fstream(filename, mode)) {
-        tail(file);
-    }
-
-    throw std::runtime_error("failed to open file");
+    ::unlink(FILENAME);
+    return EXIT_SUCCESS;
 }
 
+#endif
+
 int
 main(int argc, char **argv)
 {
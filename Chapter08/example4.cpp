@@ -0,0 +1,324 @@
+//
+// Copyright (C) 2018 Rian Quinn <rianquinn@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "line_reader.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+
+#include <gsl/gsl>
+using namespace gsl;
+
+// -----------------------------------------------------------------------------
+// Tests
+// -----------------------------------------------------------------------------
+
+#ifdef TEST
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+
+#define FILENAME "example4_test.txt"
+
+class test_file
+{
+public:
+
+    test_file()
+    {
+        m_writer = ::open(FILENAME, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        m_reader = ::open(FILENAME, O_RDONLY);
+    }
+
+    ~test_file()
+    {
+        ::close(m_writer);
+        ::close(m_reader);
+        ::unlink(FILENAME);
+    }
+
+    void write(const std::string &str)
+    { CHECK(::write(m_writer, str.data(), str.size()) == static_cast<ssize_t>(str.size())); }
+
+    int fd() const
+    { return m_reader; }
+
+private:
+
+    int m_writer;
+    int m_reader;
+};
+
+std::vector<std::string>
+read_all(line_reader &reader)
+{
+    std::vector<std::string> lines;
+
+    for (auto line : reader) {
+        lines.emplace_back(line);
+    }
+
+    return lines;
+}
+
+TEST_CASE("newline mask")
+{
+    std::string str(64, 'x');
+
+    CHECK(newline_mask(str.data()) == 0);
+
+    for (std::size_t i = 0; i < str.size(); i++) {
+        str[i] = '\n';
+        CHECK(newline_mask(str.data()) == uint64_t{1} << i);
+        str[i] = 'x';
+    }
+
+    str = std::string(64, '\n');
+    CHECK(newline_mask(str.data()) == ~uint64_t{});
+}
+
+TEST_CASE("lines")
+{
+    test_file file;
+    file.write("Hello\n\nWorld\nno newline");
+
+    line_reader reader{file.fd()};
+    CHECK(read_all(reader) == std::vector<std::string>{"Hello", "", "World", "no newline"});
+}
+
+TEST_CASE("lines straddle the buffer")
+{
+    test_file file;
+    std::vector<std::string> expected;
+
+    for (std::size_t i = 0; i < 100; i++) {
+        expected.emplace_back(i % 13, static_cast<char>('a' + i % 26));
+        file.write(expected.back() + '\n');
+    }
+
+    line_reader reader{file.fd(), 16};
+    CHECK(read_all(reader) == expected);
+}
+
+TEST_CASE("lines longer than the buffer")
+{
+    test_file file;
+    std::vector<std::string> expected{std::string(100, 'a'), "b", std::string(1000, 'c')};
+
+    for (const auto &line : expected) {
+        file.write(line + '\n');
+    }
+
+    line_reader reader{file.fd(), 8};
+    CHECK(read_all(reader) == expected);
+}
+
+TEST_CASE("partial lines wait for more data")
+{
+    test_file file;
+    line_reader reader{file.fd(), 8};
+
+    std::string_view line;
+    CHECK(!reader.next(line));
+
+    file.write("Hello W");
+    CHECK(!reader.next(line));
+
+    file.write("orld\nmore");
+    CHECK(reader.next(line));
+    CHECK(line == "Hello World");
+    CHECK(!reader.next(line));
+
+    file.write("\n");
+    CHECK(reader.next(line));
+    CHECK(line == "more");
+    CHECK(!reader.next(line));
+    CHECK(reader.partial().empty());
+}
+
+#endif
+
+// -----------------------------------------------------------------------------
+// Benchmark
+// -----------------------------------------------------------------------------
+
+#ifdef BENCHMARK
+
+#include <chrono>
+#include <random>
+#include <iomanip>
+
+// Splits a log file into lines with std::getline() and with a line_reader.
+// If no file is given, one of the given size in MB (2GB by default) is
+// generated first, with lines of varying length that look like log output.
+// The file will usually still be in the page cache when it is read, so this
+// measures the splitting and not the disk.
+
+#define FILENAME "example4_benchmark.txt"
+
+void
+generate(std::size_t size)
+{
+    std::mt19937 gen{42};
+    std::uniform_int_distribution<std::size_t> dist{0, 160};
+
+    std::ofstream file{FILENAME, std::ios::trunc | std::ios::binary};
+    std::string msg(256, 'x');
+
+    for (std::size_t bytes = 0, i = 0; bytes < size; i++) {
+        auto line = "[2018-01-01 00:00:00] DEBUG: request " + std::to_string(i) + ": " + msg.substr(0, dist(gen)) + '\n';
+
+        file << line;
+        bytes += line.size();
+    }
+}
+
+template<typename FUNC>
+void
+report(const char *name, const char *filename, FUNC func)
+{
+    using namespace std::chrono;
+
+    std::size_t lines{};
+    std::size_t bytes{};
+
+    auto stime = high_resolution_clock::now();
+    func(filename, lines, bytes);
+    auto etime = high_resolution_clock::now();
+
+    auto elapsed = duration_cast<nanoseconds>(etime - stime).count();
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << std::setw(16) << std::left << name
+              << std::setw(12) << std::right << static_cast<double>(bytes) / static_cast<double>(elapsed) << " GB/s"
+              << std::setw(12) << static_cast<double>(elapsed) / static_cast<double>(lines) << " ns/line"
+              << std::setw(14) << lines << " lines\n";
+}
+
+int
+protected_main(int argc, char **argv)
+{
+    auto args = make_span(argv, argc);
+
+    const char *filename = FILENAME;
+    if (args.size() > 1) {
+        filename = ensure_z(args[1]).data();
+    }
+    else {
+        generate(std::size_t{2048} << 20);
+    }
+
+    report("getline", filename, [](const char *filename, auto &lines, auto &bytes) {
+        std::fstream file{filename, std::ios::in};
+
+        for (std::string line; std::getline(file, line);) {
+            lines++;
+            bytes += line.size() + 1;
+        }
+    });
+
+    report("line_reader", filename, [](const char *filename, auto &lines, auto &bytes) {
+        auto fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        line_reader reader{fd};
+
+        for (auto line : reader) {
+            lines++;
+            bytes += line.size() + 1;
+        }
+
+        ::close(fd);
+    });
+
+    if (args.size() == 1) {
+        ::unlink(FILENAME);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// -----------------------------------------------------------------------------
+// Line Count
+// -----------------------------------------------------------------------------
+
+#elif !defined(TEST)
+
+// Counts the lines in a file (or stdin) and reports the longest one.
+
+int
+protected_main(int argc, char **argv)
+{
+    auto args = make_span(argv, argc);
+
+    auto fd = STDIN_FILENO;
+    if (args.size() > 1) {
+        if (fd = ::open(ensure_z(args[1]).data(), O_RDONLY | O_CLOEXEC); fd == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+    }
+
+    std::size_t lines{};
+    std::size_t longest{};
+
+    line_reader reader{fd};
+
+    for (auto line : reader) {
+        lines++;
+        longest = std::max(longest, line.size());
+    }
+
+    std::cout << "lines: " << lines << '\n';
+    std::cout << "longest: " << longest << '\n';
+
+    return EXIT_SUCCESS;
+}
+
+#endif
+
+#ifndef TEST
+
+int
+main(int argc, char **argv)
+{
+    try {
+        return protected_main(argc, argv);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Caught unhandled exception:\n";
+        std::cerr << " - what(): " << e.what() << '\n';
+    }
+    catch (...) {
+        std::cerr << "Caught unknown exception\n";
+    }
+
+    return EXIT_FAILURE;
+}
+
+#endif
@@ -0,0 +1,299 @@
+//
+// Copyright (C) 2018 Rian Quinn <rianquinn@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <string>
+#include <fstream>
+#include <iostream>
+
+#include <gsl/gsl>
+using namespace gsl;
+
+// -----------------------------------------------------------------------------
+// Tests
+// -----------------------------------------------------------------------------
+
+#ifdef TEST
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+
+#define FILENAME "example5_test.txt"
+
+void
+append(const std::string &str)
+{
+    std::fstream{FILENAME, std::ios::out | std::ios::app} << str;
+}
+
+TEST_CASE("maps the whole file")
+{
+    std::fstream{FILENAME, std::ios::out | std::ios::trunc} << "Hello World\n";
+    mapped_file file{FILENAME};
+
+    CHECK(file.size() == 12);
+    CHECK(file.view() == "Hello World\n");
+    CHECK(file.span().size() == 12);
+    CHECK(file.span()[0] == std::byte{'H'});
+
+    ::unlink(FILENAME);
+}
+
+TEST_CASE("empty file")
+{
+    std::fstream{FILENAME, std::ios::out | std::ios::trunc};
+    mapped_file file{FILENAME};
+
+    CHECK(file.empty());
+    CHECK(file.data() == nullptr);
+    CHECK(!file.refresh());
+
+    append("Hello");
+    CHECK(file.refresh());
+    CHECK(file.view() == "Hello");
+
+    ::unlink(FILENAME);
+}
+
+TEST_CASE("grows when appended to")
+{
+    std::fstream{FILENAME, std::ios::out | std::ios::trunc} << "Hello";
+
+    for (auto huge_pages : {false, true}) {
+        mapped_file file{FILENAME, access_hint::sequential, huge_pages};
+        auto expected = std::string(file.view());
+
+        for (auto i = 0; i < 3; i++) {
+            auto str = std::string(0x3000 * static_cast<std::size_t>(i + 1), static_cast<char>('a' + i));
+
+            append(str);
+            expected += str;
+
+            CHECK(file.refresh());
+            CHECK(file.view() == expected);
+            CHECK(!file.refresh());
+        }
+    }
+
+    ::unlink(FILENAME);
+}
+
+TEST_CASE("huge page alignment")
+{
+    std::fstream{FILENAME, std::ios::out | std::ios::trunc} << std::string(0x5000, 'x');
+
+    mapped_file file{FILENAME, access_hint::random, true};
+
+    CHECK(reinterpret_cast<uintptr_t>(file.data()) % HUGE_PAGE_SIZE == 0);
+    CHECK(std::count(file.view().begin(), file.view().end(), 'x') == 0x5000);
+
+    ::unlink(FILENAME);
+}
+
+TEST_CASE("move")
+{
+    std::fstream{FILENAME, std::ios::out | std::ios::trunc} << "Hello World";
+
+    mapped_file file1{FILENAME};
+    mapped_file file2{std::move(file1)};
+
+    CHECK(file1.empty());
+    CHECK(file2.view() == "Hello World");
+
+    file1 = std::move(file2);
+    CHECK(file1.view() == "Hello World");
+
+    ::unlink(FILENAME);
+}
+
+TEST_CASE("closes the file if it cannot be mapped")
+{
+    // A directory can be opened, but not mapped. The lowest free descriptor
+    // is reused by the next open(), so it shows whether one was leaked.
+
+    auto fd = ::open("/dev/null", O_RDONLY);
+    ::close(fd);
+
+    CHECK_THROWS(mapped_file{"."});
+
+    auto next = ::open("/dev/null", O_RDONLY);
+    CHECK(next == fd);
+    ::close(next);
+}
+
+#endif
+
+// -----------------------------------------------------------------------------
+// Benchmark
+// -----------------------------------------------------------------------------
+
+#ifdef BENCHMARK
+
+#include <chrono>
+#include <iomanip>
+
+// Re-reads the same file a number of times, the way a tool that scans a log
+// more than once would, counting its lines on each pass. With an fstream,
+// each pass allocates a buffer the size of the file and copies the file
+// into it; with a mapped_file, each pass reads the page cache directly. The
+// first pass of each is not timed, so that all of them start out with the
+// file in the page cache (and the reused mapping with its pages mapped).
+
+#define FILENAME "example5_benchmark.txt"
+
+template<typename FUNC>
+void
+report(const char *name, std::size_t size, std::size_t passes, FUNC func)
+{
+    using namespace std::chrono;
+
+    std::size_t lines = func();
+
+    auto stime = high_resolution_clock::now();
+    for (std::size_t i = 0; i < passes; i++) {
+        lines += func();
+    }
+    auto etime = high_resolution_clock::now();
+
+    auto elapsed = duration_cast<nanoseconds>(etime - stime).count();
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << std::setw(24) << std::left << name
+              << std::setw(12) << std::right << static_cast<double>(size * passes) / static_cast<double>(elapsed) << " GB/s"
+              << std::setw(14) << lines / (passes + 1) << " lines\n";
+}
+
+std::size_t
+count_lines(std::string_view str)
+{
+    return static_cast<std::size_t>(std::count(str.begin(), str.end(), '\n'));
+}
+
+int
+protected_main(int argc, char **argv)
+{
+    auto args = make_span(argv, argc);
+
+    std::size_t size = args.size() > 1 ? std::stoul(ensure_z(args[1]).data()) << 20 : std::size_t{1024} << 20;
+    std::size_t passes = args.size() > 2 ? std::stoul(ensure_z(args[2]).data()) : 5;
+
+    {
+        std::fstream file{FILENAME, std::ios::out | std::ios::trunc};
+        std::string line = "[2018-01-01 00:00:00] DEBUG: " + std::string(98, 'x') + '\n';
+
+        for (std::size_t bytes = 0; bytes < size; bytes += line.size()) {
+            file << line;
+        }
+    }
+
+    size = mapped_file{FILENAME}.size();
+
+    report("fstream (per pass)", size, passes, [] {
+        std::fstream file{FILENAME, std::ios::in | std::ios::ate};
+
+        std::string buf(static_cast<std::size_t>(file.tellg()), '\0');
+        file.seekg(0);
+        file.read(buf.data(), static_cast<std::streamsize>(buf.size()));
+
+        return count_lines(buf);
+    });
+
+    mapped_file file{FILENAME, access_hint::willneed};
+
+    report("mapped_file (reused)", size, passes, [&file] {
+        file.refresh();
+        return count_lines(file.view());
+    });
+
+    report("mapped_file (per pass)", size, passes, [] {
+        mapped_file mapped{FILENAME, access_hint::sequential};
+        return count_lines(mapped.view());
+    });
+
+    ::unlink(FILENAME);
+    return EXIT_SUCCESS;
+}
+
+// -----------------------------------------------------------------------------
+// Count Matches
+// -----------------------------------------------------------------------------
+
+#elif !defined(TEST)
+
+// Counts the lines of a file that contain a pattern ("ERROR" by default),
+// searching the mapping directly.
+
+int
+protected_main(int argc, char **argv)
+{
+    auto args = make_span(argv, argc);
+
+    if (args.size() < 2) {
+        std::cerr << "usage: example5 <file> [pattern]\n";
+        return EXIT_FAILURE;
+    }
+
+    std::string_view pattern = "ERROR";
+    if (args.size() > 2) {
+        pattern = ensure_z(args[2]).data();
+    }
+
+    mapped_file file{ensure_z(args[1]).data(), access_hint::sequential};
+    auto view = file.view();
+
+    std::size_t matches{};
+    for (std::size_t pos = 0; (pos = view.find(pattern, pos)) != std::string_view::npos;) {
+        matches++;
+
+        if (pos = view.find('\n', pos); pos == std::string_view::npos) {
+            break;
+        }
+    }
+
+    std::cout << "matches: " << matches << '\n';
+    return EXIT_SUCCESS;
+}
+
+#endif
+
+#ifndef TEST
+
+int
+main(int argc, char **argv)
+{
+    try {
+        return protected_main(argc, argv);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Caught unhandled exception:\n";
+        std::cerr << " - what(): " << e.what() << '\n';
+    }
+    catch (...) {
+        std::cerr << "Caught unknown exception\n";
+    }
+
+    return EXIT_FAILURE;
+}
+
+#endif
@@ -0,0 +1,412 @@
+//
+// Copyright (C) 2018 Rian Quinn <rianquinn@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "async_file.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include <gsl/gsl>
+using namespace gsl;
+
+#define IO_SIZE 0x1000
+
+// -----------------------------------------------------------------------------
+// Tests
+// -----------------------------------------------------------------------------
+
+#ifdef TEST
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+
+#define FILENAME "example6_test.txt"
+
+const auto backends = {async_file::backend::uring, async_file::backend::threads};
+
+TEST_CASE("write, sync and read back")
+{
+    for (auto type : backends) {
+        async_file file{FILENAME, O_RDWR | O_CREAT | O_TRUNC, 0644, 4, type};
+
+        CHECK(file.fallocate(0, 0, IO_SIZE).get() == 0);
+        CHECK(file.write_at("Hello World", 11, 0).get() == 11);
+        CHECK(file.fsync().get() == 0);
+        CHECK(file.fsync(true).get() == 0);
+
+        char buf[12] = {};
+        CHECK(file.read_at(buf, 11, 0).get() == 11);
+        CHECK(std::string(buf) == "Hello World");
+    }
+
+    ::unlink(FILENAME);
+}
+
+TEST_CASE("errors")
+{
+    for (auto type : backends) {
+        async_file file{FILENAME, O_RDONLY | O_CREAT | O_TRUNC, 0644, 4, type};
+
+        char buf[12] = {};
+        CHECK_THROWS(file.write_at(buf, sizeof(buf), 0).get());
+
+        file.write_at(buf, sizeof(buf), 0, [](int res) {
+            CHECK(res == -EBADF);
+        });
+    }
+
+    ::unlink(FILENAME);
+}
+
+TEST_CASE("callbacks keep the queue full")
+{
+    std::vector<char> data(IO_SIZE * 64);
+    for (std::size_t i = 0; i < data.size(); i++) {
+        data[i] = static_cast<char>(i / IO_SIZE);
+    }
+
+    for (auto type : backends) {
+        std::vector<char> buf(data.size());
+        std::atomic<std::size_t> next{};
+        std::atomic<std::size_t> bad{};
+
+        // The callbacks use read, so it has to outlive the file, whose
+        // destructor waits for the last of them.
+
+        std::function<void(std::size_t)> read;
+
+        {
+            async_file file{FILENAME, O_RDWR | O_CREAT | O_TRUNC, 0644, 8, type};
+            file.write_at(data.data(), data.size(), 0).get();
+
+            read = [&](std::size_t block) {
+                auto offset = block * IO_SIZE;
+
+                file.read_at(&buf[offset], IO_SIZE, static_cast<off_t>(offset), [&](int res) {
+                    if (res != IO_SIZE) {
+                        bad++;
+                    }
+
+                    if (auto i = next++; i < 64) {
+                        read(i);
+                    }
+                });
+            };
+
+            for (auto slot = 0; slot < 8; slot++) {
+                if (auto i = next++; i < 64) {
+                    read(i);
+                }
+            }
+        }
+
+        CHECK(bad == 0);
+        CHECK(buf == data);
+    }
+
+    ::unlink(FILENAME);
+}
+
+TEST_CASE("callbacks can start operations past the depth")
+{
+    for (auto type : backends) {
+        std::vector<char> buf(IO_SIZE);
+        std::atomic<int> done{};
+
+        {
+            async_file file{FILENAME, O_RDWR | O_CREAT | O_TRUNC, 0644, 1, type};
+            file.write_at(buf.data(), buf.size(), 0).get();
+
+            // The second read started by the callback finds the queue full,
+            // and would otherwise wait on the thread that has to complete
+            // the first one.
+
+            file.read_at(buf.data(), buf.size(), 0, [&](int) {
+                done++;
+
+                file.read_at(buf.data(), buf.size(), 0, [&](int) { done++; });
+                file.read_at(buf.data(), buf.size(), 0, [&](int) { done++; });
+            });
+        }
+
+        CHECK(done == 3);
+    }
+
+    ::unlink(FILENAME);
+}
+
+#endif
+
+// -----------------------------------------------------------------------------
+// Benchmark
+// -----------------------------------------------------------------------------
+
+#ifdef BENCHMARK
+
+#include <chrono>
+#include <random>
+#include <iomanip>
+#include <algorithm>
+
+// Reads random 4KB blocks of a file (1GB by default) from a single thread,
+// keeping a fixed number of reads in flight by starting a new read from
+// each completion, for queue depths from 1 to 128. The file is opened with
+// O_DIRECT where the file system supports it, so that the reads go to the
+// device instead of the page cache. The thread pool is given one thread per
+// read in flight, since that is what it takes for it to reach the depth.
+
+#define FILENAME "example6_benchmark.dat"
+
+struct aligned_free
+{
+    void operator()(char *ptr) const
+    { free(ptr); }
+};
+
+void
+create_file(std::size_t size)
+{
+    async_file file{FILENAME, O_WRONLY | O_CREAT | O_TRUNC};
+
+    std::vector<char> block(0x100000, 'x');
+    for (std::size_t offset = 0; offset < size; offset += block.size()) {
+        file.write_at(block.data(), block.size(), static_cast<off_t>(offset)).get();
+    }
+
+    file.fsync().get();
+}
+
+void
+benchmark(async_file::backend type, int flags, std::size_t size, unsigned depth, std::size_t num)
+{
+    using namespace std::chrono;
+
+    auto buf = std::unique_ptr<char, aligned_free>(static_cast<char *>(aligned_alloc(IO_SIZE, IO_SIZE * depth)));
+    auto blocks = size / IO_SIZE;
+
+    std::vector<int64_t> latencies(num);
+    std::atomic<std::size_t> next{};
+    std::atomic<std::size_t> errors{};
+
+    std::function<void(unsigned, std::size_t)> read;
+    auto stime = high_resolution_clock::now();
+
+    {
+        async_file file{FILENAME, flags, 0644, depth, type};
+
+        read = [&](unsigned slot, std::size_t i) {
+            auto offset = static_cast<off_t>((i * 0x9E3779B97F4A7C15 % blocks) * IO_SIZE);
+            auto start = high_resolution_clock::now();
+
+            file.read_at(buf.get() + slot * IO_SIZE, IO_SIZE, offset, [&, slot, i, start](int res) {
+                latencies[i] = duration_cast<nanoseconds>(high_resolution_clock::now() - start).count();
+
+                if (res != IO_SIZE) {
+                    errors++;
+                }
+
+                if (auto n = next++; n < num) {
+                    read(slot, n);
+                }
+            });
+        };
+
+        for (unsigned slot = 0; slot < depth; slot++) {
+            if (auto n = next++; n < num) {
+                read(slot, n);
+            }
+        }
+    }
+
+    auto etime = high_resolution_clock::now();
+    auto elapsed = duration_cast<nanoseconds>(etime - stime).count();
+
+    if (errors != 0) {
+        throw std::runtime_error("failed to read file");
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+
+    auto iops = static_cast<double>(num) * 1e9 / static_cast<double>(elapsed);
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << std::setw(10) << (type == async_file::backend::uring ? "io_uring" : "threads")
+              << std::setw(8) << depth
+              << std::setw(12) << iops
+              << std::setw(10) << iops * IO_SIZE / 0x100000
+              << std::setw(12) << static_cast<double>(latencies[num / 2]) / 1000.0
+              << std::setw(12) << static_cast<double>(latencies[num * 99 / 100]) / 1000.0 << '\n';
+}
+
+int
+protected_main(int argc, char **argv)
+{
+    auto args = make_span(argv, argc);
+
+    std::size_t size = args.size() > 1 ? std::stoul(ensure_z(args[1]).data()) << 20 : std::size_t{1024} << 20;
+    std::size_t num = args.size() > 2 ? std::stoul(ensure_z(args[2]).data()) : 20000;
+
+    create_file(size);
+
+    auto flags = O_RDONLY | O_DIRECT;
+    if (auto fd = ::open(FILENAME, flags); fd == -1) {
+        std::cout << "O_DIRECT is not supported, reading through the page cache\n";
+        flags = O_RDONLY;
+    }
+    else {
+        ::close(fd);
+    }
+
+    std::cout << std::setw(10) << "backend"
+              << std::setw(8) << "QD"
+              << std::setw(12) << "IOPS"
+              << std::setw(10) << "MB/s"
+              << std::setw(12) << "p50 (us)"
+              << std::setw(12) << "p99 (us)" << '\n';
+
+    for (auto type : {async_file::backend::uring, async_file::backend::threads}) {
+        for (unsigned depth = 1; depth <= 128; depth *= 2) {
+            benchmark(type, flags, size, depth, num);
+        }
+    }
+
+    ::unlink(FILENAME);
+    return EXIT_SUCCESS;
+}
+
+// -----------------------------------------------------------------------------
+// Copy
+// -----------------------------------------------------------------------------
+
+#elif !defined(TEST)
+
+// Copies a file with a number of blocks in flight at once, each block being
+// written as soon as its read completes, and its buffer being reused for
+// the next block once the write completes. The copy is allocated up front,
+// and synced once the last block has been written.
+
+#define COPY_BLOCK_SIZE 0x100000
+#define COPY_DEPTH 16
+
+int
+protected_main(int argc, char **argv)
+{
+    auto args = make_span(argv, argc);
+
+    if (args.size() < 3) {
+        std::cerr << "usage: example6 <source> <destination>\n";
+        return EXIT_FAILURE;
+    }
+
+    std::vector<std::vector<char>> bufs(COPY_DEPTH, std::vector<char>(COPY_BLOCK_SIZE));
+
+    std::atomic<off_t> next{};
+    std::atomic<off_t> remaining{};
+    std::atomic<std::size_t> errors{};
+
+    std::promise<void> done;
+    std::function<void(std::size_t)> copy;
+
+    auto block_done = [&](bool ok) {
+        if (!ok) {
+            errors++;
+        }
+
+        if (--remaining == 0) {
+            done.set_value();
+        }
+    };
+
+    // Everything the callbacks use is declared above the files, so that it
+    // outlives them; a file's destructor waits for its last callback.
+
+    async_file src{ensure_z(args[1]).data()};
+    async_file dst{ensure_z(args[2]).data(), O_WRONLY | O_CREAT | O_TRUNC};
+
+    auto size = lseek(src.fd(), 0, SEEK_END);
+    if (size <= 0) {
+        return EXIT_SUCCESS;
+    }
+
+    dst.fallocate(0, 0, size).get();
+    remaining = (size + COPY_BLOCK_SIZE - 1) / COPY_BLOCK_SIZE;
+
+    copy = [&, size](std::size_t slot) {
+        auto offset = next.fetch_add(COPY_BLOCK_SIZE);
+        if (offset >= size) {
+            return;
+        }
+
+        auto buf = bufs[slot].data();
+        auto len = static_cast<std::size_t>(std::min<off_t>(COPY_BLOCK_SIZE, size - offset));
+
+        src.read_at(buf, len, offset, [&, slot, buf, len, offset](int res) {
+            if (res != static_cast<int>(len)) {
+                block_done(false);
+                return copy(slot);
+            }
+
+            dst.write_at(buf, len, offset, [&, slot, len](int res) {
+                block_done(res == static_cast<int>(len));
+                copy(slot);
+            });
+        });
+    };
+
+    for (std::size_t slot = 0; slot < COPY_DEPTH; slot++) {
+        copy(slot);
+    }
+
+    done.get_future().wait();
+
+    if (errors != 0) {
+        throw std::runtime_error("failed to copy file");
+    }
+
+    dst.fsync().get();
+    return EXIT_SUCCESS;
+}
+
+#endif
+
+#ifndef TEST
+
+int
+main(int argc, char **argv)
+{
+    try {
+        return protected_main(argc, argv);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Caught unhandled exception:\n";
+        std::cerr << " - what(): " << e.what() << '\n';
+    }
+    catch (...) {
+        std::cerr << "Caught unknown exception\n";
+    }
+
+    return EXIT_FAILURE;
+}
+
+#endif
@@ -0,0 +1,528 @@
+//
+// Copyright (C) 2018 Rian Quinn <rianquinn@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <iostream>
+#include <condition_variable>
+
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem;
+
+#include <gsl/gsl>
+using namespace gsl;
+
+#define DIRENT_BUF_SIZE 0x10000
+
+// -----------------------------------------------------------------------------
+// Directory Walker
+// -----------------------------------------------------------------------------
+
+// Walks a directory tree with a pool of threads. Each subdirectory that is
+// found becomes a separate piece of work, so the walk fans out over the
+// tree instead of going one directory at a time. Directories are read in
+// large batches with getdents64(), and everything is opened and stat'd
+// with openat() and statx() relative to the open parent directory, so the
+// kernel never has to resolve a full path again.
+//
+// Work is taken from the top of a shared stack, which keeps the walk close
+// to depth first, and with it the number of directories that are open at
+// once. A queued subdirectory holds a reference to its open parent rather
+// than being opened itself, so a directory with many subdirectories costs a
+// single descriptor until all of them have been opened.
+//
+// The consumer is called for every entry (not including the root) from
+// whichever thread found it, so it must be thread safe. Symbolic links are
+// reported but not followed (other than the root itself), entries that
+// disappear before they can be stat'd are skipped, and so are
+// subdirectories that cannot be opened (after saying so on stderr). Only
+// failing to open the root throws.
+
+struct entry
+{
+    std::string path;
+    struct statx stx;
+
+    bool is_dir() const
+    { return S_ISDIR(stx.stx_mode); }
+
+    bool is_file() const
+    { return S_ISREG(stx.stx_mode); }
+};
+
+class dir_fd
+{
+public:
+
+    // Entries are opened with O_NOFOLLOW, so that a symbolic link that is
+    // swapped in for a subdirectory during the walk is not followed out of
+    // the tree. The root is named by the caller, so it may be a link.
+
+    dir_fd(int parent, const char *name)
+    {
+        auto nofollow = parent == AT_FDCWD ? 0 : O_NOFOLLOW;
+
+        if (m_fd = openat(parent, name, O_RDONLY | O_DIRECTORY | nofollow | O_CLOEXEC); m_fd == -1) {
+            throw std::runtime_error(std::string(name) + ": " + strerror(errno));
+        }
+    }
+
+    ~dir_fd()
+    { ::close(m_fd); }
+
+    dir_fd(const dir_fd &) = delete;
+    dir_fd &operator=(const dir_fd &) = delete;
+
+    operator int() const
+    { return m_fd; }
+
+private:
+    int m_fd;
+};
+
+class walker
+{
+    struct work {
+        std::shared_ptr<dir_fd> parent;
+        std::string name;
+        std::string path;
+    };
+
+public:
+
+    explicit walker(std::size_t threads = std::thread::hardware_concurrency()) :
+        m_threads{std::max<std::size_t>(threads, 1)}
+    { }
+
+    template<typename FUNC>
+    void walk(const std::string &root, FUNC func)
+    {
+        m_stack.push_back({nullptr, root, root});
+        m_pending = 1;
+
+        std::vector<std::thread> threads;
+        for (std::size_t i = 0; i < m_threads; i++) {
+            threads.emplace_back(&walker::run<FUNC>, this, std::ref(func));
+        }
+
+        for (auto &t : threads) {
+            t.join();
+        }
+
+        if (m_error) {
+            std::rethrow_exception(m_error);
+        }
+    }
+
+private:
+
+    template<typename FUNC>
+    void run(FUNC &func)
+    {
+        while (true) {
+            std::unique_lock lock(m_mutex);
+            m_cond.wait(lock, [&] { return m_pending == 0 || !m_stack.empty(); });
+
+            if (m_stack.empty()) {
+                return;
+            }
+
+            auto w = std::move(m_stack.back());
+            m_stack.pop_back();
+
+            lock.unlock();
+
+            try {
+                read_dir(w, func);
+            }
+            catch (const std::exception &e) {
+                if (w.parent) {
+                    std::cerr << e.what() << '\n';
+                }
+                else {
+                    m_error = std::current_exception();
+                }
+            }
+
+            lock.lock();
+            if (--m_pending == 0) {
+                lock.unlock();
+                m_cond.notify_all();
+            }
+        }
+    }
+
+    template<typename FUNC>
+    void read_dir(const work &w, FUNC &func)
+    {
+        auto fd = std::make_shared<dir_fd>(w.parent ? int(*w.parent) : AT_FDCWD, w.name.c_str());
+
+        std::array<char, DIRENT_BUF_SIZE> buf;
+        std::vector<work> subdirs;
+
+        while (true) {
+            auto bytes = syscall(SYS_getdents64, int(*fd), buf.data(), buf.size());
+            if (bytes == -1) {
+                throw std::runtime_error(w.path + ": " + strerror(errno));
+            }
+
+            if (bytes == 0) {
+                break;
+            }
+
+            for (long pos = 0; pos < bytes;) {
+                auto d = reinterpret_cast<struct dirent64 *>(buf.data() + pos);
+                pos += d->d_reclen;
+
+                if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+                    continue;
+                }
+
+                entry e;
+                e.path = w.path + '/' + d->d_name;
+
+                auto flags = AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC;
+                if (statx(*fd, d->d_name, flags, STATX_BASIC_STATS, &e.stx) == -1) {
+                    continue;
+                }
+
+                if (e.is_dir()) {
+                    subdirs.push_back({fd, d->d_name, e.path});
+                }
+
+                func(e);
+            }
+        }
+
+        if (!subdirs.empty()) {
+            {
+                std::lock_guard lock(m_mutex);
+
+                m_pending += subdirs.size();
+                for (auto &s : subdirs) {
+                    m_stack.push_back(std::move(s));
+                }
+            }
+
+            m_cond.notify_all();
+        }
+    }
+
+private:
+
+    std::size_t m_threads;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+
+    std::vector<work> m_stack;
+    std::size_t m_pending{};
+    std::exception_ptr m_error;
+};
+
+// -----------------------------------------------------------------------------
+// Tests
+// -----------------------------------------------------------------------------
+
+#ifdef TEST
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+
+#include <set>
+#include <fstream>
+
+#define DIRNAME "example7_test"
+
+TEST_CASE("finds the same entries as recursive_directory_iterator")
+{
+    fs::remove_all(DIRNAME);
+
+    for (auto i = 0; i < 10; i++) {
+        auto dir = std::string(DIRNAME) + "/dir" + std::to_string(i) + "/sub" + std::to_string(i % 3);
+        fs::create_directories(dir);
+
+        for (auto j = 0; j < i * 10; j++) {
+            std::ofstream{dir + "/file" + std::to_string(j)} << std::string(static_cast<std::size_t>(j), 'x');
+        }
+    }
+
+    fs::create_directory_symlink("..", DIRNAME "/loop");
+
+    std::set<std::string> expected;
+    std::size_t expected_bytes{};
+
+    for (const auto &p : fs::recursive_directory_iterator(DIRNAME)) {
+        expected.insert(p.path().string());
+
+        if (fs::is_regular_file(fs::symlink_status(p.path()))) {
+            expected_bytes += fs::file_size(p.path());
+        }
+    }
+
+    for (std::size_t threads : {1, 2, 8}) {
+        std::mutex mutex;
+        std::set<std::string> found;
+        std::size_t bytes{};
+
+        walker{threads}.walk(DIRNAME, [&](const entry &e) {
+            std::lock_guard lock(mutex);
+
+            found.insert(e.path);
+            if (e.is_file()) {
+                bytes += e.stx.stx_size;
+            }
+        });
+
+        CHECK(found == expected);
+        CHECK(bytes == expected_bytes);
+    }
+
+    fs::remove_all(DIRNAME);
+}
+
+TEST_CASE("root is a symbolic link")
+{
+    fs::remove_all(DIRNAME);
+    fs::remove(DIRNAME "_link");
+
+    fs::create_directories(DIRNAME "/dir");
+    std::ofstream{DIRNAME "/dir/file"} << "Hello World";
+    fs::create_directory_symlink(DIRNAME, DIRNAME "_link");
+
+    std::mutex mutex;
+    std::set<std::string> found;
+
+    walker{}.walk(DIRNAME "_link", [&](const entry &e) {
+        std::lock_guard lock(mutex);
+        found.insert(e.path);
+    });
+
+    CHECK(found == std::set<std::string>{DIRNAME "_link/dir", DIRNAME "_link/dir/file"});
+
+    fs::remove(DIRNAME "_link");
+    fs::remove_all(DIRNAME);
+}
+
+TEST_CASE("missing root")
+{
+    CHECK_THROWS(walker{}.walk("example7_missing", [](const entry &) { }));
+}
+
+#endif
+
+// -----------------------------------------------------------------------------
+// Benchmark
+// -----------------------------------------------------------------------------
+
+#ifdef BENCHMARK
+
+#include <chrono>
+#include <iomanip>
+
+// Walks a tree of a million files (by default), spread over a thousand
+// directories in two levels, and sums the size of every regular file. The
+// recursive_directory_iterator has to stat every entry by its full path to
+// get the same information, whereas the walker reads directories in large
+// batches and stats relative to the open directory, on 1 to 16 threads. The
+// tree is only created if it does not exist yet, and is kept afterwards,
+// since creating a million files takes far longer than walking them.
+//
+// Usage: example7_benchmark [files] [directory]
+
+template<typename FUNC>
+void
+report(const std::string &name, FUNC func)
+{
+    using namespace std::chrono;
+
+    auto stime = high_resolution_clock::now();
+    auto [entries, bytes] = func();
+    auto etime = high_resolution_clock::now();
+
+    auto elapsed = duration_cast<nanoseconds>(etime - stime).count();
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << std::setw(28) << std::left << name
+              << std::setw(14) << std::right << static_cast<double>(entries) * 1e9 / static_cast<double>(elapsed) << " entries/s"
+              << std::setw(12) << static_cast<double>(elapsed) / 1e6 << " ms"
+              << std::setw(12) << entries << " entries"
+              << std::setw(14) << bytes << " bytes\n";
+}
+
+void
+create_tree(const std::string &root, std::size_t files)
+{
+    if (fs::exists(root)) {
+        return;
+    }
+
+    std::cout << "creating " << files << " files in " << root << '\n';
+
+    auto per_dir = std::max<std::size_t>(files / 1000, 1);
+    for (std::size_t i = 0; i < files; i++) {
+        auto dir = root + "/" + std::to_string(i / per_dir / 32) + "/" + std::to_string(i / per_dir);
+        if (i % per_dir == 0) {
+            fs::create_directories(dir);
+        }
+
+        auto path = dir + "/" + std::to_string(i);
+        if (auto fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644); fd != -1) {
+            if (::write(fd, path.data(), i % 64) == -1) {
+                std::cerr << "failed to write " << path << '\n';
+            }
+            ::close(fd);
+        }
+    }
+}
+
+int
+protected_main(int argc, char **argv)
+{
+    auto args = make_span(argv, argc);
+
+    std::size_t files = args.size() > 1 ? std::stoul(ensure_z(args[1]).data()) : 1000000;
+    std::string root = args.size() > 2 ? ensure_z(args[2]).data() : "example7_tree";
+
+    create_tree(root, files);
+
+    report("recursive_directory_iterator", [&] {
+        std::size_t entries{};
+        std::size_t bytes{};
+
+        for (const auto &p : fs::recursive_directory_iterator(root)) {
+            entries++;
+
+            if (fs::is_regular_file(fs::symlink_status(p.path()))) {
+                bytes += fs::file_size(p.path());
+            }
+        }
+
+        return std::make_pair(entries, bytes);
+    });
+
+    for (std::size_t threads = 1; threads <= 16; threads *= 2) {
+        report("walker (" + std::to_string(threads) + " threads)", [&] {
+            std::atomic<std::size_t> entries{};
+            std::atomic<std::size_t> bytes{};
+
+            walker{threads}.walk(root, [&](const entry &e) {
+                entries.fetch_add(1, std::memory_order_relaxed);
+
+                if (e.is_file()) {
+                    bytes.fetch_add(e.stx.stx_size, std::memory_order_relaxed);
+                }
+            });
+
+            return std::make_pair(entries.load(), bytes.load());
+        });
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// -----------------------------------------------------------------------------
+// Index
+// -----------------------------------------------------------------------------
+
+#elif !defined(TEST)
+
+// Indexes a directory tree: counts its files and directories, adds up the
+// size of its files, and reports the largest one.
+
+int
+protected_main(int argc, char **argv)
+{
+    auto args = make_span(argv, argc);
+
+    std::string root = args.size() > 1 ? ensure_z(args[1]).data() : ".";
+    std::size_t threads = args.size() > 2 ? std::stoul(ensure_z(args[2]).data()) : 4;
+
+    std::mutex mutex;
+
+    std::size_t files{};
+    std::size_t dirs{};
+    std::size_t bytes{};
+
+    std::string largest;
+    std::size_t largest_size{};
+
+    walker{threads}.walk(root, [&](const entry &e) {
+        std::lock_guard lock(mutex);
+
+        if (e.is_dir()) {
+            dirs++;
+        }
+
+        if (e.is_file()) {
+            files++;
+            bytes += e.stx.stx_size;
+
+            if (e.stx.stx_size >= largest_size) {
+                largest = e.path;
+                largest_size = e.stx.stx_size;
+            }
+        }
+    });
+
+    std::cout << "files: " << files << '\n';
+    std::cout << "directories: " << dirs << '\n';
+    std::cout << "bytes: " << bytes << '\n';
+    std::cout << "largest: " << largest << " (" << largest_size << " bytes)\n";
+
+    return EXIT_SUCCESS;
+}
+
+#endif
+
+#ifndef TEST
+
+int
+main(int argc, char **argv)
+{
+    try {
+        return protected_main(argc, argv);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Caught unhandled exception:\n";
+        std::cerr << " - what(): " << e.what() << '\n';
+    }
+    catch (...) {
+        std::cerr << "Caught unknown exception\n";
+    }
+
+    return EXIT_FAILURE;
+}
+
+#endif
@@ -0,0 +1,450 @@
+//
+// Copyright (C) 2018 Rian Quinn <rianquinn@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <iostream>
+
+#include <gsl/gsl>
+using namespace gsl;
+
+#include "durable_file.h"
+
+// -----------------------------------------------------------------------------
+// Tests
+// -----------------------------------------------------------------------------
+
+#ifdef TEST
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+
+#include <fstream>
+#include <sstream>
+
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem;
+
+#define FILENAME "example8_test.txt"
+
+std::string
+contents(const std::string &path)
+{
+    std::stringstream ss;
+    ss << std::ifstream(path).rdbuf();
+
+    return ss.str();
+}
+
+std::size_t
+leftovers()
+{
+    std::size_t num{};
+
+    for (const auto &p : fs::directory_iterator(".")) {
+        if (p.path().filename().string().find(FILENAME ".") == 0) {
+            num++;
+        }
+    }
+
+    return num;
+}
+
+TEST_CASE("atomic replace")
+{
+    ::unlink(FILENAME);
+
+    atomic_replace(FILENAME, "Hello World\n");
+    CHECK(contents(FILENAME) == "Hello World\n");
+
+    ::chmod(FILENAME, 0600);
+
+    atomic_replace(FILENAME, "The answer is: 42\n");
+    CHECK(contents(FILENAME) == "The answer is: 42\n");
+
+    struct stat st{};
+    REQUIRE(::stat(FILENAME, &st) == 0);
+    CHECK((st.st_mode & 07777) == 0600);
+
+    atomic_replace(FILENAME, "");
+    CHECK(contents(FILENAME).empty());
+
+    CHECK(leftovers() == 0);
+    ::unlink(FILENAME);
+}
+
+TEST_CASE("atomic replace into a missing directory")
+{
+    CHECK_THROWS(atomic_replace("example8_missing/" FILENAME, "Hello World\n"));
+}
+
+TEST_CASE("durable append from many threads")
+{
+    ::unlink(FILENAME);
+
+    {
+        durable_appender appender(FILENAME, {DURABLE_FILE_MAX_BYTES, std::chrono::microseconds{100}});
+        std::vector<std::thread> threads;
+
+        for (auto i = 0; i < 8; i++) {
+            threads.emplace_back([&appender, i] {
+                for (auto j = 0; j < 100; j++) {
+                    appender.append(std::to_string(i) + " " + std::to_string(j) + '\n');
+                }
+            });
+        }
+
+        for (auto &t : threads) {
+            t.join();
+        }
+
+        CHECK(appender.syncs() > 0);
+        CHECK(appender.syncs() <= 800);
+    }
+
+    std::ifstream file(FILENAME);
+    std::vector<int> next(8);
+
+    int i{};
+    int j{};
+    std::size_t lines{};
+
+    while (file >> i >> j) {
+        REQUIRE(i >= 0);
+        REQUIRE(i < 8);
+        CHECK(j == next[static_cast<std::size_t>(i)]++);
+        lines++;
+    }
+
+    CHECK(lines == 800);
+    ::unlink(FILENAME);
+}
+
+TEST_CASE("byte threshold")
+{
+    using namespace std::chrono;
+    ::unlink(FILENAME);
+
+    {
+        durable_appender appender(FILENAME, {100, hours{1}});
+
+        appender.write(std::string(50, 'a'));
+        std::this_thread::sleep_for(milliseconds{50});
+
+        CHECK(appender.syncs() == 0);
+        CHECK(contents(FILENAME).empty());
+
+        appender.wait(appender.write(std::string(60, 'b')));
+
+        CHECK(appender.syncs() == 1);
+        CHECK(contents(FILENAME) == std::string(50, 'a') + std::string(60, 'b'));
+    }
+
+    ::unlink(FILENAME);
+}
+
+TEST_CASE("pending writes are bounded")
+{
+    ::unlink(FILENAME);
+
+    {
+        durable_appender appender(FILENAME, {64, std::chrono::hours{1}});
+
+        for (auto i = 0; i < 1000; i++) {
+            appender.write(std::string(31, 'x') + '\n');
+        }
+
+        appender.sync();
+
+        // Each commit holds at most twice max_bytes, plus the record that
+        // crossed the limit.
+
+        CHECK(appender.syncs() >= 32000 / (64 * 2 + 32));
+    }
+
+    CHECK(contents(FILENAME).size() == 32000);
+    ::unlink(FILENAME);
+}
+
+TEST_CASE("no max_bytes commits records one at a time")
+{
+    ::unlink(FILENAME);
+
+    {
+        durable_appender appender(FILENAME, {0, std::chrono::hours{1}});
+
+        for (auto i = 0; i < 100; i++) {
+            appender.write("Hello World\n");
+        }
+
+        appender.sync();
+        CHECK(appender.syncs() == 100);
+    }
+
+    CHECK(contents(FILENAME).size() == 1200);
+    ::unlink(FILENAME);
+}
+
+TEST_CASE("pending writes are committed")
+{
+    ::unlink(FILENAME);
+
+    {
+        durable_appender appender(FILENAME, {DURABLE_FILE_MAX_BYTES, std::chrono::hours{1}});
+
+        appender.write("Hello ");
+        appender.write("World\n");
+    }
+
+    CHECK(contents(FILENAME) == "Hello World\n");
+
+    {
+        durable_appender appender(FILENAME);
+
+        appender.write("The answer is: 42\n");
+        appender.sync();
+
+        CHECK(contents(FILENAME) == "Hello World\nThe answer is: 42\n");
+    }
+
+    ::unlink(FILENAME);
+}
+
+#endif
+
+// -----------------------------------------------------------------------------
+// Benchmark
+// -----------------------------------------------------------------------------
+
+#ifdef BENCHMARK
+
+#include <chrono>
+#include <iomanip>
+
+#define RECORD_SIZE 128
+
+// Measures how many records per second can be made durable by 1 to 64
+// writer threads, each of which waits for its record to be on disk before
+// writing the next one. The naive writer calls write() and fdatasync() for
+// every record, while the appender commits them in groups, with no delay
+// and with a 1ms delay. Each run lasts a fixed amount of time (1 second by
+// default), and reports the number of syncs it took as well. Lastly, a 4KB
+// file is replaced over and over, both atomically and by rewriting it in
+// place (which is just as durable, but not crash safe).
+//
+// Note that some file systems (ext4 among them) already merge the journal
+// commits of concurrent fdatasync() calls, so the naive writer gets a
+// little faster with a few threads as well, but each of its threads still
+// waits for a sync of its own.
+//
+// Usage: example8_benchmark [seconds] [file]
+
+template<typename FUNC>
+void
+report(const std::string &name, std::size_t threads, double seconds, FUNC func)
+{
+    using namespace std::chrono;
+
+    std::atomic<bool> done{};
+    std::atomic<std::size_t> records{};
+    std::vector<std::thread> workers;
+
+    auto stime = high_resolution_clock::now();
+
+    for (std::size_t i = 0; i < threads; i++) {
+        workers.emplace_back([&] {
+            std::size_t num{};
+
+            while (!done.load(std::memory_order_relaxed)) {
+                func();
+                num++;
+            }
+
+            records += num;
+        });
+    }
+
+    std::this_thread::sleep_for(duration<double>(seconds));
+    done = true;
+
+    for (auto &t : workers) {
+        t.join();
+    }
+
+    auto etime = high_resolution_clock::now();
+    auto elapsed = duration_cast<nanoseconds>(etime - stime).count();
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << std::setw(24) << std::left << name
+              << std::setw(6) << std::right << threads << " threads"
+              << std::setw(14) << static_cast<double>(records) * 1e9 / static_cast<double>(elapsed) << " writes/s";
+}
+
+void
+syncs(std::size_t num)
+{
+    std::cout << std::setw(12) << num << " syncs\n";
+}
+
+int
+protected_main(int argc, char **argv)
+{
+    using namespace std::chrono;
+
+    auto args = make_span(argv, argc);
+
+    auto seconds = args.size() > 1 ? std::stod(ensure_z(args[1]).data()) : 1.0;
+    std::string path = args.size() > 2 ? ensure_z(args[2]).data() : "example8_benchmark.txt";
+
+    std::string record(RECORD_SIZE - 1, 'x');
+    record += '\n';
+
+    for (std::size_t threads = 1; threads <= 64; threads *= 4) {
+        ::unlink(path.c_str());
+
+        {
+            auto fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (fd == -1) {
+                throw std::runtime_error(strerror(errno));
+            }
+
+            std::atomic<std::size_t> num{};
+
+            report("fdatasync per write", threads, seconds, [&] {
+                if (!write_all(fd, record.data(), record.size()) || ::fdatasync(fd) == -1) {
+                    throw std::runtime_error(strerror(errno));
+                }
+
+                num.fetch_add(1, std::memory_order_relaxed);
+            });
+
+            ::close(fd);
+            syncs(num);
+        }
+
+        for (auto delay : {microseconds{0}, microseconds{1000}}) {
+            ::unlink(path.c_str());
+
+            durable_appender appender(path, {DURABLE_FILE_MAX_BYTES, delay});
+            auto name = "group commit (" + std::to_string(delay.count()) + "us)";
+
+            report(name, threads, seconds, [&] {
+                appender.append(record);
+            });
+
+            syncs(appender.syncs());
+        }
+    }
+
+    std::string data(0x1000, 'x');
+
+    report("rewrite in place", 1, seconds, [&] {
+        auto fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+        if (fd == -1 || !write_all(fd, data.data(), data.size()) || ::fdatasync(fd) == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        ::close(fd);
+    });
+
+    std::cout << '\n';
+
+    report("atomic replace", 1, seconds, [&] {
+        atomic_replace(path, data);
+    });
+
+    std::cout << '\n';
+
+    ::unlink(path.c_str());
+    return EXIT_SUCCESS;
+}
+
+// -----------------------------------------------------------------------------
+// Durable Copy
+// -----------------------------------------------------------------------------
+
+#elif !defined(TEST)
+
+#include <sstream>
+
+// Copies stdin to a file so that the file survives a crash. By default, the
+// file is replaced atomically, so that it holds either its old contents or
+// all of stdin. With -a, every line of stdin is appended to the file
+// instead, and the lines are committed in groups as they arrive.
+//
+// Usage: example8 [-a] <file>
+
+int
+protected_main(int argc, char **argv)
+{
+    auto args = make_span(argv, argc);
+
+    if (args.size() == 3 && std::string(ensure_z(args[1]).data()) == "-a") {
+        durable_appender appender(ensure_z(args[2]).data());
+
+        for (std::string line; std::getline(std::cin, line); ) {
+            appender.write(line + '\n');
+        }
+
+        appender.sync();
+        std::cout << "appended with " << appender.syncs() << " syncs\n";
+
+        return EXIT_SUCCESS;
+    }
+
+    if (args.size() != 2) {
+        std::cerr << "usage: example8 [-a] <file>\n";
+        return EXIT_FAILURE;
+    }
+
+    std::stringstream ss;
+    ss << std::cin.rdbuf();
+
+    atomic_replace(ensure_z(args[1]).data(), ss.str());
+    return EXIT_SUCCESS;
+}
+
+#endif
+
+#ifndef TEST
+
+int
+main(int argc, char **argv)
+{
+    try {
+        return protected_main(argc, argv);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Caught unhandled exception:\n";
+        std::cerr << " - what(): " << e.what() << '\n';
+    }
+    catch (...) {
+        std::cerr << "Caught unknown exception\n";
+    }
+
+    return EXIT_FAILURE;
+}
+
+#endif
@@ -0,0 +1,264 @@
+//
+// Copyright (C) 2018 Rian Quinn <rianquinn@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef LINE_READER_H
+#define LINE_READER_H
+
+#include <memory>
+#include <cstdint>
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <string_view>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define LINE_READER_SIZE 0x100000
+
+// -----------------------------------------------------------------------------
+// Newline Search
+// -----------------------------------------------------------------------------
+
+// Compares 64 bytes at once against '\n' with SSE2, which is always there on
+// x86_64, and returns a mask with one bit set for each newline. Walking the
+// set bits of that mask finds every newline in the block without going back
+// to memory, which is cheaper than calling memchr() once per line when lines
+// are short. Other architectures build the same mask one byte at a time.
+
+inline uint64_t
+newline_mask(const char *ptr)
+{
+#if defined(__SSE2__)
+    const auto nl = _mm_set1_epi8('\n');
+
+    auto b0 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + 0)), nl);
+    auto b1 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + 16)), nl);
+    auto b2 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + 32)), nl);
+    auto b3 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + 48)), nl);
+
+    return
+        static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(b0))) |
+        static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(b1))) << 16 |
+        static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(b2))) << 32 |
+        static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(b3))) << 48;
+#else
+    uint64_t mask{};
+
+    for (auto i = 0; i < 64; i++) {
+        mask |= static_cast<uint64_t>(ptr[i] == '\n') << i;
+    }
+
+    return mask;
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// Line Reader
+// -----------------------------------------------------------------------------
+
+// Reads a file descriptor in large blocks into a single reusable buffer, and
+// hands out each line (without its newline) as a string_view into that
+// buffer. A view is only valid until the next call to next(). Newlines are
+// found 64 bytes at a time with newline_mask(); the buffer has 64 bytes of
+// slack at the end so the last block can be loaded whole, and the bits past
+// the data are masked off. A line that straddles the end of the buffer is
+// moved to the front before reading more, and a line longer than the whole
+// buffer makes the buffer grow.
+//
+// When the descriptor has no more data (end of file, or EAGAIN on a
+// non-blocking descriptor), next() returns false and keeps whatever
+// unterminated line it has, so a file that is still being written to can
+// be read again later. partial() returns that line for a file that really
+// has ended without a final newline.
+
+class line_reader
+{
+public:
+
+    explicit line_reader(int fd, std::size_t size = LINE_READER_SIZE) :
+        m_fd{fd},
+        m_size{size},
+        m_buf{std::make_unique<char[]>(size + 64)}
+    { }
+
+    bool next(std::string_view &line)
+    {
+        while (true) {
+            if (m_mask != 0) {
+                auto pos = m_block + static_cast<std::size_t>(__builtin_ctzll(m_mask));
+                m_mask &= m_mask - 1;
+
+                line = {m_buf.get() + m_begin, pos - m_begin};
+                m_begin = pos + 1;
+
+                return true;
+            }
+
+            if (m_scan < m_end) {
+                auto len = std::min<std::size_t>(m_end - m_scan, 64);
+
+                m_block = m_scan;
+                m_mask = newline_mask(m_buf.get() + m_block);
+                m_scan += len;
+
+                if (len < 64) {
+                    m_mask &= (uint64_t{1} << len) - 1;
+                }
+
+                continue;
+            }
+
+            if (!fill()) {
+                return false;
+            }
+        }
+    }
+
+    std::string_view partial()
+    {
+        std::string_view line{m_buf.get() + m_begin, m_end - m_begin};
+
+        m_begin = m_scan = m_end;
+        m_mask = 0;
+
+        return line;
+    }
+
+    void reset()
+    {
+        m_begin = m_scan = m_end = 0;
+        m_mask = 0;
+    }
+
+    class iterator
+    {
+    public:
+
+        using iterator_category = std::input_iterator_tag;
+        using value_type = std::string_view;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const std::string_view *;
+        using reference = const std::string_view &;
+
+        iterator() = default;
+
+        explicit iterator(line_reader *reader) :
+            m_reader{reader}
+        { ++(*this); }
+
+        reference operator*() const
+        { return m_line; }
+
+        pointer operator->() const
+        { return &m_line; }
+
+        iterator &operator++()
+        {
+            if (m_reader->next(m_line)) {
+                return *this;
+            }
+
+            if (m_line = m_reader->partial(); m_line.empty()) {
+                m_reader = nullptr;
+            }
+
+            return *this;
+        }
+
+        bool operator==(const iterator &other) const
+        { return m_reader == other.m_reader; }
+
+        bool operator!=(const iterator &other) const
+        { return m_reader != other.m_reader; }
+
+    private:
+
+        line_reader *m_reader{};
+        std::string_view m_line;
+    };
+
+    iterator begin()
+    { return iterator{this}; }
+
+    iterator end()
+    { return iterator{}; }
+
+private:
+
+    bool fill()
+    {
+        if (m_begin != 0) {
+            memmove(m_buf.get(), m_buf.get() + m_begin, m_end - m_begin);
+
+            m_end -= m_begin;
+            m_scan -= m_begin;
+            m_begin = 0;
+        }
+
+        if (m_end == m_size) {
+            auto buf = std::make_unique<char[]>(m_size * 2 + 64);
+            memcpy(buf.get(), m_buf.get(), m_end);
+
+            m_buf = std::move(buf);
+            m_size *= 2;
+        }
+
+        while (true) {
+            auto bytes = ::read(m_fd, m_buf.get() + m_end, m_size - m_end);
+            if (bytes == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                if (errno == EAGAIN) {
+                    return false;
+                }
+
+                throw std::runtime_error(strerror(errno));
+            }
+
+            m_end += static_cast<std::size_t>(bytes);
+            return bytes != 0;
+        }
+    }
+
+private:
+
+    int m_fd;
+    std::size_t m_size;
+    std::unique_ptr<char[]> m_buf;
+
+    std::size_t m_begin{};
+    std::size_t m_block{};
+    std::size_t m_scan{};
+    std::size_t m_end{};
+
+    uint64_t m_mask{};
+};
+
+#endif
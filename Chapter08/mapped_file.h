@@ -0,0 +1,283 @@
+//
+// Copyright (C) 2018 Rian Quinn <rianquinn@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <stdexcept>
+#include <string_view>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <gsl/gsl>
+
+#define HUGE_PAGE_SIZE 0x200000
+
+// -----------------------------------------------------------------------------
+// Mapped File
+// -----------------------------------------------------------------------------
+
+// Maps a whole file read-only, so that it can be read through a span or a
+// string_view straight out of the page cache, without copying it into a
+// buffer of our own first. The access hint is passed on to madvise() so that
+// the kernel can read ahead (sequential, willneed) or not (random).
+//
+// With huge pages enabled, the mapping is placed on a 2MB boundary and
+// MADV_HUGEPAGE is set, which lets the kernel back it with huge pages where
+// the file system supports it. The boundary is found by reserving 2MB more
+// address space than needed and mapping the file over the aligned part.
+//
+// A mapping covers the file as it was when it was mapped. If the file has
+// since been appended to, refresh() grows the mapping (which may move it,
+// so any views taken before are invalid afterwards). Reading a page of the
+// mapping past the end of a file that has been truncated raises SIGBUS.
+
+enum class access_hint
+{
+    normal,
+    sequential,
+    random,
+    willneed
+};
+
+class mapped_file
+{
+public:
+
+    explicit mapped_file(const std::string &path, access_hint hint = access_hint::normal, bool huge_pages = false) :
+        m_hint{hint},
+        m_huge_pages{huge_pages}
+    {
+        if (m_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC); m_fd == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        // The destructor does not run if the constructor throws, so the file
+        // has to be closed here if it cannot be mapped.
+
+        try {
+            refresh();
+        }
+        catch (...) {
+            ::close(m_fd);
+            throw;
+        }
+    }
+
+    ~mapped_file()
+    {
+        unmap();
+
+        if (m_fd != -1) {
+            ::close(m_fd);
+        }
+    }
+
+    mapped_file(mapped_file &&other) noexcept :
+        m_fd{std::exchange(other.m_fd, -1)},
+        m_data{std::exchange(other.m_data, nullptr)},
+        m_size{std::exchange(other.m_size, 0)},
+        m_hint{other.m_hint},
+        m_huge_pages{other.m_huge_pages}
+    { }
+
+    mapped_file &operator=(mapped_file &&other) noexcept
+    {
+        std::swap(m_fd, other.m_fd);
+        std::swap(m_data, other.m_data);
+        std::swap(m_size, other.m_size);
+        std::swap(m_hint, other.m_hint);
+        std::swap(m_huge_pages, other.m_huge_pages);
+
+        return *this;
+    }
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    // Brings the mapping up to date with the size of the file, and returns
+    // true if the size changed.
+
+    bool refresh()
+    {
+        struct stat st{};
+        if (fstat(m_fd, &st) == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        auto size = static_cast<std::size_t>(st.st_size);
+        if (size == m_size) {
+            return false;
+        }
+
+        if (size == 0) {
+            unmap();
+            return true;
+        }
+
+        if (m_data == nullptr || m_huge_pages) {
+            auto data = map(size);
+
+            unmap();
+            m_data = data;
+        }
+        else {
+            auto data = mremap(const_cast<std::byte *>(m_data), m_size, size, MREMAP_MAYMOVE);
+            if (data == MAP_FAILED) {
+                throw std::runtime_error(strerror(errno));
+            }
+
+            m_data = static_cast<const std::byte *>(data);
+        }
+
+        m_size = size;
+        advise(m_hint);
+
+        return true;
+    }
+
+    void advise(access_hint hint)
+    {
+        m_hint = hint;
+
+        if (m_data == nullptr) {
+            return;
+        }
+
+        auto ptr = const_cast<std::byte *>(m_data);
+
+        switch (hint) {
+            case access_hint::normal:
+                madvise(ptr, m_size, MADV_NORMAL);
+                break;
+
+            case access_hint::sequential:
+                madvise(ptr, m_size, MADV_SEQUENTIAL);
+                break;
+
+            case access_hint::random:
+                madvise(ptr, m_size, MADV_RANDOM);
+                break;
+
+            case access_hint::willneed:
+                madvise(ptr, m_size, MADV_WILLNEED);
+                break;
+        }
+
+        if (m_huge_pages) {
+            madvise(ptr, m_size, MADV_HUGEPAGE);
+        }
+    }
+
+    gsl::span<const std::byte> span() const
+    { return gsl::make_span(m_data, m_size); }
+
+    std::string_view view() const
+    { return {reinterpret_cast<const char *>(m_data), m_size}; }
+
+    const std::byte *data() const
+    { return m_data; }
+
+    std::size_t size() const
+    { return m_size; }
+
+    bool empty() const
+    { return m_size == 0; }
+
+private:
+
+    const std::byte *map(std::size_t size)
+    {
+        if (!m_huge_pages) {
+            auto ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, m_fd, 0);
+            if (ptr == MAP_FAILED) {
+                throw std::runtime_error(strerror(errno));
+            }
+
+            return static_cast<const std::byte *>(ptr);
+        }
+
+        auto reserved = size + HUGE_PAGE_SIZE;
+
+        auto ptr = mmap(nullptr, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (ptr == MAP_FAILED) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        auto addr = reinterpret_cast<uintptr_t>(ptr);
+        auto aligned = (addr + HUGE_PAGE_SIZE - 1) & ~uintptr_t{HUGE_PAGE_SIZE - 1};
+
+        auto data = mmap(reinterpret_cast<void *>(aligned), size, PROT_READ, MAP_SHARED | MAP_FIXED, m_fd, 0);
+        if (data == MAP_FAILED) {
+            munmap(ptr, reserved);
+            throw std::runtime_error(strerror(errno));
+        }
+
+        // The file mapping is rounded up to whole pages, so only the
+        // reservation before it and past the end of its last page are
+        // left to give back.
+
+        auto page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        auto end = aligned + ((size + page - 1) & ~(page - 1));
+
+        if (aligned != addr) {
+            munmap(ptr, aligned - addr);
+        }
+
+        if (end != addr + reserved) {
+            munmap(reinterpret_cast<void *>(end), addr + reserved - end);
+        }
+
+        return static_cast<const std::byte *>(data);
+    }
+
+    void unmap()
+    {
+        if (m_data != nullptr) {
+            munmap(const_cast<std::byte *>(m_data), m_size);
+        }
+
+        m_data = nullptr;
+        m_size = 0;
+    }
+
+private:
+
+    int m_fd{-1};
+
+    const std::byte *m_data{};
+    std::size_t m_size{};
+
+    access_hint m_hint;
+    bool m_huge_pages;
+};
+
+#endif
@@ -25,6 +25,7 @@
 #ifdef SERVER
 
 #include <array>
+#include <vector>
 #include <iostream>
 #include <stdexcept>
 
@@ -33,6 +34,13 @@
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
+
+// UDP GRO can coalesce many datagrams into a single buffer of up to 64k, so
+// it is only enabled when the batched buffer size is large enough to hold
+// the result.
+
+constexpr std::size_t GRO_SIZE = 0x10000;
 
 class myserver
 {
@@ -110,20 +118,167 @@ public:
         }
     }
 
+    // The batched echo receives up to "batch" datagrams of up to "size" bytes
+    // each with a single recvmmsg(), and replies to all of them with a single
+    // sendmmsg(). Each reply reuses the iovec and the sender's address from
+    // the received message. If GRO coalesced several datagrams into one
+    // buffer, the reply is sent with the same segment size, so that GSO
+    // splits it back into the original datagrams.
+
+    void echo_batched(std::size_t batch, std::size_t size)
+    {
+        union cmsgbuf {
+            char buf[CMSG_SPACE(sizeof(int))];
+            struct cmsghdr align;
+        };
+
+        std::vector<char> bufs(batch * size);
+        std::vector<struct mmsghdr> msgs(batch);
+        std::vector<struct iovec> iovs(batch);
+        std::vector<struct sockaddr_in> addrs(batch);
+        std::vector<cmsgbuf> cmsgs(batch);
+
+        auto gro = false;
+
+#if defined(UDP_GRO) && defined(UDP_SEGMENT)
+        if (size >= GRO_SIZE) {
+            int on = 1;
+            gro = ::setsockopt(m_fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+        }
+#endif
+
+        while(true)
+        {
+            for (std::size_t i = 0; i < batch; i++) {
+                iovs[i].iov_base = &bufs[i * size];
+                iovs[i].iov_len = size;
+
+                msgs[i].msg_hdr.msg_name = &addrs[i];
+                msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+                msgs[i].msg_hdr.msg_control = gro ? cmsgs[i].buf : nullptr;
+                msgs[i].msg_hdr.msg_controllen = gro ? sizeof(cmsgs[i].buf) : 0;
+                msgs[i].msg_hdr.msg_flags = 0;
+            }
+
+            auto num = ::recvmmsg(
+                m_fd,
+                msgs.data(),
+                static_cast<unsigned int>(batch),
+                MSG_WAITFORONE,
+                nullptr
+            );
+
+            if (num == -1) {
+                throw std::runtime_error(strerror(errno));
+            }
+
+            auto done = false;
+            auto replies = static_cast<std::size_t>(num);
+
+            for (std::size_t i = 0; i < replies; i++) {
+                if (msgs[i].msg_len == 0) {
+                    replies = i;
+                    done = true;
+                    break;
+                }
+
+                iovs[i].iov_len = msgs[i].msg_len;
+
+                auto &hdr = msgs[i].msg_hdr;
+                auto segment = gro_segment(hdr);
+
+                hdr.msg_control = nullptr;
+                hdr.msg_controllen = 0;
+
+#if defined(UDP_SEGMENT)
+                if (segment != 0 && segment < msgs[i].msg_len) {
+                    hdr.msg_control = cmsgs[i].buf;
+                    hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+
+                    auto cmsg = CMSG_FIRSTHDR(&hdr);
+                    cmsg->cmsg_level = SOL_UDP;
+                    cmsg->cmsg_type = UDP_SEGMENT;
+                    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+                    auto gso = static_cast<uint16_t>(segment);
+                    memcpy(CMSG_DATA(cmsg), &gso, sizeof(gso));
+                }
+#endif
+            }
+
+            for (std::size_t sent = 0; sent < replies;) {
+                auto ret = ::sendmmsg(
+                    m_fd,
+                    &msgs[sent],
+                    static_cast<unsigned int>(replies - sent),
+                    0
+                );
+
+                if (ret == -1) {
+                    throw std::runtime_error(strerror(errno));
+                }
+
+                sent += static_cast<std::size_t>(ret);
+            }
+
+            if (done) {
+                break;
+            }
+        }
+    }
+
     ~myserver()
     {
         close(m_fd);
     }
+
+private:
+
+    static unsigned int gro_segment(struct msghdr &hdr)
+    {
+#if defined(UDP_GRO)
+        if (hdr.msg_controllen == 0) {
+            return 0;
+        }
+
+        for (auto cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int segment;
+                memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+
+                return static_cast<unsigned int>(segment);
+            }
+        }
+#else
+        (void) hdr;
+#endif
+
+        return 0;
+    }
 };
 
 int
 protected_main(int argc, char** argv)
 {
-    (void) argc;
-    (void) argv;
-
     myserver server{PORT};
-    server.echo();
+
+    // usage: example1_server [batch] [size]
+
+    if (argc > 1) {
+        std::size_t batch = std::stoul(argv[1]);
+        std::size_t size = argc > 2 ? std::stoul(argv[2]) : MAX_SIZE;
+
+        if (batch == 0 || size == 0) {
+            throw std::invalid_argument("batch and size must be non-zero");
+        }
+
+        server.echo_batched(batch, size);
+    }
+    else {
+        server.echo();
+    }
 
     return EXIT_SUCCESS;
 }
@@ -265,3 +420,169 @@ main(int argc, char** argv)
 }
 
 #endif
+
+#ifdef LOADGEN
+
+#include <chrono>
+#include <vector>
+#include <iostream>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <string.h>
+
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+class myloadgen
+{
+    int m_fd{};
+    struct sockaddr_in m_addr{};
+
+public:
+    explicit myloadgen(uint16_t port)
+    {
+        if (m_fd = ::socket(AF_INET, SOCK_DGRAM, 0); m_fd == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        m_addr.sin_family = AF_INET;
+        m_addr.sin_port = htons(port);
+        m_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if (connect() == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        // Datagrams can be dropped, so a receive never waits forever.
+
+        struct timeval tv = {0, 100000};
+        if (::setsockopt(m_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+    }
+
+    int connect()
+    {
+        return ::connect(
+            m_fd,
+            reinterpret_cast<struct sockaddr *>(&m_addr),
+            sizeof(m_addr)
+        );
+    }
+
+    // Sends "batch" datagrams with one sendmmsg() and waits for the echoes,
+    // for the given duration. Returns the number of echoes received.
+
+    uint64_t run(std::size_t batch, std::size_t size, std::chrono::seconds d)
+    {
+        std::vector<char> bufs(batch * size, 'x');
+        std::vector<struct mmsghdr> msgs(batch);
+        std::vector<struct iovec> iovs(batch);
+
+        for (std::size_t i = 0; i < batch; i++) {
+            iovs[i].iov_base = &bufs[i * size];
+            iovs[i].iov_len = size;
+
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        uint64_t total = 0;
+        auto end = std::chrono::steady_clock::now() + d;
+
+        while (std::chrono::steady_clock::now() < end) {
+            for (std::size_t sent = 0; sent < batch;) {
+                auto ret = ::sendmmsg(
+                    m_fd,
+                    &msgs[sent],
+                    static_cast<unsigned int>(batch - sent),
+                    0
+                );
+
+                if (ret == -1) {
+                    throw std::runtime_error(strerror(errno));
+                }
+
+                sent += static_cast<std::size_t>(ret);
+            }
+
+            for (std::size_t recvd = 0; recvd < batch;) {
+                auto ret = ::recvmmsg(
+                    m_fd,
+                    &msgs[recvd],
+                    static_cast<unsigned int>(batch - recvd),
+                    MSG_WAITFORONE,
+                    nullptr
+                );
+
+                if (ret == -1) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        break;
+                    }
+
+                    throw std::runtime_error(strerror(errno));
+                }
+
+                recvd += static_cast<std::size_t>(ret);
+                total += static_cast<uint64_t>(ret);
+            }
+        }
+
+        return total;
+    }
+
+    ~myloadgen()
+    {
+        close(m_fd);
+    }
+};
+
+int
+protected_main(int argc, char** argv)
+{
+    using namespace std::chrono;
+
+    // usage: example1_loadgen [size] [seconds]
+    //
+    // Note that the server should be started in batched mode, with a batch
+    // size at least as large as the largest batch below.
+
+    std::size_t size = argc > 1 ? std::stoul(argv[1]) : MAX_SIZE - 1;
+    seconds d{argc > 2 ? std::stoul(argv[2]) : 1};
+
+    if (size == 0 || d.count() == 0) {
+        throw std::invalid_argument("size and seconds must be non-zero");
+    }
+
+    myloadgen loadgen{PORT};
+
+    for (std::size_t batch : {1, 4, 16, 64, 256}) {
+        auto total = loadgen.run(batch, size, d);
+
+        std::cout << "batch: " << batch << ", packets/sec: "
+                  << total / static_cast<uint64_t>(d.count()) << '\n';
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int
+main(int argc, char** argv)
+{
+    try {
+        return protected_main(argc, argv);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Caught unhandled exception:\n";
+        std::cerr << " - what(): " << e.what() << '\n';
+    }
+    catch (...) {
+        std::cerr << "Caught unknown exception\n";
+    }
+
+    return EXIT_FAILURE;
+}
+
+#endif
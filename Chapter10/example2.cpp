@@ -21,6 +21,128 @@
 
 #define PORT 22000
 #define MAX_SIZE 0x10
+#define MAX_BATCH 0x40
+
+#if defined(SERVER) || defined(BENCHMARK)
+
+#include <array>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <string.h>
+
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+// -----------------------------------------------------------------------------
+// Pooled Echo
+// -----------------------------------------------------------------------------
+
+struct echo_stats
+{
+    uint64_t syscalls;
+    uint64_t memset_bytes;
+};
+
+class write_queue
+{
+public:
+
+    bool full() const
+    { return m_num == m_iovs.size(); }
+
+    void push(char *buf, std::size_t len)
+    { m_iovs[m_num++] = {buf, len}; }
+
+    // Sends every queued response with a single writev(). More than one call
+    // is only needed if the socket accepts a partial write.
+
+    void flush(int fd, echo_stats &stats)
+    {
+        auto iov = m_iovs.data();
+        auto num = m_num;
+
+        while (num != 0) {
+            stats.syscalls++;
+
+            auto ret = ::writev(fd, iov, static_cast<int>(num));
+            if (ret == -1) {
+                throw std::runtime_error(strerror(errno));
+            }
+
+            auto left = static_cast<std::size_t>(ret);
+            while (num != 0 && left >= iov->iov_len) {
+                left -= iov->iov_len;
+                iov++;
+                num--;
+            }
+
+            if (num != 0) {
+                iov->iov_base = static_cast<char *>(iov->iov_base) + left;
+                iov->iov_len -= left;
+            }
+        }
+
+        m_num = 0;
+    }
+
+private:
+
+    std::array<struct iovec, MAX_BATCH> m_iovs;
+    std::size_t m_num{};
+};
+
+// Echoes everything received on fd until the peer closes the connection.
+// One receive buffer is reused for the whole connection and is never zeroed.
+// Once a blocking recv() fills its slot, any other data that is already
+// pending is drained with MSG_DONTWAIT into the rest of the buffer (a short
+// read means the socket is empty), and all of the responses are then sent
+// back together using one writev().
+
+void
+echo_pooled(int fd, echo_stats &stats)
+{
+    std::array<char, MAX_SIZE * MAX_BATCH> buf;
+    write_queue queue;
+
+    auto done = false;
+    while (!done)
+    {
+        auto flags = 0;
+        std::size_t used = 0;
+
+        while (!queue.full()) {
+            stats.syscalls++;
+
+            auto len = ::recv(fd, &buf[used], MAX_SIZE, flags);
+            if (len == -1) {
+                if (flags != 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    break;
+                }
+
+                throw std::runtime_error(strerror(errno));
+            }
+
+            if (len == 0) {
+                done = true;
+                break;
+            }
+
+            queue.push(&buf[used], static_cast<std::size_t>(len));
+
+            if (len != MAX_SIZE) {
+                break;
+            }
+
+            used += static_cast<std::size_t>(len);
+            flags = MSG_DONTWAIT;
+        }
+
+        queue.flush(fd, stats);
+    }
+}
+
+#endif
 
 #ifdef SERVER
 
@@ -66,30 +188,6 @@ public:
         );
     }
 
-    ssize_t recv(std::array<char, MAX_SIZE> &buf)
-    {
-        return ::recv(
-            m_client,
-            buf.data(),
-            buf.size(),
-            0
-        );
-    }
-
-    ssize_t send(std::array<char, MAX_SIZE> &buf, ssize_t len)
-    {
-        if (len >= buf.size()) {
-            throw std::out_of_range("len >= buf.size()");
-        }
-
-        return ::send(
-            m_client,
-            buf.data(),
-            len,
-            0
-        );
-    }
-
     void echo()
     {
         if (::listen(m_fd, 0) == -1) {
@@ -100,17 +198,8 @@ public:
             throw std::runtime_error(strerror(errno));
         }
 
-        while(true)
-        {
-            std::array<char, MAX_SIZE> buf{};
-
-            if (auto len = recv(buf); len != 0) {
-                send(buf, len);
-            }
-            else {
-                break;
-            }
-        }
+        echo_stats stats{};
+        echo_pooled(m_client, stats);
 
         close(m_client);
     }
@@ -290,3 +379,136 @@ private:
 
     int m_fd{};
 };
+
+#ifdef BENCHMARK
+
+#include <chrono>
+#include <thread>
+#include <iostream>
+
+// The original echo loop: a fresh, zeroed buffer for every recv() and one
+// send() for every response.
+
+void
+echo_naive(int fd, echo_stats &stats)
+{
+    while(true)
+    {
+        std::array<char, MAX_SIZE> buf{};
+        stats.memset_bytes += buf.size();
+
+        stats.syscalls++;
+        auto len = ::recv(fd, buf.data(), buf.size(), 0);
+
+        if (len == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        if (len == 0) {
+            break;
+        }
+
+        stats.syscalls++;
+        if (::send(fd, buf.data(), static_cast<std::size_t>(len), 0) == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+    }
+}
+
+// The client sends bursts of small messages, one send() per message, and
+// then waits for all of the echoes before sending the next burst.
+
+void
+client(int fd, std::size_t num, std::size_t burst)
+{
+    std::array<char, MAX_SIZE - 1> msg;
+    msg.fill('x');
+
+    std::array<char, MAX_SIZE * MAX_BATCH> buf;
+
+    for (std::size_t i = 0; i < num; i += burst) {
+        for (std::size_t j = 0; j < burst; j++) {
+            if (::send(fd, msg.data(), msg.size(), 0) == -1) {
+                throw std::runtime_error(strerror(errno));
+            }
+        }
+
+        for (std::size_t left = burst * msg.size(); left != 0;) {
+            auto len = ::recv(fd, buf.data(), std::min(left, buf.size()), 0);
+            if (len <= 0) {
+                throw std::runtime_error("echo failed");
+            }
+
+            left -= static_cast<std::size_t>(len);
+        }
+    }
+
+    ::shutdown(fd, SHUT_WR);
+}
+
+template<typename FUNC>
+void
+report(const char *name, std::size_t num, std::size_t burst, FUNC func)
+{
+    using namespace std::chrono;
+
+    int fds[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        throw std::runtime_error(strerror(errno));
+    }
+
+    echo_stats stats{};
+
+    auto stime = high_resolution_clock::now();
+    std::thread t{client, fds[1], num, burst};
+    func(fds[0], stats);
+    t.join();
+    auto etime = high_resolution_clock::now();
+
+    close(fds[0]);
+    close(fds[1]);
+
+    auto secs = duration_cast<duration<double>>(etime - stime).count();
+
+    std::cout << name << ":\n";
+    std::cout << " - msgs/sec: " << static_cast<uint64_t>(num / secs) << '\n';
+    std::cout << " - syscalls: " << stats.syscalls << '\n';
+    std::cout << " - memset bytes: " << stats.memset_bytes << '\n';
+}
+
+int
+protected_main(int argc, char** argv)
+{
+    std::size_t num = argc > 1 ? std::stoul(argv[1]) : 1000000;
+    std::size_t burst = argc > 2 ? std::stoul(argv[2]) : 32;
+
+    if (burst == 0 || burst > MAX_BATCH) {
+        throw std::out_of_range("burst must be between 1 and MAX_BATCH");
+    }
+
+    num -= num % burst;
+
+    report("naive", num, burst, echo_naive);
+    report("pooled", num, burst, echo_pooled);
+
+    return EXIT_SUCCESS;
+}
+
+int
+main(int argc, char** argv)
+{
+    try {
+        return protected_main(argc, argv);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Caught unhandled exception:\n";
+        std::cerr << " - what(): " << e.what() << '\n';
+    }
+    catch (...) {
+        std::cerr << "Caught unknown exception\n";
+    }
+
+    return EXIT_FAILURE;
+}
+
+#endif
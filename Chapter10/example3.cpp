@@ -22,15 +22,35 @@
 #define PORT 22000
 #define MAX_SIZE 0x1000
 
+#define CONNECTIONS 4
+#define HIGH_WATERMARK 0x100000
+
+// -----------------------------------------------------------------------------
+// Binary Log Records
+// -----------------------------------------------------------------------------
+
+// A client built with BINARY_LOG sends binary log records instead of text,
+// using the same format as Chapter08's log.bin (so its example1_decoder can
+// render them): each record is a record_header followed by its payload, and
+// every connection starts with a dictionary record holding the client's
+// format strings. The server tells the two kinds of connection apart by the
+// dictionary ID that a binary connection starts with.
+
+#include "../Chapter08/binary_log.h"
+
 #ifdef SERVER
 
 #include <array>
+#include <string>
+#include <vector>
+#include <unordered_map>
 
 #include <sstream>
 #include <fstream>
 #include <iostream>
 #include <stdexcept>
 
+#include <poll.h>
 #include <unistd.h>
 #include <string.h>
 
@@ -39,11 +59,31 @@
 
 std::fstream g_log{"server_log.txt", std::ios::out | std::ios::app};
 
+// What the server knows about each connection: whether it sends text or
+// binary records (which is only known once its first four bytes arrive),
+// and the bytes it holds on to until then.
+//
+// Each binary connection is written to a file of its own, as every
+// connection starts with the dictionary of the client that opened it, and
+// clients built from different sources have different dictionaries. The
+// decoder reads a file in order and uses the latest dictionary it has seen,
+// so sharing a file would decode one client's records with another's
+// formats.
+
+struct peer
+{
+    bool detected{};
+    bool binary{};
+    std::string pending;
+    std::fstream file;
+};
+
 class myserver
 {
     int m_fd{};
-    int m_client{};
     struct sockaddr_in m_addr{};
+    std::unordered_map<int, peer> m_peers;
+    std::size_t m_binary_peers{};
 
 public:
 
@@ -71,46 +111,125 @@ public:
         );
     }
 
-    ssize_t recv(std::array<char, MAX_SIZE> &buf)
+    ssize_t recv(int client, std::array<char, MAX_SIZE> &buf)
     {
         return ::recv(
-            m_client,
+            client,
             buf.data(),
             buf.size(),
             0
         );
     }
 
+    // Clients keep a pool of connections open, so the listening socket is
+    // polled along with every accepted connection, and the server exits once
+    // all of them have been closed.
+
     void log()
     {
-        if (::listen(m_fd, 0) == -1) {
+        if (::listen(m_fd, CONNECTIONS) == -1) {
             throw std::runtime_error(strerror(errno));
         }
 
-        if (m_client = ::accept(m_fd, nullptr, nullptr); m_client == -1) {
-            throw std::runtime_error(strerror(errno));
-        }
+        std::vector<struct pollfd> fds{{m_fd, POLLIN, 0}};
+
+        // The receive buffer is reused for every read, and since only the
+        // first len bytes are ever written out, it is never zeroed.
 
-        while(true)
+        std::array<char, MAX_SIZE> buf;
+
+        auto accepted = false;
+        while (!accepted || fds.size() > 1)
         {
-            std::array<char, MAX_SIZE> buf{};
+            if (::poll(fds.data(), fds.size(), -1) == -1) {
+                throw std::runtime_error(strerror(errno));
+            }
 
-            if (auto len = recv(buf); len != 0) {
-                g_log.write(buf.data(), len);
-                std::clog.write(buf.data(), len);
+            if ((fds[0].revents & POLLIN) != 0) {
+                if (int c = ::accept(m_fd, nullptr, nullptr); c != -1) {
+                    fds.push_back({c, POLLIN, 0});
+                    accepted = true;
+                }
+                else {
+                    throw std::runtime_error(strerror(errno));
+                }
             }
-            else {
-                break;
+
+            for (auto iter = fds.begin() + 1; iter != fds.end();) {
+                if (iter->revents == 0) {
+                    ++iter;
+                    continue;
+                }
+
+                if (auto len = recv(iter->fd, buf); len > 0) {
+                    write(m_peers[iter->fd], buf.data(), static_cast<std::size_t>(len));
+                    ++iter;
+                }
+                else {
+                    if (auto &p = m_peers[iter->fd]; !p.binary) {
+                        write_text(p.pending.data(), p.pending.size());
+                    }
+
+                    m_peers.erase(iter->fd);
+
+                    close(iter->fd);
+                    iter = fds.erase(iter);
+                }
             }
         }
-
-        close(m_client);
     }
 
     ~myserver()
     {
         close(m_fd);
     }
+
+private:
+
+    void write_text(const char *buf, std::size_t len)
+    {
+        g_log.write(buf, static_cast<std::streamsize>(len));
+        std::clog.write(buf, static_cast<std::streamsize>(len));
+    }
+
+    void write(peer &p, const char *buf, std::size_t len)
+    {
+        if (p.detected && !p.binary) {
+            write_text(buf, len);
+            return;
+        }
+
+        p.pending.append(buf, len);
+
+        if (!p.detected) {
+            if (p.pending.size() < sizeof(uint32_t)) {
+                return;
+            }
+
+            uint32_t id;
+            memcpy(&id, p.pending.data(), sizeof(id));
+
+            p.detected = true;
+            p.binary = id == DICTIONARY_ID;
+
+            if (!p.binary) {
+                write_text(p.pending.data(), p.pending.size());
+                p.pending.clear();
+
+                return;
+            }
+
+            auto path = "server_log." + std::to_string(m_binary_peers++) + ".bin";
+            p.file.open(path, std::ios::out | std::ios::trunc | std::ios::binary);
+
+            if (!p.file) {
+                throw std::runtime_error("unable to open " + path);
+            }
+        }
+
+        p.file.write(p.pending.data(), static_cast<std::streamsize>(p.pending.size()));
+        p.pending.clear();
+    }
 };
 
 int
@@ -147,18 +266,27 @@ main(int argc, char** argv)
 #ifdef CLIENT
 
 #include <array>
+#include <memory>
 #include <string>
+#include <vector>
 #include <stdexcept>
+#include <string_view>
 
 #include <sstream>
 #include <fstream>
 #include <iostream>
 
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+
+#include <poll.h>
 #include <unistd.h>
 #include <string.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #ifdef DEBUG_LEVEL
 constexpr auto g_debug_level = DEBUG_LEVEL;
@@ -172,13 +300,31 @@ constexpr auto g_ndebug = true;
 constexpr auto g_ndebug = false;
 #endif
 
-class myclient
+
+// Each connection is persistent and keeps a queue of pending bytes, so
+// send() never waits for the server: it queues the message, and writes as
+// much as the socket accepts without blocking. This allows many messages to
+// be outstanding (pipelined) on a single connection. send() only blocks once
+// more than HIGH_WATERMARK bytes are pending, which keeps a slow server from
+// causing unbounded memory growth. Bytes that have been sent are dropped
+// from the front of the queue once they make up more than half of it, so
+// the queue stays within about twice HIGH_WATERMARK even if it never fully
+// drains, while each byte is still only moved a constant number of times.
+
+class myconnection
 {
     int m_fd{};
     struct sockaddr_in m_addr{};
 
+    bool m_cork{};
+
+    std::mutex m_mutex;
+    std::vector<char> m_pending;
+    std::size_t m_offset{};
+
 public:
-    explicit myclient(uint16_t port)
+    myconnection(uint16_t port, bool nodelay, bool cork) :
+        m_cork{cork}
     {
         if (m_fd = ::socket(AF_INET, SOCK_STREAM, 0); m_fd == -1) {
             throw std::runtime_error(strerror(errno));
@@ -191,6 +337,14 @@ public:
         if (connect() == -1) {
             throw std::runtime_error(strerror(errno));
         }
+
+        if (nodelay && setopt(TCP_NODELAY, 1) == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        if (cork && setopt(TCP_CORK, 1) == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
     }
 
     int connect()
@@ -202,25 +356,196 @@ public:
         );
     }
 
-    ssize_t send(const std::string &buf)
+    int setopt(int opt, int val)
     {
-        return ::send(
-            m_fd,
-            buf.data(),
-            buf.size(),
-            0
-        );
+        return ::setsockopt(m_fd, IPPROTO_TCP, opt, &val, sizeof(val));
     }
 
-    ~myclient()
+    void send(std::string_view buf)
+    {
+        std::lock_guard lock(m_mutex);
+
+        // Nothing is queued, so try to send directly from buf, and only
+        // queue whatever the socket does not accept.
+
+        if (m_pending.empty()) {
+            auto ret = ::send(m_fd, buf.data(), buf.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+
+            if (ret == -1) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    throw std::runtime_error(strerror(errno));
+                }
+
+                ret = 0;
+            }
+
+            buf.remove_prefix(static_cast<std::size_t>(ret));
+        }
+
+        m_pending.insert(m_pending.end(), buf.begin(), buf.end());
+        drain();
+
+        while (m_pending.size() - m_offset > HIGH_WATERMARK) {
+            wait_writable();
+            drain();
+        }
+    }
+
+    // Blocks until everything queued has been handed to the kernel. When
+    // TCP_CORK is used, the cork is also pulled so that a final partial
+    // frame is sent immediately.
+
+    void flush()
+    {
+        std::lock_guard lock(m_mutex);
+
+        while (!m_pending.empty()) {
+            wait_writable();
+            drain();
+        }
+
+        if (m_cork) {
+            setopt(TCP_CORK, 0);
+            setopt(TCP_CORK, 1);
+        }
+    }
+
+    ~myconnection()
     {
         close(m_fd);
     }
+
+private:
+
+    void drain()
+    {
+        while (m_offset < m_pending.size()) {
+            auto ret = ::send(
+                m_fd,
+                &m_pending[m_offset],
+                m_pending.size() - m_offset,
+                MSG_DONTWAIT | MSG_NOSIGNAL
+            );
+
+            if (ret == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+
+                throw std::runtime_error(strerror(errno));
+            }
+
+            m_offset += static_cast<std::size_t>(ret);
+        }
+
+        if (m_offset == m_pending.size()) {
+            m_pending.clear();
+            m_offset = 0;
+        }
+        else if (m_offset > m_pending.size() / 2) {
+            m_pending.erase(m_pending.begin(), m_pending.begin() + static_cast<std::ptrdiff_t>(m_offset));
+            m_offset = 0;
+        }
+    }
+
+    void wait_writable()
+    {
+        struct pollfd pfd = {m_fd, POLLOUT, 0};
+
+        if (::poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+            throw std::runtime_error(strerror(errno));
+        }
+    }
+};
+
+// The client keeps a pool of persistent connections. Each thread is
+// assigned one connection the first time it sends, so messages from the
+// same thread stay in order, while different threads do not contend on the
+// same connection. A thread remembers its assignment per client (by an id
+// that is never reused), since it may send through more than one.
+
+std::atomic<std::size_t> g_client_ids{};
+
+class myclient
+{
+    std::vector<std::unique_ptr<myconnection>> m_connections;
+    std::atomic<std::size_t> m_next{};
+    const std::size_t m_id{g_client_ids++};
+
+public:
+    explicit myclient(
+        uint16_t port, std::size_t connections = CONNECTIONS,
+        bool nodelay = true, bool cork = false)
+    {
+        if (connections == 0) {
+            throw std::invalid_argument("connections == 0");
+        }
+
+        for (std::size_t i = 0; i < connections; i++) {
+            m_connections.push_back(
+                std::make_unique<myconnection>(port, nodelay, cork)
+            );
+
+#ifdef BINARY_LOG
+            m_connections.back()->send(log_dictionary());
+#endif
+        }
+    }
+
+    void send(std::string_view buf)
+    {
+        thread_local std::unordered_map<std::size_t, std::size_t> assigned;
+
+        auto [iter, added] = assigned.try_emplace(m_id);
+        if (added) {
+            iter->second = m_next++ % m_connections.size();
+        }
+
+        m_connections[iter->second]->send(buf);
+    }
+
+    void flush()
+    {
+        for (const auto &connection : m_connections) {
+            connection->flush();
+        }
+    }
 };
 
 myclient g_client{PORT};
 std::fstream g_log{"client_log.txt", std::ios::out | std::ios::app};
 
+#ifdef BINARY_LOG
+
+// Every record is written to the local log and sent to the server. The
+// formats and the encoding are shared with Chapter08 (see binary_log.h).
+
+binary_log g_blog{"client_log.bin"};
+
+template<typename... Args>
+void
+blog(const log_format &format, const Args &... args)
+{
+    std::array<char, MAX_RECORD> buf;
+    auto size = encode_record(buf, format, args...);
+
+    g_blog.write(buf.data(), size);
+    g_client.send({buf.data(), size});
+}
+
+#define BLOG(LEVEL, FMT, ...)                                                   \
+    do {                                                                        \
+        if constexpr (!g_ndebug && ((LEVEL) <= g_debug_level)) {                \
+            using types = type_string<decltype(std::make_tuple(__VA_ARGS__))>;  \
+            static const log_format format                                      \
+                __attribute__((section("log_formats"), aligned(8), used)) =     \
+                {(LEVEL), FMT, types::value};                                   \
+            blog(format, ##__VA_ARGS__);                                        \
+        }                                                                       \
+    } while (0)
+
+#endif
+
 template <std::size_t LEVEL>
 constexpr void log(void(*func)()) {
     if constexpr (!g_ndebug && (LEVEL <= g_debug_level)) {
@@ -250,12 +575,17 @@ protected_main(int argc, char** argv)
     (void) argc;
     (void) argv;
 
+#ifdef BINARY_LOG
+    BLOG(0, "Hello {}", "World");
+#else
     log<0>([]{
         std::clog << "Hello World\n";
     });
+#endif
 
     std::clog << "Hello World\n";
 
+    g_client.flush();
     return EXIT_SUCCESS;
 }
 
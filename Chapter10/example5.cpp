@@ -22,6 +22,463 @@
 #define PORT 22000
 #define MAX_SIZE 0x1000
 
+#include <array>
+#include <string>
+#include <charconv>
+#include <string_view>
+#include <stdexcept>
+
+#include <ctype.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include <nlohmann/json.hpp>
+using json = nlohmann::json;
+
+#ifdef JSON_FORMAT
+constexpr auto g_json_format = true;
+#else
+constexpr auto g_json_format = false;
+#endif
+
+// -----------------------------------------------------------------------------
+// Binary Packet Format
+// -----------------------------------------------------------------------------
+
+// The binary format is a fixed-size header (in network byte order) followed
+// directly by the bytes of msg. Since every field lives at a known offset,
+// the receiver can read the packet in place from the receive buffer without
+// parsing it or allocating memory. JSON is still supported as a debug format
+// (see JSON_FORMAT), and the server tells the two apart using the magic
+// number and version at the start of the header. Anything else is handed to
+// the JSON scanner, which rejects it if it is not JSON either.
+
+constexpr uint32_t PACKET_MAGIC = 0x42494E31;
+constexpr uint32_t PACKET_VERSION = 1;
+
+struct packet_header
+{
+    uint32_t magic;
+    uint32_t version;
+    int32_t data1;
+    int32_t data2;
+    uint32_t msg_len;
+};
+
+std::size_t
+encode_packet(
+    std::array<char, MAX_SIZE> &buf, int32_t data1, int32_t data2,
+    std::string_view msg)
+{
+    if (msg.size() > buf.size() - sizeof(packet_header)) {
+        throw std::out_of_range("msg.size() > buf.size() - sizeof(packet_header)");
+    }
+
+    packet_header hdr = {
+        htonl(PACKET_MAGIC),
+        htonl(PACKET_VERSION),
+        static_cast<int32_t>(htonl(static_cast<uint32_t>(data1))),
+        static_cast<int32_t>(htonl(static_cast<uint32_t>(data2))),
+        htonl(static_cast<uint32_t>(msg.size()))
+    };
+
+    memcpy(buf.data(), &hdr, sizeof(hdr));
+    memcpy(buf.data() + sizeof(hdr), msg.data(), msg.size());
+
+    return sizeof(hdr) + msg.size();
+}
+
+class packet_view
+{
+public:
+
+    packet_view(const char *buf, std::size_t len)
+    {
+        if (len < sizeof(m_hdr)) {
+            throw std::runtime_error("packet too small");
+        }
+
+        memcpy(&m_hdr, buf, sizeof(m_hdr));
+
+        if (ntohl(m_hdr.magic) != PACKET_MAGIC) {
+            throw std::runtime_error("invalid packet magic");
+        }
+
+        if (ntohl(m_hdr.version) != PACKET_VERSION) {
+            throw std::runtime_error("unsupported packet version");
+        }
+
+        if (ntohl(m_hdr.msg_len) > len - sizeof(m_hdr)) {
+            throw std::runtime_error("invalid packet msg_len");
+        }
+
+        m_msg = buf + sizeof(m_hdr);
+    }
+
+    static bool is_packet(const char *buf, std::size_t len)
+    {
+        packet_header hdr{};
+
+        if (len < sizeof(hdr)) {
+            return false;
+        }
+
+        memcpy(&hdr, buf, sizeof(hdr));
+        return ntohl(hdr.magic) == PACKET_MAGIC && ntohl(hdr.version) == PACKET_VERSION;
+    }
+
+    int32_t data1() const
+    { return static_cast<int32_t>(ntohl(static_cast<uint32_t>(m_hdr.data1))); }
+
+    int32_t data2() const
+    { return static_cast<int32_t>(ntohl(static_cast<uint32_t>(m_hdr.data2))); }
+
+    std::string_view msg() const
+    { return {m_msg, ntohl(m_hdr.msg_len)}; }
+
+private:
+
+    packet_header m_hdr{};
+    const char *m_msg{};
+};
+
+// -----------------------------------------------------------------------------
+// JSON Scanner
+// -----------------------------------------------------------------------------
+
+// When JSON is used on the wire, json_view extracts fields on demand instead
+// of building a DOM. Parsing happens in two stages. The first stage scans the
+// packet 64 bytes at a time (using AVX2 or SSE2 when the CPU supports it) and
+// records the offset of every quote and every structural character that is
+// not inside of a string. The second stage walks this index to find the
+// requested key at the top level of the object, and returns its value as a
+// view into the receive buffer. Neither stage allocates memory.
+//
+// Note that string values are returned as-is, meaning escape sequences are
+// not decoded.
+
+struct block_masks
+{
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t structural;
+};
+
+block_masks
+scan_block_scalar(const char *in)
+{
+    block_masks m{};
+
+    for (uint64_t i = 0; i < 64; i++) {
+        switch (in[i]) {
+            case '"':
+                m.quote |= 1ULL << i;
+                break;
+
+            case '\\':
+                m.backslash |= 1ULL << i;
+                break;
+
+            case '{':
+            case '}':
+            case '[':
+            case ']':
+            case ':':
+            case ',':
+                m.structural |= 1ULL << i;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    return m;
+}
+
+#if defined(__x86_64__)
+
+// '[' and ']' only differ from '{' and '}' by bit 5, so OR'ing each byte with
+// 0x20 allows all four brackets to be found using two comparisons.
+
+block_masks
+scan_block_sse2(const char *in)
+{
+    block_masks m{};
+
+    for (auto i = 0; i < 4; i++) {
+        auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + (i * 16)));
+        auto l = _mm_or_si128(v, _mm_set1_epi8(0x20));
+
+        auto q = _mm_cmpeq_epi8(v, _mm_set1_epi8('"'));
+        auto b = _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'));
+        auto s = _mm_or_si128(
+            _mm_or_si128(
+                _mm_cmpeq_epi8(l, _mm_set1_epi8('{')),
+                _mm_cmpeq_epi8(l, _mm_set1_epi8('}'))
+            ),
+            _mm_or_si128(
+                _mm_cmpeq_epi8(v, _mm_set1_epi8(':')),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8(','))
+            )
+        );
+
+        auto shift = i * 16;
+        m.quote |= static_cast<uint64_t>(_mm_movemask_epi8(q) & 0xFFFF) << shift;
+        m.backslash |= static_cast<uint64_t>(_mm_movemask_epi8(b) & 0xFFFF) << shift;
+        m.structural |= static_cast<uint64_t>(_mm_movemask_epi8(s) & 0xFFFF) << shift;
+    }
+
+    return m;
+}
+
+__attribute__((target("avx2"))) block_masks
+scan_block_avx2(const char *in)
+{
+    block_masks m{};
+
+    for (auto i = 0; i < 2; i++) {
+        auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + (i * 32)));
+        auto l = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+
+        auto q = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'));
+        auto b = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'));
+        auto s = _mm256_or_si256(
+            _mm256_or_si256(
+                _mm256_cmpeq_epi8(l, _mm256_set1_epi8('{')),
+                _mm256_cmpeq_epi8(l, _mm256_set1_epi8('}'))
+            ),
+            _mm256_or_si256(
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')),
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8(','))
+            )
+        );
+
+        auto shift = i * 32;
+        m.quote |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(q))) << shift;
+        m.backslash |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(b))) << shift;
+        m.structural |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(s))) << shift;
+    }
+
+    return m;
+}
+
+#endif
+
+using scan_block_t = block_masks(*)(const char *);
+
+scan_block_t
+select_scan_block()
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+        return scan_block_avx2;
+    }
+
+    return scan_block_sse2;
+#else
+    return scan_block_scalar;
+#endif
+}
+
+#ifdef SCALAR_SCAN
+scan_block_t g_scan_block = scan_block_scalar;
+#else
+scan_block_t g_scan_block = select_scan_block();
+#endif
+
+class json_view
+{
+public:
+
+    json_view(const char *buf, std::size_t len) :
+        m_buf{buf}
+    {
+        if (len > MAX_SIZE) {
+            throw std::out_of_range("len > MAX_SIZE");
+        }
+
+        uint64_t in_string = 0;
+        bool escape_next = false;
+
+        for (std::size_t i = 0; i < len; i += 64) {
+            block_masks m;
+
+            if (len - i >= 64) {
+                m = g_scan_block(buf + i);
+            }
+            else {
+                std::array<char, 64> tail;
+                tail.fill(' ');
+
+                memcpy(tail.data(), buf + i, len - i);
+                m = g_scan_block(tail.data());
+            }
+
+            // Backslashes are rare, so escaped characters are found with a
+            // simple loop, and only when the block (or the carry from the
+            // previous block) actually contains one.
+
+            uint64_t escaped = 0;
+            if (m.backslash != 0 || escape_next) {
+                for (uint64_t bit = 0; bit < 64; bit++) {
+                    if (escape_next) {
+                        escaped |= 1ULL << bit;
+                        escape_next = false;
+                    }
+                    else if ((m.backslash & (1ULL << bit)) != 0) {
+                        escape_next = true;
+                    }
+                }
+            }
+
+            auto quote = m.quote & ~escaped;
+            auto strings = prefix_xor(quote) ^ in_string;
+            in_string = static_cast<uint64_t>(static_cast<int64_t>(strings) >> 63);
+
+            auto bits = (m.structural & ~strings) | quote;
+            while (bits != 0) {
+                m_index[m_num++] = static_cast<uint32_t>(i) + __builtin_ctzll(bits);
+                bits &= bits - 1;
+            }
+        }
+
+        if (m_num == 0 || m_buf[m_index[0]] != '{') {
+            throw std::runtime_error("json: expected object");
+        }
+    }
+
+    std::string_view raw(std::string_view key) const
+    {
+        std::size_t i = 1;
+
+        while (i < m_num && at(i) != '}') {
+            if (at(i) != '"' || i + 2 >= m_num || at(i + 2) != ':') {
+                throw std::runtime_error("json: malformed object");
+            }
+
+            std::string_view k{
+                m_buf + m_index[i] + 1, m_index[i + 1] - m_index[i] - 1
+            };
+
+            auto start = m_index[i + 2] + 1;
+            auto next = skip_value(i + 3);
+
+            if (k == key) {
+                return trim({m_buf + start, m_index[next] - start});
+            }
+
+            i = at(next) == ',' ? next + 1 : next;
+        }
+
+        throw std::runtime_error("json: key not found");
+    }
+
+    int64_t get_int(std::string_view key) const
+    {
+        int64_t val{};
+        auto r = raw(key);
+
+        if (auto [p, ec] = std::from_chars(r.data(), r.data() + r.size(), val);
+            ec != std::errc() || p != r.data() + r.size())
+        {
+            throw std::runtime_error("json: value is not an integer");
+        }
+
+        return val;
+    }
+
+    std::string_view get_string(std::string_view key) const
+    {
+        auto r = raw(key);
+
+        if (r.size() < 2 || r.front() != '"' || r.back() != '"') {
+            throw std::runtime_error("json: value is not a string");
+        }
+
+        return r.substr(1, r.size() - 2);
+    }
+
+private:
+
+    static uint64_t prefix_xor(uint64_t bits)
+    {
+        bits ^= bits << 1;
+        bits ^= bits << 2;
+        bits ^= bits << 4;
+        bits ^= bits << 8;
+        bits ^= bits << 16;
+        bits ^= bits << 32;
+
+        return bits;
+    }
+
+    static std::string_view trim(std::string_view str)
+    {
+        while (!str.empty() && isspace(str.front())) {
+            str.remove_prefix(1);
+        }
+
+        while (!str.empty() && isspace(str.back())) {
+            str.remove_suffix(1);
+        }
+
+        return str;
+    }
+
+    char at(std::size_t i) const
+    { return m_buf[m_index[i]]; }
+
+    // Returns the index of the ',' or '}' that follows the value starting at
+    // index i (strings take two entries, one for each quote).
+
+    std::size_t skip_value(std::size_t i) const
+    {
+        if (i >= m_num) {
+            throw std::runtime_error("json: truncated value");
+        }
+
+        switch (at(i)) {
+            case '"':
+                i += 2;
+                break;
+
+            case '{':
+            case '[': {
+                std::size_t depth = 0;
+                do {
+                    switch (at(i)) {
+                        case '{': case '[': depth++; break;
+                        case '}': case ']': depth--; break;
+                        default: break;
+                    }
+                    i++;
+                }
+                while (depth != 0 && i < m_num);
+                break;
+            }
+
+            default:
+                break;
+        }
+
+        if (i >= m_num || (at(i) != ',' && at(i) != '}')) {
+            throw std::runtime_error("json: malformed value");
+        }
+
+        return i;
+    }
+
+    const char *m_buf;
+
+    std::size_t m_num{};
+    std::array<uint32_t, MAX_SIZE> m_index;
+};
+
 #ifdef SERVER
 
 #include <iostream>
@@ -33,9 +490,6 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 
-#include <nlohmann/json.hpp>
-using json = nlohmann::json;
-
 class myserver
 {
 public:
@@ -91,13 +545,23 @@ public:
             throw std::runtime_error(strerror(errno));
         }
 
-        if (auto len = recv(buf); len != 0) {
-            auto j = json::parse(buf.data(), buf.data() + len);
-
-            std::cout << "data1: " << j["data1"] << '\n';
-            std::cout << "data2: " << j["data2"] << '\n';
-            std::cout << "msg: " << j["msg"] << '\n';
-            std::cout << "len: " << len << '\n';
+        if (auto len = recv(buf); len > 0) {
+            if (packet_view::is_packet(buf.data(), len)) {
+                packet_view p{buf.data(), static_cast<std::size_t>(len)};
+
+                std::cout << "data1: " << p.data1() << '\n';
+                std::cout << "data2: " << p.data2() << '\n';
+                std::cout << "msg: " << p.msg() << '\n';
+                std::cout << "len: " << len << '\n';
+            }
+            else {
+                json_view j{buf.data(), static_cast<std::size_t>(len)};
+
+                std::cout << "data1: " << j.get_int("data1") << '\n';
+                std::cout << "data2: " << j.get_int("data2") << '\n';
+                std::cout << "msg: " << j.get_string("msg") << '\n';
+                std::cout << "len: " << len << '\n';
+            }
         }
 
         close(m_client);
@@ -153,9 +617,6 @@ main(int argc, char** argv)
 #include <sys/socket.h>
 #include <netinet/in.h>
 
-#include <nlohmann/json.hpp>
-using json = nlohmann::json;
-
 class myclient
 {
 public:
@@ -198,15 +659,31 @@ public:
         );
     }
 
+    ssize_t send(const std::array<char, MAX_SIZE> &buf, std::size_t len)
+    {
+        return ::send(
+            m_fd,
+            buf.data(),
+            len,
+            0
+        );
+    }
+
     void send_packet()
     {
-        json j;
+        if constexpr (g_json_format) {
+            json j;
 
-        j["data1"] = 42;
-        j["data2"] = 43;
-        j["msg"] = "Hello World";
+            j["data1"] = 42;
+            j["data2"] = 43;
+            j["msg"] = "Hello World";
 
-        send(j.dump());
+            send(j.dump());
+        }
+        else {
+            std::array<char, MAX_SIZE> buf;
+            send(buf, encode_packet(buf, 42, 43, "Hello World"));
+        }
     }
 
 private:
@@ -246,3 +723,201 @@ main(int argc, char** argv)
 }
 
 #endif
+
+#ifdef BENCHMARK
+
+#include <chrono>
+#include <vector>
+#include <fstream>
+#include <iostream>
+
+#include <new>
+#include <cstdlib>
+
+// -----------------------------------------------------------------------------
+// Allocation Counter
+// -----------------------------------------------------------------------------
+
+// Only allocations are counted, but operator delete() is replaced as well,
+// so that memory from the malloc() below is always released with free().
+// The replacements are kept out of line, as otherwise GCC inlines free()
+// into code that called operator new() and warns about the mismatch.
+
+std::size_t g_allocations{};
+
+[[gnu::noinline]] void *
+operator new(std::size_t size)
+{
+    g_allocations++;
+
+    if (auto ptr = malloc(size)) {
+        return ptr;
+    }
+
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void
+operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+[[gnu::noinline]] void
+operator delete(void *ptr, std::size_t) noexcept
+{
+    free(ptr);
+}
+
+// -----------------------------------------------------------------------------
+// Benchmark
+// -----------------------------------------------------------------------------
+
+template<typename FUNC>
+auto benchmark(FUNC func) {
+    auto stime = std::chrono::high_resolution_clock::now();
+    func();
+    auto etime = std::chrono::high_resolution_clock::now();
+
+    return etime - stime;
+}
+
+template<typename FUNC>
+void
+report(const char *name, std::size_t num, FUNC func)
+{
+    using namespace std::chrono;
+
+    auto allocations = g_allocations;
+    auto d = benchmark([&]{
+        for (std::size_t i = 0; i < num; i++) {
+            func();
+        }
+    });
+    allocations = g_allocations - allocations;
+
+    auto secs = duration_cast<duration<double>>(d).count();
+
+    std::cout << name << ":\n";
+    std::cout << " - msgs/sec: " << static_cast<uint64_t>(num / secs) << '\n';
+    std::cout << " - allocs/msg: "
+              << static_cast<double>(allocations) / num << '\n';
+}
+
+int
+protected_main(int argc, char** argv)
+{
+    std::size_t num = 1000000;
+    if (argc > 1) {
+        num = std::stoul(argv[1]);
+    }
+
+    // Both formats encode into a send buffer, which is then copied into a
+    // receive buffer (standing in for the socket) and decoded in place.
+
+    int64_t sum = 0;
+    std::array<char, MAX_SIZE> sendbuf;
+    std::array<char, MAX_SIZE> recvbuf;
+
+    report("json", num, [&]{
+        json j;
+
+        j["data1"] = 42;
+        j["data2"] = 43;
+        j["msg"] = "Hello World";
+
+        auto str = j.dump();
+        memcpy(recvbuf.data(), str.data(), str.size());
+
+        auto r = json::parse(recvbuf.data(), recvbuf.data() + str.size());
+        sum += r["data1"].get<int32_t>();
+        sum += r["data2"].get<int32_t>();
+        sum += r["msg"].get_ref<const std::string &>().size();
+    });
+
+    report("binary", num, [&]{
+        auto len = encode_packet(sendbuf, 42, 43, "Hello World");
+        memcpy(recvbuf.data(), sendbuf.data(), len);
+
+        packet_view p{recvbuf.data(), len};
+        sum += p.data1();
+        sum += p.data2();
+        sum += p.msg().size();
+    });
+
+    // The decode benchmarks replay a corpus of recorded JSON messages (one per
+    // line) if a file is provided, otherwise a corpus is generated with
+    // varying msg lengths, including escaped characters.
+
+    std::vector<std::string> corpus;
+
+    if (argc > 2) {
+        if (auto file = std::fstream(argv[2], std::ios::in)) {
+            for (std::string line; std::getline(file, line);) {
+                if (!line.empty() && line.size() <= MAX_SIZE) {
+                    corpus.push_back(line);
+                }
+            }
+        }
+        else {
+            throw std::runtime_error("failed to open corpus");
+        }
+    }
+    else {
+        for (auto i = 0; i < 1024; i++) {
+            json j;
+
+            j["data1"] = i;
+            j["data2"] = i * 7;
+            j["msg"] = std::string(i % 512, 'x') + "\"Hello World\"";
+
+            corpus.push_back(j.dump());
+        }
+    }
+
+    if (corpus.empty()) {
+        throw std::runtime_error("corpus is empty");
+    }
+
+    std::size_t next = 0;
+
+    report("json decode (dom)", num, [&]{
+        const auto &msg = corpus[next++ % corpus.size()];
+
+        auto r = json::parse(msg.data(), msg.data() + msg.size());
+        sum += r["data1"].get<int64_t>();
+        sum += r["data2"].get<int64_t>();
+        sum += r["msg"].get_ref<const std::string &>().size();
+    });
+
+    report("json decode (scan)", num, [&]{
+        const auto &msg = corpus[next++ % corpus.size()];
+
+        json_view r{msg.data(), msg.size()};
+        sum += r.get_int("data1");
+        sum += r.get_int("data2");
+        sum += r.get_string("msg").size();
+    });
+
+    std::cout << "checksum: " << sum << '\n';
+    return EXIT_SUCCESS;
+}
+
+int
+main(int argc, char** argv)
+{
+    try {
+        return protected_main(argc, argv);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Caught unhandled exception:\n";
+        std::cerr << " - what(): " << e.what() << '\n';
+    }
+    catch (...) {
+        std::cerr << "Caught unknown exception\n";
+    }
+
+    return EXIT_FAILURE;
+}
+
+#endif
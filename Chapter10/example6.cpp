@@ -0,0 +1,566 @@
+//
+// Copyright (C) 2018 Rian Quinn <rianquinn@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#define PORT 22000
+#define MAX_SIZE 0x10000
+
+// Buffers at least this large are sent with MSG_ZEROCOPY, while smaller
+// buffers are copied. Pinning pages and reaping completions from the error
+// queue has a fixed cost, so zero-copy only pays off for large buffers (use
+// example6_benchmark to find the crossover on a given machine).
+
+#define ZEROCOPY_THRESHOLD 0x10000
+
+#if defined(SERVER) || defined(BENCHMARK)
+
+#include <vector>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+class myserver
+{
+    int m_fd{};
+    struct sockaddr_in m_addr{};
+
+public:
+
+    explicit myserver(uint16_t port)
+    {
+        if (m_fd = ::socket(AF_INET, SOCK_STREAM, 0); m_fd == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        m_addr.sin_family = AF_INET;
+        m_addr.sin_port = htons(port);
+        m_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+        if (this->bind() == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        if (::listen(m_fd, 0) == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+    }
+
+    int bind()
+    {
+        return ::bind(
+            m_fd,
+            reinterpret_cast<struct sockaddr *>(&m_addr),
+            sizeof(m_addr)
+        );
+    }
+
+    uint16_t port()
+    {
+        struct sockaddr_in addr{};
+        socklen_t len = sizeof(addr);
+
+        if (::getsockname(m_fd, reinterpret_cast<struct sockaddr *>(&addr), &len) == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        return ntohs(addr.sin_port);
+    }
+
+    // Accepts a single connection and reads from it until the client
+    // closes it, returning the number of bytes received.
+
+    uint64_t drain()
+    {
+        int client;
+        if (client = ::accept(m_fd, nullptr, nullptr); client == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        uint64_t total = 0;
+        std::vector<char> buf(MAX_SIZE);
+
+        while (true) {
+            auto len = ::recv(client, buf.data(), buf.size(), 0);
+
+            if (len == -1) {
+                close(client);
+                throw std::runtime_error(strerror(errno));
+            }
+
+            if (len == 0) {
+                break;
+            }
+
+            total += static_cast<uint64_t>(len);
+        }
+
+        close(client);
+        return total;
+    }
+
+    ~myserver()
+    {
+        close(m_fd);
+    }
+};
+
+#endif
+
+#if defined(CLIENT) || defined(BENCHMARK)
+
+#include <stdexcept>
+
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+
+#include <linux/errqueue.h>
+
+class myclient
+{
+    int m_fd{};
+    struct sockaddr_in m_addr{};
+
+    bool m_zerocopy{};
+    std::size_t m_threshold{};
+
+    uint64_t m_pending{};
+    uint64_t m_copied{};
+
+public:
+
+    explicit myclient(uint16_t port, std::size_t threshold = ZEROCOPY_THRESHOLD) :
+        m_threshold{threshold}
+    {
+        if (m_fd = ::socket(AF_INET, SOCK_STREAM, 0); m_fd == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        m_addr.sin_family = AF_INET;
+        m_addr.sin_port = htons(port);
+        m_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if (connect() == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        // If the kernel does not support SO_ZEROCOPY, every buffer is copied.
+
+        int on = 1;
+        m_zerocopy = ::setsockopt(m_fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+    }
+
+    int connect()
+    {
+        return ::connect(
+            m_fd,
+            reinterpret_cast<struct sockaddr *>(&m_addr),
+            sizeof(m_addr)
+        );
+    }
+
+    // Sends all of buf. Large buffers are sent with MSG_ZEROCOPY, meaning the
+    // kernel pins the pages of buf instead of copying them, so buf must not
+    // be modified or freed until flush() returns.
+
+    void send(const char *buf, std::size_t len)
+    {
+        auto flags = m_zerocopy && len >= m_threshold ? MSG_ZEROCOPY : 0;
+
+        while (len != 0) {
+            auto ret = ::send(m_fd, buf, len, flags);
+
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                // The socket ran out of option memory for tracking pinned
+                // pages, which is freed as completions are reaped.
+
+                if (errno == ENOBUFS && flags != 0 && m_pending != 0) {
+                    wait_for_completion();
+                    continue;
+                }
+
+                throw std::runtime_error(strerror(errno));
+            }
+
+            if (flags != 0) {
+                m_pending++;
+            }
+
+            buf += ret;
+            len -= static_cast<std::size_t>(ret);
+        }
+    }
+
+    // Sends the contents of a file using sendfile(), so the data goes from
+    // the page cache to the socket without passing through user space.
+
+    void send_file(const char *path)
+    {
+        int fd;
+        if (fd = ::open(path, O_RDONLY); fd == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        struct stat st{};
+        if (::fstat(fd, &st) == -1) {
+            close(fd);
+            throw std::runtime_error(strerror(errno));
+        }
+
+        off_t offset = 0;
+        while (offset < st.st_size) {
+            auto ret = ::sendfile(
+                m_fd, fd, &offset, static_cast<std::size_t>(st.st_size - offset)
+            );
+
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                close(fd);
+                throw std::runtime_error(strerror(errno));
+            }
+
+            if (ret == 0) {
+                break;
+            }
+        }
+
+        close(fd);
+    }
+
+    // Waits until the kernel has released every buffer sent with
+    // MSG_ZEROCOPY.
+
+    void flush()
+    {
+        while (m_pending != 0) {
+            wait_for_completion();
+        }
+    }
+
+    // Returns the number of MSG_ZEROCOPY sends that the kernel ended up
+    // copying anyway (for example, loopback traffic is always copied).
+
+    uint64_t copied() const
+    { return m_copied; }
+
+    ~myclient()
+    {
+        close(m_fd);
+    }
+
+private:
+
+    void wait_for_completion()
+    {
+        // Completions are queued on the socket's error queue, which poll()
+        // reports as POLLERR even when no events are requested.
+
+        struct pollfd pfd = {m_fd, 0, 0};
+        if (::poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        reap();
+    }
+
+    void reap()
+    {
+        while (true) {
+            union {
+                char buf[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in))];
+                struct cmsghdr align;
+            } control;
+
+            struct msghdr msg{};
+            msg.msg_control = control.buf;
+            msg.msg_controllen = sizeof(control.buf);
+
+            if (::recvmsg(m_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return;
+                }
+
+                throw std::runtime_error(strerror(errno));
+            }
+
+            for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR) {
+                    continue;
+                }
+
+                struct sock_extended_err serr;
+                memcpy(&serr, CMSG_DATA(cmsg), sizeof(serr));
+
+                if (serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr.ee_errno != 0) {
+                    throw std::runtime_error("unexpected error queue message");
+                }
+
+                // Each notification covers the inclusive range of send()
+                // calls [ee_info, ee_data].
+
+                auto num = static_cast<uint64_t>(serr.ee_data - serr.ee_info) + 1;
+
+                m_pending -= num;
+                if ((serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0) {
+                    m_copied += num;
+                }
+            }
+        }
+    }
+};
+
+#endif
+
+#ifdef SERVER
+
+#include <iostream>
+
+int
+protected_main(int argc, char** argv)
+{
+    (void) argc;
+    (void) argv;
+
+    myserver server{PORT};
+
+    while (true) {
+        std::cout << "received: " << server.drain() << " bytes\n";
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    try {
+        return protected_main(argc, argv);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Caught unhandled exception:\n";
+        std::cerr << " - what(): " << e.what() << '\n';
+    }
+    catch (...) {
+        std::cerr << "Caught unknown exception\n";
+    }
+
+    return EXIT_FAILURE;
+}
+
+#endif
+
+#ifdef CLIENT
+
+#include <vector>
+#include <iostream>
+
+int
+protected_main(int argc, char** argv)
+{
+    myclient client{PORT};
+
+    // usage: example6_client [file]
+    //
+    // With a file (for example, server_log.txt) the file is sent using
+    // sendfile(), otherwise a large buffer is sent using MSG_ZEROCOPY.
+
+    if (argc > 1) {
+        client.send_file(argv[1]);
+    }
+    else {
+        std::vector<char> buf(ZEROCOPY_THRESHOLD * 16, 'x');
+
+        client.send(buf.data(), buf.size());
+        client.flush();
+
+        std::cout << "zerocopy sends copied by the kernel: "
+                  << client.copied() << '\n';
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int
+main(int argc, char** argv)
+{
+    try {
+        return protected_main(argc, argv);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Caught unhandled exception:\n";
+        std::cerr << " - what(): " << e.what() << '\n';
+    }
+    catch (...) {
+        std::cerr << "Caught unknown exception\n";
+    }
+
+    return EXIT_FAILURE;
+}
+
+#endif
+
+#ifdef BENCHMARK
+
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <fstream>
+#include <iostream>
+
+template<typename FUNC>
+auto benchmark(FUNC func) {
+    auto stime = std::chrono::high_resolution_clock::now();
+    func();
+    auto etime = std::chrono::high_resolution_clock::now();
+
+    return etime - stime;
+}
+
+// Sends total bytes to a sink on loopback, size bytes per send(), and
+// returns the throughput in GB/s.
+
+double
+run(myserver &server, std::size_t size, std::size_t threshold, uint64_t total)
+{
+    using namespace std::chrono;
+
+    std::vector<char> buf(size, 'x');
+    std::thread sink{[&server]{ server.drain(); }};
+
+    auto d = benchmark([&]{
+        myclient client{server.port(), threshold};
+
+        for (uint64_t sent = 0; sent < total; sent += size) {
+            client.send(buf.data(), buf.size());
+        }
+
+        client.flush();
+    });
+
+    sink.join();
+    return total / duration_cast<duration<double>>(d).count() / 1e9;
+}
+
+int
+protected_main(int argc, char** argv)
+{
+    using namespace std::chrono;
+
+    uint64_t total = argc > 1 ? std::stoull(argv[1], nullptr, 0) : 0x10000000;
+    myserver server{0};
+
+    // Sweep the send size, comparing plain copies with MSG_ZEROCOPY. The
+    // crossover is the smallest size at which zero-copy is faster.
+
+    std::size_t crossover = 0;
+
+    for (std::size_t size = 0x1000; size <= 0x1000000; size <<= 1) {
+        auto copy = run(server, size, SIZE_MAX, total);
+        auto zerocopy = run(server, size, 0, total);
+
+        std::cout << "size: " << size
+                  << ", copy GB/s: " << copy
+                  << ", zerocopy GB/s: " << zerocopy << '\n';
+
+        if (crossover == 0 && zerocopy > copy) {
+            crossover = size;
+        }
+    }
+
+    if (crossover != 0) {
+        std::cout << "crossover: " << crossover << " bytes\n";
+    }
+    else {
+        std::cout << "crossover: none (zero-copy never won)\n";
+    }
+
+    // Compare sending a file with sendfile() against read() + send().
+
+    {
+        std::vector<char> buf(MAX_SIZE, 'x');
+        if (auto file = std::fstream("test.txt", std::ios::out)) {
+            for (uint64_t written = 0; written < total; written += buf.size()) {
+                file.write(buf.data(), buf.size());
+            }
+        }
+    }
+
+    std::thread sink{[&server]{ server.drain(); }};
+    auto d = benchmark([&]{
+        myclient client{server.port()};
+        client.send_file("test.txt");
+    });
+    sink.join();
+
+    std::cout << "sendfile GB/s: "
+              << total / duration_cast<duration<double>>(d).count() / 1e9 << '\n';
+
+    sink = std::thread{[&server]{ server.drain(); }};
+    d = benchmark([&]{
+        myclient client{server.port(), SIZE_MAX};
+        std::vector<char> buf(MAX_SIZE);
+
+        if (auto file = std::fstream("test.txt", std::ios::in)) {
+            while (file.read(buf.data(), buf.size()) || file.gcount() != 0) {
+                client.send(buf.data(), static_cast<std::size_t>(file.gcount()));
+            }
+        }
+    });
+    sink.join();
+
+    std::cout << "read + send GB/s: "
+              << total / duration_cast<duration<double>>(d).count() / 1e9 << '\n';
+
+    return EXIT_SUCCESS;
+}
+
+int
+main(int argc, char** argv)
+{
+    try {
+        return protected_main(argc, argv);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Caught unhandled exception:\n";
+        std::cerr << " - what(): " << e.what() << '\n';
+    }
+    catch (...) {
+        std::cerr << "Caught unknown exception\n";
+    }
+
+    return EXIT_FAILURE;
+}
+
+#endif
@@ -0,0 +1,888 @@
+//
+// Copyright (C) 2018 Rian Quinn <rianquinn@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#define PORT 22000
+#define MAX_SIZE 0x1000
+
+#include <map>
+#include <array>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <string_view>
+
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+using namespace std::chrono;
+
+// -----------------------------------------------------------------------------
+// Framing
+// -----------------------------------------------------------------------------
+
+// Every request and response starts with a fixed-size header (in network
+// byte order) followed by len bytes of payload. Responses carry the id of
+// the request they answer, so the server is free to answer requests in any
+// order. A request may carry a timeout, after which the server gives up on
+// it and answers with status::deadline_exceeded instead.
+
+enum class method : uint16_t
+{
+    echo,
+    delay,
+    cancel
+};
+
+enum class status : uint16_t
+{
+    ok,
+    unknown_method,
+    bad_request,
+    deadline_exceeded,
+    cancelled
+};
+
+struct frame_header
+{
+    uint32_t len;
+    uint32_t id;
+    uint16_t method;
+    uint16_t status;
+    uint32_t timeout_us;
+};
+
+void
+append_frame(
+    std::vector<char> &out, uint32_t id, method m, status s,
+    microseconds timeout, std::string_view payload)
+{
+    if (payload.size() > MAX_SIZE) {
+        throw std::out_of_range("payload.size() > MAX_SIZE");
+    }
+
+    frame_header hdr = {
+        htonl(static_cast<uint32_t>(payload.size())),
+        htonl(id),
+        htons(static_cast<uint16_t>(m)),
+        htons(static_cast<uint16_t>(s)),
+        htonl(static_cast<uint32_t>(timeout.count()))
+    };
+
+    auto ptr = reinterpret_cast<const char *>(&hdr);
+
+    out.insert(out.end(), ptr, ptr + sizeof(hdr));
+    out.insert(out.end(), payload.begin(), payload.end());
+}
+
+// Calls func(hdr, payload) for every complete frame in "in", and removes
+// those frames from the buffer. A partial frame is left for the next read.
+
+template<typename FUNC>
+void
+for_each_frame(std::vector<char> &in, FUNC func)
+{
+    std::size_t offset = 0;
+
+    while (in.size() - offset >= sizeof(frame_header)) {
+        frame_header hdr;
+        memcpy(&hdr, &in[offset], sizeof(hdr));
+
+        hdr.len = ntohl(hdr.len);
+        hdr.id = ntohl(hdr.id);
+        hdr.method = ntohs(hdr.method);
+        hdr.status = ntohs(hdr.status);
+        hdr.timeout_us = ntohl(hdr.timeout_us);
+
+        if (hdr.len > MAX_SIZE) {
+            throw std::runtime_error("frame too large");
+        }
+
+        if (in.size() - offset - sizeof(hdr) < hdr.len) {
+            break;
+        }
+
+        func(hdr, std::string_view{&in[offset + sizeof(hdr)], hdr.len});
+        offset += sizeof(hdr) + hdr.len;
+    }
+
+    in.erase(in.begin(), in.begin() + static_cast<std::ptrdiff_t>(offset));
+}
+
+// Reads whatever is available on fd into "in". Returns false once the peer
+// has closed the connection.
+
+bool
+read_available(int fd, std::vector<char> &in)
+{
+    std::array<char, MAX_SIZE> buf;
+
+    while (true) {
+        auto len = ::recv(fd, buf.data(), buf.size(), MSG_DONTWAIT);
+
+        if (len == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+
+            if (errno == ECONNRESET) {
+                return false;
+            }
+
+            throw std::runtime_error(strerror(errno));
+        }
+
+        if (len == 0) {
+            return false;
+        }
+
+        in.insert(in.end(), buf.data(), buf.data() + len);
+    }
+}
+
+// Writes as much of "out" as the socket accepts without blocking.
+
+void
+write_available(int fd, std::vector<char> &out)
+{
+    std::size_t offset = 0;
+
+    while (offset < out.size()) {
+        auto ret = ::send(
+            fd, &out[offset], out.size() - offset, MSG_DONTWAIT | MSG_NOSIGNAL
+        );
+
+        if (ret == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+
+            throw std::runtime_error(strerror(errno));
+        }
+
+        offset += static_cast<std::size_t>(ret);
+    }
+
+    out.erase(out.begin(), out.begin() + static_cast<std::ptrdiff_t>(offset));
+}
+
+#if defined(SERVER) || defined(BENCHMARK)
+
+#include <atomic>
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+// A handler fills in the response and returns how long the server should
+// wait before sending it (zero meaning right away). Delayed responses are
+// what allow later requests to be answered first.
+
+using handler_t = microseconds(*)(std::string_view, std::string &);
+
+microseconds
+echo_handler(std::string_view request, std::string &response)
+{
+    response = request;
+    return microseconds{0};
+}
+
+microseconds
+delay_handler(std::string_view request, std::string &response)
+{
+    uint32_t us;
+
+    if (request.size() != sizeof(us)) {
+        throw std::invalid_argument("delay expects a 32-bit duration");
+    }
+
+    memcpy(&us, request.data(), sizeof(us));
+    response = request;
+
+    return microseconds{ntohl(us)};
+}
+
+// The handler table is indexed by method, and is built at compile time.
+// method::cancel is not in the table as it is handled by the server itself.
+
+constexpr std::array<handler_t, 2> g_handlers = {
+    echo_handler,
+    delay_handler
+};
+
+static_assert(g_handlers.size() == static_cast<std::size_t>(method::cancel));
+
+// -----------------------------------------------------------------------------
+// Server
+// -----------------------------------------------------------------------------
+
+class myserver
+{
+    struct connection
+    {
+        int fd;
+        std::vector<char> in;
+        std::vector<char> out;
+    };
+
+    struct delayed
+    {
+        int fd;
+        uint32_t id;
+        method m;
+        status s;
+        std::string response;
+    };
+
+    using timers_t = std::multimap<steady_clock::time_point, delayed>;
+
+    int m_fd{};
+    struct sockaddr_in m_addr{};
+
+    std::map<int, connection> m_connections;
+
+    timers_t m_timers;
+    std::map<std::pair<int, uint32_t>, timers_t::iterator> m_index;
+
+    std::atomic<bool> m_stop{};
+
+public:
+
+    explicit myserver(uint16_t port)
+    {
+        if (m_fd = ::socket(AF_INET, SOCK_STREAM, 0); m_fd == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        int on = 1;
+        if (::setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        m_addr.sin_family = AF_INET;
+        m_addr.sin_port = htons(port);
+        m_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+        if (this->bind() == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        if (::listen(m_fd, SOMAXCONN) == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+    }
+
+    int bind()
+    {
+        return ::bind(
+            m_fd,
+            reinterpret_cast<struct sockaddr *>(&m_addr),
+            sizeof(m_addr)
+        );
+    }
+
+    uint16_t port()
+    {
+        struct sockaddr_in addr{};
+        socklen_t len = sizeof(addr);
+
+        if (::getsockname(m_fd, reinterpret_cast<struct sockaddr *>(&addr), &len) == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        return ntohs(addr.sin_port);
+    }
+
+    void stop()
+    { m_stop = true; }
+
+    // The event loop polls the listening socket and every connection. The
+    // poll() timeout is the time until the next delayed response is due (or
+    // 100ms, so that stop() is noticed).
+
+    void run()
+    {
+        std::vector<struct pollfd> fds;
+
+        while (!m_stop) {
+            fds.clear();
+            fds.push_back({m_fd, POLLIN, 0});
+
+            for (const auto &[fd, c] : m_connections) {
+                short events = c.out.empty() ? POLLIN : (POLLIN | POLLOUT);
+                fds.push_back({fd, events, 0});
+            }
+
+            auto timeout = milliseconds{100};
+            if (!m_timers.empty()) {
+                auto next = duration_cast<milliseconds>(
+                    m_timers.begin()->first - steady_clock::now()
+                );
+
+                timeout = std::clamp(next, milliseconds{0}, timeout);
+            }
+
+            if (::poll(fds.data(), fds.size(), static_cast<int>(timeout.count())) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                throw std::runtime_error(strerror(errno));
+            }
+
+            if ((fds[0].revents & POLLIN) != 0) {
+                accept();
+            }
+
+            for (std::size_t i = 1; i < fds.size(); i++) {
+                if (fds[i].revents != 0) {
+                    service(fds[i].fd, fds[i].revents);
+                }
+            }
+
+            expire_timers();
+        }
+    }
+
+    ~myserver()
+    {
+        for (const auto &[fd, c] : m_connections) {
+            close(fd);
+        }
+
+        close(m_fd);
+    }
+
+private:
+
+    void accept()
+    {
+        if (int c = ::accept(m_fd, nullptr, nullptr); c != -1) {
+            int on = 1;
+            ::setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+            m_connections[c] = {c, {}, {}};
+            return;
+        }
+
+        throw std::runtime_error(strerror(errno));
+    }
+
+    void service(int fd, short revents)
+    {
+        auto &c = m_connections.at(fd);
+
+        if ((revents & (POLLIN | POLLHUP | POLLERR)) != 0) {
+            if (!read_available(fd, c.in)) {
+                disconnect(fd);
+                return;
+            }
+
+            for_each_frame(c.in, [&](const frame_header &hdr, std::string_view payload) {
+                dispatch(c, hdr, payload);
+            });
+        }
+
+        write_available(fd, c.out);
+    }
+
+    void dispatch(connection &c, const frame_header &hdr, std::string_view payload)
+    {
+        auto m = static_cast<method>(hdr.method);
+
+        if (m == method::cancel) {
+            if (auto iter = m_index.find({c.fd, hdr.id}); iter != m_index.end()) {
+                m_timers.erase(iter->second);
+                m_index.erase(iter);
+            }
+
+            return;
+        }
+
+        if (hdr.method >= g_handlers.size()) {
+            append_frame(c.out, hdr.id, m, status::unknown_method, {}, {});
+            return;
+        }
+
+        std::string response;
+        microseconds delay;
+
+        try {
+            delay = g_handlers[hdr.method](payload, response);
+        }
+        catch (const std::invalid_argument &) {
+            append_frame(c.out, hdr.id, m, status::bad_request, {}, {});
+            return;
+        }
+
+        // A response that would be sent after the request's deadline is
+        // replaced with status::deadline_exceeded, sent at the deadline.
+
+        auto s = status::ok;
+        if (hdr.timeout_us != 0 && delay >= microseconds{hdr.timeout_us}) {
+            delay = microseconds{hdr.timeout_us};
+            response.clear();
+            s = status::deadline_exceeded;
+        }
+
+        if (delay == microseconds{0}) {
+            append_frame(c.out, hdr.id, m, s, {}, response);
+            return;
+        }
+
+        auto iter = m_timers.insert({
+            steady_clock::now() + delay, {c.fd, hdr.id, m, s, std::move(response)}
+        });
+
+        m_index[{c.fd, hdr.id}] = iter;
+    }
+
+    void expire_timers()
+    {
+        auto now = steady_clock::now();
+
+        while (!m_timers.empty() && m_timers.begin()->first <= now) {
+            auto &d = m_timers.begin()->second;
+
+            if (auto c = m_connections.find(d.fd); c != m_connections.end()) {
+                append_frame(c->second.out, d.id, d.m, d.s, {}, d.response);
+                write_available(d.fd, c->second.out);
+            }
+
+            m_index.erase({d.fd, d.id});
+            m_timers.erase(m_timers.begin());
+        }
+    }
+
+    void disconnect(int fd)
+    {
+        for (auto iter = m_timers.begin(); iter != m_timers.end();) {
+            if (iter->second.fd == fd) {
+                m_index.erase({fd, iter->second.id});
+                iter = m_timers.erase(iter);
+            }
+            else {
+                ++iter;
+            }
+        }
+
+        close(fd);
+        m_connections.erase(fd);
+    }
+};
+
+#endif
+
+#if defined(CLIENT) || defined(BENCHMARK)
+
+#include <set>
+#include <functional>
+#include <unordered_map>
+
+// -----------------------------------------------------------------------------
+// Client
+// -----------------------------------------------------------------------------
+
+// The client is driven by poll(), which sends queued requests, dispatches
+// responses (in whatever order they arrive) to the callback registered for
+// their id, and fails calls whose deadline has passed. Cancelling a call
+// completes it locally with status::cancelled, and tells the server that it
+// no longer needs to answer it.
+
+class myclient
+{
+public:
+    using callback_t = std::function<void(status, std::string_view)>;
+
+private:
+
+    struct pending_call
+    {
+        steady_clock::time_point deadline;
+        callback_t callback;
+    };
+
+    int m_fd{};
+    struct sockaddr_in m_addr{};
+
+    uint32_t m_next_id{};
+    std::vector<char> m_in;
+    std::vector<char> m_out;
+
+    std::unordered_map<uint32_t, pending_call> m_pending;
+    std::set<std::pair<steady_clock::time_point, uint32_t>> m_deadlines;
+
+public:
+
+    explicit myclient(uint16_t port)
+    {
+        if (m_fd = ::socket(AF_INET, SOCK_STREAM, 0); m_fd == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        m_addr.sin_family = AF_INET;
+        m_addr.sin_port = htons(port);
+        m_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if (connect() == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        int on = 1;
+        ::setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+
+    int connect()
+    {
+        return ::connect(
+            m_fd,
+            reinterpret_cast<struct sockaddr *>(&m_addr),
+            sizeof(m_addr)
+        );
+    }
+
+    uint32_t call(
+        method m, std::string_view payload, microseconds timeout,
+        callback_t callback)
+    {
+        auto id = m_next_id++;
+        auto deadline = steady_clock::now() + timeout;
+
+        append_frame(m_out, id, m, status::ok, timeout, payload);
+        write_available(m_fd, m_out);
+
+        m_pending[id] = {deadline, std::move(callback)};
+        m_deadlines.insert({deadline, id});
+
+        return id;
+    }
+
+    void cancel(uint32_t id)
+    {
+        if (complete(id, status::cancelled, {})) {
+            append_frame(m_out, id, method::cancel, status::ok, {}, {});
+            write_available(m_fd, m_out);
+        }
+    }
+
+    std::size_t pending() const
+    { return m_pending.size(); }
+
+    // Runs one iteration of the event loop, waiting at most "timeout" (or
+    // until the next deadline) for a response.
+
+    void poll(nanoseconds timeout)
+    {
+        if (!m_deadlines.empty()) {
+            auto next = duration_cast<nanoseconds>(
+                m_deadlines.begin()->first - steady_clock::now()
+            );
+
+            timeout = std::clamp(next, nanoseconds{0}, timeout);
+        }
+
+        short events = m_out.empty() ? POLLIN : (POLLIN | POLLOUT);
+        struct pollfd pfd = {m_fd, events, 0};
+
+        // ppoll() is used instead of poll() for its nanosecond timeout, so
+        // an open-loop caller wakes up when its next request is due rather
+        // than up to a millisecond late.
+
+        auto ns = timeout.count();
+        struct timespec ts = {ns / 1000000000, ns % 1000000000};
+
+        if (::ppoll(&pfd, 1, &ts, nullptr) == -1 && errno != EINTR) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        if ((pfd.revents & POLLOUT) != 0) {
+            write_available(m_fd, m_out);
+        }
+
+        if ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) != 0) {
+            if (!read_available(m_fd, m_in)) {
+                throw std::runtime_error("server closed the connection");
+            }
+
+            for_each_frame(m_in, [&](const frame_header &hdr, std::string_view payload) {
+                complete(hdr.id, static_cast<status>(hdr.status), payload);
+            });
+        }
+
+        auto now = steady_clock::now();
+        while (!m_deadlines.empty() && m_deadlines.begin()->first <= now) {
+            complete(m_deadlines.begin()->second, status::deadline_exceeded, {});
+        }
+    }
+
+    ~myclient()
+    {
+        close(m_fd);
+    }
+
+private:
+
+    // Completes a call, returning false if it had already completed (for
+    // example, a response that arrives after the call was cancelled).
+
+    bool complete(uint32_t id, status s, std::string_view payload)
+    {
+        auto iter = m_pending.find(id);
+        if (iter == m_pending.end()) {
+            return false;
+        }
+
+        auto callback = std::move(iter->second.callback);
+
+        m_deadlines.erase({iter->second.deadline, id});
+        m_pending.erase(iter);
+
+        callback(s, payload);
+        return true;
+    }
+};
+
+#endif
+
+#ifdef SERVER
+
+#include <iostream>
+
+int
+protected_main(int argc, char** argv)
+{
+    (void) argc;
+    (void) argv;
+
+    myserver server{PORT};
+    server.run();
+
+    return EXIT_SUCCESS;
+}
+
+int
+main(int argc, char** argv)
+{
+    try {
+        return protected_main(argc, argv);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Caught unhandled exception:\n";
+        std::cerr << " - what(): " << e.what() << '\n';
+    }
+    catch (...) {
+        std::cerr << "Caught unknown exception\n";
+    }
+
+    return EXIT_FAILURE;
+}
+
+#endif
+
+#ifdef CLIENT
+
+#include <iostream>
+
+const char *
+to_string(status s)
+{
+    switch (s) {
+        case status::ok: return "ok";
+        case status::unknown_method: return "unknown method";
+        case status::bad_request: return "bad request";
+        case status::deadline_exceeded: return "deadline exceeded";
+        case status::cancelled: return "cancelled";
+    }
+
+    return "unknown";
+}
+
+std::string
+delay_payload(microseconds d)
+{
+    auto us = htonl(static_cast<uint32_t>(d.count()));
+    return std::string(reinterpret_cast<const char *>(&us), sizeof(us));
+}
+
+int
+protected_main(int argc, char** argv)
+{
+    (void) argc;
+    (void) argv;
+
+    myclient client{PORT};
+
+    auto print = [](const char *name) {
+        return [name](status s, std::string_view payload) {
+            std::cout << name << ": " << to_string(s);
+
+            if (s == status::ok) {
+                std::cout << " (" << payload.size() << " bytes)";
+            }
+
+            std::cout << '\n';
+        };
+    };
+
+    // The slow call is sent first but answered last, the call with a short
+    // deadline fails, and the cancelled call is never answered.
+
+    client.call(method::delay, delay_payload(milliseconds{200}), seconds{1}, print("slow"));
+    client.call(method::echo, "Hello World", seconds{1}, print("echo"));
+    client.call(method::delay, delay_payload(seconds{1}), milliseconds{50}, print("deadline"));
+
+    auto id = client.call(method::delay, delay_payload(milliseconds{100}), seconds{1}, print("cancel"));
+    client.cancel(id);
+
+    while (client.pending() != 0) {
+        client.poll(milliseconds{100});
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int
+main(int argc, char** argv)
+{
+    try {
+        return protected_main(argc, argv);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Caught unhandled exception:\n";
+        std::cerr << " - what(): " << e.what() << '\n';
+    }
+    catch (...) {
+        std::cerr << "Caught unknown exception\n";
+    }
+
+    return EXIT_FAILURE;
+}
+
+#endif
+
+#ifdef BENCHMARK
+
+#include <thread>
+#include <iostream>
+
+// The benchmark is open loop: requests are sent at a fixed rate, regardless
+// of how quickly responses come back, and latency is measured from when each
+// request was supposed to be sent. This way, a stall in the server shows up
+// in the latency of every request that should have been sent during the
+// stall, instead of just one.
+
+int
+protected_main(int argc, char** argv)
+{
+    uint64_t rate = argc > 1 ? std::stoull(argv[1]) : 10000;
+    seconds duration{argc > 2 ? std::stoull(argv[2]) : 5};
+
+    if (rate == 0) {
+        throw std::invalid_argument("rate must be non-zero");
+    }
+
+    myserver server{0};
+    std::thread t{[&server]{ server.run(); }};
+
+    std::vector<nanoseconds> latencies;
+    uint64_t failed = 0;
+
+    {
+        myclient client{server.port()};
+
+        std::string payload(64, 'x');
+        auto interval = nanoseconds{1000000000 / rate};
+
+        auto start = steady_clock::now();
+        auto end = start + duration;
+        auto next = start;
+
+        while (next < end || client.pending() != 0) {
+            auto now = steady_clock::now();
+
+            for (; next <= now && next < end; next += interval) {
+                client.call(method::echo, payload, seconds{1},
+                    [&latencies, &failed, intended = next](status s, std::string_view) {
+                        if (s != status::ok) {
+                            failed++;
+                            return;
+                        }
+
+                        latencies.push_back(steady_clock::now() - intended);
+                    }
+                );
+            }
+
+            auto wait = next < end ?
+                duration_cast<nanoseconds>(next - now) : nanoseconds{100000000};
+
+            client.poll(wait);
+        }
+    }
+
+    server.stop();
+    t.join();
+
+    if (latencies.empty()) {
+        throw std::runtime_error("no responses received");
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+
+    auto percentile = [&latencies](double p) {
+        auto i = static_cast<std::size_t>(p * static_cast<double>(latencies.size() - 1));
+        return duration_cast<microseconds>(latencies[i]).count();
+    };
+
+    std::cout << "rate: " << rate << " req/sec\n";
+    std::cout << "responses: " << latencies.size() << '\n';
+    std::cout << "failed: " << failed << '\n';
+    std::cout << "p50: " << percentile(0.50) << " us\n";
+    std::cout << "p99: " << percentile(0.99) << " us\n";
+    std::cout << "p999: " << percentile(0.999) << " us\n";
+
+    return EXIT_SUCCESS;
+}
+
+int
+main(int argc, char** argv)
+{
+    try {
+        return protected_main(argc, argv);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Caught unhandled exception:\n";
+        std::cerr << " - what(): " << e.what() << '\n';
+    }
+    catch (...) {
+        std::cerr << "Caught unknown exception\n";
+    }
+
+    return EXIT_FAILURE;
+}
+
+#endif
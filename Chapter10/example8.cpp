@@ -0,0 +1,481 @@
+//
+// Copyright (C) 2018 Rian Quinn <rianquinn@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// -----------------------------------------------------------------------------
+// Load Generator
+// -----------------------------------------------------------------------------
+
+// usage: example8 <tcp|udp> [rate] [seconds] [size] [connections]
+//
+// Sends size-byte messages at a constant rate (messages per second, spread
+// round-robin over the connections) to the echo server at PORT (example1 for
+// UDP, example2 for TCP), and prints the latency of the echoes as JSON. Note
+// that the example2 server only accepts a single TCP connection, and the
+// example1 server (when not batched) only echoes messages smaller than 16
+// bytes.
+//
+// The load is open loop: a message is sent when it is due, whether or not
+// earlier messages have been answered, and latency is measured from when it
+// was due rather than from when it was actually sent. A closed-loop client
+// that waits for each answer (like the example*_client targets) slows down
+// whenever the server stalls, and so hides the stall from its measurements
+// (known as coordinated omission).
+
+#define PORT 22000
+
+#include <array>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <nlohmann/json.hpp>
+using json = nlohmann::json;
+
+using namespace std::chrono;
+
+// -----------------------------------------------------------------------------
+// Histogram
+// -----------------------------------------------------------------------------
+
+// An HDR (high dynamic range) histogram records values from 1ns to hours
+// with a fixed relative precision, using a fixed amount of memory. Values
+// below 128 get their own bucket. Above that, every power of two is split
+// into 64 linear sub-buckets, so a value is off by at most 1/64 (~1.6%).
+
+class hdr_histogram
+{
+    static constexpr std::size_t SUB_BUCKETS = 64;
+    static constexpr std::size_t NUM_BUCKETS = 128 + (57 * SUB_BUCKETS);
+
+    std::array<uint64_t, NUM_BUCKETS> m_counts{};
+
+    uint64_t m_count{};
+    uint64_t m_min{UINT64_MAX};
+    uint64_t m_max{};
+    long double m_sum{};
+
+public:
+
+    void record(uint64_t val)
+    {
+        m_counts[index(val)]++;
+
+        m_count++;
+        m_min = std::min(m_min, val);
+        m_max = std::max(m_max, val);
+        m_sum += val;
+    }
+
+    uint64_t count() const
+    { return m_count; }
+
+    uint64_t min() const
+    { return m_count != 0 ? m_min : 0; }
+
+    uint64_t max() const
+    { return m_max; }
+
+    double mean() const
+    { return m_count != 0 ? static_cast<double>(m_sum / m_count) : 0; }
+
+    // Returns the highest value that is equivalent (within the precision of
+    // the histogram) to the value at the given percentile.
+
+    uint64_t percentile(double p) const
+    {
+        auto target = static_cast<uint64_t>(p / 100.0 * m_count + 0.5);
+        target = std::max<uint64_t>(target, 1);
+
+        uint64_t total = 0;
+        for (std::size_t i = 0; i < m_counts.size(); i++) {
+            if (total += m_counts[i]; total >= target) {
+                return std::min(highest_equivalent(i), m_max);
+            }
+        }
+
+        return m_max;
+    }
+
+private:
+
+    static std::size_t index(uint64_t val)
+    {
+        if (val < 128) {
+            return val;
+        }
+
+        auto shift = static_cast<std::size_t>(63 - __builtin_clzll(val)) - 6;
+        auto sub = static_cast<std::size_t>(val >> shift) - SUB_BUCKETS;
+
+        return 128 + ((shift - 1) * SUB_BUCKETS) + sub;
+    }
+
+    static uint64_t highest_equivalent(std::size_t i)
+    {
+        if (i < 128) {
+            return i;
+        }
+
+        auto shift = ((i - 128) / SUB_BUCKETS) + 1;
+        auto sub = ((i - 128) % SUB_BUCKETS) + SUB_BUCKETS;
+
+        return ((static_cast<uint64_t>(sub) + 1) << shift) - 1;
+    }
+};
+
+// -----------------------------------------------------------------------------
+// Connections
+// -----------------------------------------------------------------------------
+
+// Every message starts with the time it was due to be sent, which the echo
+// server sends back, so no per-message state needs to be kept.
+
+uint64_t
+now_ns()
+{
+    return static_cast<uint64_t>(
+        duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count()
+    );
+}
+
+class myconnection
+{
+    int m_fd{};
+    bool m_tcp{};
+    struct sockaddr_in m_addr{};
+
+    std::vector<char> m_in;
+    std::vector<char> m_out;
+
+public:
+
+    myconnection(uint16_t port, bool tcp) :
+        m_tcp{tcp}
+    {
+        if (m_fd = ::socket(AF_INET, tcp ? SOCK_STREAM : SOCK_DGRAM, 0); m_fd == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        m_addr.sin_family = AF_INET;
+        m_addr.sin_port = htons(port);
+        m_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if (connect() == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        if (tcp) {
+            int on = 1;
+            ::setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+
+        if (::fcntl(m_fd, F_SETFL, ::fcntl(m_fd, F_GETFL) | O_NONBLOCK) == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+    }
+
+    myconnection(myconnection &&) = delete;
+    myconnection &operator=(myconnection &&) = delete;
+
+    int connect()
+    {
+        return ::connect(
+            m_fd,
+            reinterpret_cast<struct sockaddr *>(&m_addr),
+            sizeof(m_addr)
+        );
+    }
+
+    int fd() const
+    { return m_fd; }
+
+    bool want_write() const
+    { return !m_out.empty(); }
+
+    // Returns false if the message had to be dropped, which can only happen
+    // with UDP when the socket buffer is full.
+
+    bool send(std::vector<char> &msg)
+    {
+        if (!m_tcp) {
+            if (::send(m_fd, msg.data(), msg.size(), 0) == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED) {
+                    return false;
+                }
+
+                throw std::runtime_error(strerror(errno));
+            }
+
+            return true;
+        }
+
+        m_out.insert(m_out.end(), msg.begin(), msg.end());
+        flush();
+
+        return true;
+    }
+
+    void flush()
+    {
+        std::size_t offset = 0;
+
+        while (offset < m_out.size()) {
+            auto ret = ::send(
+                m_fd, &m_out[offset], m_out.size() - offset, MSG_NOSIGNAL
+            );
+
+            if (ret == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+
+                throw std::runtime_error(strerror(errno));
+            }
+
+            offset += static_cast<std::size_t>(ret);
+        }
+
+        m_out.erase(m_out.begin(), m_out.begin() + static_cast<std::ptrdiff_t>(offset));
+    }
+
+    // Reads every echo that is available, recording its latency. TCP is a
+    // stream, so echoes are split back into size-byte messages.
+
+    uint64_t receive(std::size_t size, hdr_histogram &hist)
+    {
+        uint64_t num = 0;
+        std::vector<char> buf(std::max<std::size_t>(size, 0x10000));
+
+        while (true) {
+            auto len = ::recv(m_fd, buf.data(), buf.size(), 0);
+
+            if (len == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED) {
+                    break;
+                }
+
+                throw std::runtime_error(strerror(errno));
+            }
+
+            if (len == 0) {
+                throw std::runtime_error("server closed the connection");
+            }
+
+            auto now = now_ns();
+
+            if (!m_tcp) {
+                if (static_cast<std::size_t>(len) == size) {
+                    num++;
+                    hist.record(now - due(buf.data()));
+                }
+
+                continue;
+            }
+
+            m_in.insert(m_in.end(), buf.data(), buf.data() + len);
+
+            std::size_t offset = 0;
+            for (; m_in.size() - offset >= size; offset += size) {
+                num++;
+                hist.record(now - due(&m_in[offset]));
+            }
+
+            m_in.erase(m_in.begin(), m_in.begin() + static_cast<std::ptrdiff_t>(offset));
+        }
+
+        return num;
+    }
+
+    ~myconnection()
+    {
+        close(m_fd);
+    }
+
+private:
+
+    static uint64_t due(const char *msg)
+    {
+        uint64_t val;
+        memcpy(&val, msg, sizeof(val));
+
+        return val;
+    }
+};
+
+// -----------------------------------------------------------------------------
+// Main
+// -----------------------------------------------------------------------------
+
+int
+protected_main(int argc, char** argv)
+{
+    if (argc < 2) {
+        throw std::invalid_argument(
+            "usage: example8 <tcp|udp> [rate] [seconds] [size] [connections]");
+    }
+
+    std::string protocol = argv[1];
+    uint64_t rate = argc > 2 ? std::stoull(argv[2]) : 10000;
+    seconds length{argc > 3 ? std::stoull(argv[3]) : 10};
+    std::size_t size = argc > 4 ? std::stoul(argv[4]) : 15;
+    std::size_t num_connections = argc > 5 ? std::stoul(argv[5]) : 1;
+
+    if (protocol != "tcp" && protocol != "udp") {
+        throw std::invalid_argument("protocol must be tcp or udp");
+    }
+
+    if (rate == 0 || num_connections == 0) {
+        throw std::invalid_argument("rate and connections must be non-zero");
+    }
+
+    if (size < sizeof(uint64_t)) {
+        throw std::invalid_argument("size must be at least 8 bytes");
+    }
+
+    std::vector<std::unique_ptr<myconnection>> connections;
+    for (std::size_t i = 0; i < num_connections; i++) {
+        connections.push_back(std::make_unique<myconnection>(PORT, protocol == "tcp"));
+    }
+
+    hdr_histogram hist;
+    std::vector<char> msg(size, 'x');
+    std::vector<struct pollfd> fds(connections.size());
+
+    uint64_t sent = 0;
+    uint64_t dropped = 0;
+    uint64_t received = 0;
+
+    auto interval = nanoseconds{1000000000 / rate};
+    auto start = steady_clock::now();
+    auto end = start + length;
+    auto next = start;
+
+    // Once sending is finished, wait up to a second for the remaining
+    // echoes. Anything still missing (UDP only) is reported as lost.
+
+    auto drain_end = end + seconds{1};
+
+    while (true) {
+        auto now = steady_clock::now();
+
+        for (; next <= now && next < end; next += interval) {
+            auto due = static_cast<uint64_t>(
+                duration_cast<nanoseconds>(next.time_since_epoch()).count()
+            );
+
+            memcpy(msg.data(), &due, sizeof(due));
+
+            if (connections[sent % connections.size()]->send(msg)) {
+                sent++;
+            }
+            else {
+                dropped++;
+            }
+        }
+
+        if (now >= end && (received == sent || now >= drain_end)) {
+            break;
+        }
+
+        for (std::size_t i = 0; i < connections.size(); i++) {
+            short events = connections[i]->want_write() ? (POLLIN | POLLOUT) : POLLIN;
+            fds[i] = {connections[i]->fd(), events, 0};
+        }
+
+        // ppoll() is used instead of poll() for its nanosecond timeout,
+        // since messages are typically due far less than 1ms apart.
+
+        auto wait = next < end ? next - now : drain_end - now;
+        auto ns = std::max<int64_t>(duration_cast<nanoseconds>(wait).count(), 0);
+        struct timespec ts = {ns / 1000000000, ns % 1000000000};
+
+        if (::ppoll(fds.data(), fds.size(), &ts, nullptr) == -1 && errno != EINTR) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        for (std::size_t i = 0; i < connections.size(); i++) {
+            if ((fds[i].revents & POLLOUT) != 0) {
+                connections[i]->flush();
+            }
+
+            if ((fds[i].revents & (POLLIN | POLLERR | POLLHUP)) != 0) {
+                received += connections[i]->receive(size, hist);
+            }
+        }
+    }
+
+    auto elapsed = duration_cast<duration<double>>(steady_clock::now() - start);
+
+    json j;
+
+    j["protocol"] = protocol;
+    j["rate"] = rate;
+    j["seconds"] = length.count();
+    j["size"] = size;
+    j["connections"] = num_connections;
+    j["sent"] = sent;
+    j["dropped"] = dropped;
+    j["received"] = received;
+    j["lost"] = sent - received;
+    j["achieved_rate"] = static_cast<double>(received) / elapsed.count();
+
+    j["latency_ns"]["min"] = hist.min();
+    j["latency_ns"]["mean"] = hist.mean();
+    j["latency_ns"]["p50"] = hist.percentile(50);
+    j["latency_ns"]["p90"] = hist.percentile(90);
+    j["latency_ns"]["p99"] = hist.percentile(99);
+    j["latency_ns"]["p999"] = hist.percentile(99.9);
+    j["latency_ns"]["p9999"] = hist.percentile(99.99);
+    j["latency_ns"]["max"] = hist.max();
+
+    std::cout << j.dump(4) << '\n';
+    return EXIT_SUCCESS;
+}
+
+int
+main(int argc, char** argv)
+{
+    try {
+        return protected_main(argc, argv);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Caught unhandled exception:\n";
+        std::cerr << " - what(): " << e.what() << '\n';
+    }
+    catch (...) {
+        std::cerr << "Caught unknown exception\n";
+    }
+
+    return EXIT_FAILURE;
+}
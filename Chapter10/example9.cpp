@@ -0,0 +1,734 @@
+//
+// Copyright (C) 2018 Rian Quinn <rianquinn@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#define PORT 22000
+#define MAX_SIZE 0x1000
+
+#include <array>
+#include <string>
+#include <stdexcept>
+
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// -----------------------------------------------------------------------------
+// Transports
+// -----------------------------------------------------------------------------
+
+// The socket classes below are templated on a transport, which provides the
+// socket's domain and type, and fills in its address. Most of the producers
+// of log messages live on the same host as the server, where a Unix domain
+// socket avoids the TCP/IP stack entirely. Unix domain sockets can either be
+// bound to a path in the filesystem, or to a name in the abstract namespace
+// (which starts with a null byte, and disappears with the socket instead of
+// leaving a file behind).
+
+struct tcp
+{
+    static constexpr auto name = "tcp";
+    static constexpr auto domain = AF_INET;
+    static constexpr auto type = SOCK_STREAM;
+
+    static socklen_t address(struct sockaddr_storage &addr, bool server)
+    {
+        auto in = reinterpret_cast<struct sockaddr_in *>(&addr);
+
+        in->sin_family = AF_INET;
+        in->sin_port = htons(PORT);
+        in->sin_addr.s_addr = htonl(server ? INADDR_ANY : INADDR_LOOPBACK);
+
+        return sizeof(struct sockaddr_in);
+    }
+};
+
+struct udp
+{
+    static constexpr auto name = "udp";
+    static constexpr auto domain = AF_INET;
+    static constexpr auto type = SOCK_DGRAM;
+
+    static socklen_t address(struct sockaddr_storage &addr, bool server)
+    { return tcp::address(addr, server); }
+};
+
+template<int TYPE>
+struct unix_path
+{
+    static constexpr auto name = TYPE == SOCK_STREAM ? "unix" : "unix_seqpacket";
+    static constexpr auto domain = AF_UNIX;
+    static constexpr auto type = TYPE;
+    static constexpr auto path = TYPE == SOCK_STREAM ? "example9.sock" : "example9_seqpacket.sock";
+
+    static socklen_t address(struct sockaddr_storage &addr, bool server)
+    {
+        auto un = reinterpret_cast<struct sockaddr_un *>(&addr);
+
+        if (server) {
+            ::unlink(path);
+        }
+
+        un->sun_family = AF_UNIX;
+        strncpy(un->sun_path, path, sizeof(un->sun_path) - 1);
+
+        return sizeof(struct sockaddr_un);
+    }
+};
+
+using unix_stream = unix_path<SOCK_STREAM>;
+using unix_seqpacket = unix_path<SOCK_SEQPACKET>;
+
+struct unix_abstract
+{
+    static constexpr auto name = "unix_abstract";
+    static constexpr auto domain = AF_UNIX;
+    static constexpr auto type = SOCK_STREAM;
+
+    static socklen_t address(struct sockaddr_storage &addr, bool server)
+    {
+        (void) server;
+
+        constexpr char path[] = "example9";
+        auto un = reinterpret_cast<struct sockaddr_un *>(&addr);
+
+        un->sun_family = AF_UNIX;
+        un->sun_path[0] = '\0';
+        memcpy(un->sun_path + 1, path, sizeof(path) - 1);
+
+        // The length of an abstract address includes the leading null byte,
+        // but not a trailing one.
+
+        return static_cast<socklen_t>(offsetof(struct sockaddr_un, sun_path) + sizeof(path));
+    }
+};
+
+// -----------------------------------------------------------------------------
+// File Descriptor Passing
+// -----------------------------------------------------------------------------
+
+// A Unix domain socket can pass open file descriptors to another process
+// using an SCM_RIGHTS control message. The receiver gets a new descriptor
+// that refers to the same open file. At least one byte of real data has to
+// be sent along with the control message.
+
+union fd_cmsg
+{
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+};
+
+void
+send_fd(int sock, int fd)
+{
+    char byte = 0;
+    struct iovec iov = {&byte, sizeof(byte)};
+
+    fd_cmsg control{};
+    struct msghdr msg{};
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+
+    if (::sendmsg(sock, &msg, 0) == -1) {
+        throw std::runtime_error(strerror(errno));
+    }
+}
+
+int
+recv_fd(int sock)
+{
+    char byte;
+    struct iovec iov = {&byte, sizeof(byte)};
+
+    fd_cmsg control{};
+    struct msghdr msg{};
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if (::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) <= 0) {
+        throw std::runtime_error("failed to receive fd");
+    }
+
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        throw std::runtime_error("message did not contain an fd");
+    }
+
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+
+    return fd;
+}
+
+// -----------------------------------------------------------------------------
+// Sockets
+// -----------------------------------------------------------------------------
+
+template<typename T>
+class myserver
+{
+    int m_fd{};
+    int m_client{-1};
+
+    struct sockaddr_storage m_addr{};
+    struct sockaddr_storage m_peer{};
+    socklen_t m_peer_len{};
+
+public:
+
+    static constexpr auto connected = T::type != SOCK_DGRAM;
+
+    myserver()
+    {
+        if (m_fd = ::socket(T::domain, T::type, 0); m_fd == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        if constexpr (T::domain == AF_INET) {
+            int on = 1;
+            ::setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        }
+
+        if (this->bind() == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        if constexpr (connected) {
+            if (::listen(m_fd, 0) == -1) {
+                throw std::runtime_error(strerror(errno));
+            }
+        }
+    }
+
+    int bind()
+    {
+        return ::bind(
+            m_fd,
+            reinterpret_cast<struct sockaddr *>(&m_addr),
+            T::address(m_addr, true)
+        );
+    }
+
+    void accept()
+    {
+        if constexpr (connected) {
+            if (m_client = ::accept(m_fd, nullptr, nullptr); m_client == -1) {
+                throw std::runtime_error(strerror(errno));
+            }
+
+            if constexpr (T::domain == AF_INET) {
+                int on = 1;
+                ::setsockopt(m_client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            }
+        }
+        else {
+            m_client = m_fd;
+        }
+    }
+
+    ssize_t recv(std::array<char, MAX_SIZE> &buf)
+    {
+        m_peer_len = sizeof(m_peer);
+
+        return ::recvfrom(
+            m_client,
+            buf.data(),
+            buf.size(),
+            0,
+            reinterpret_cast<struct sockaddr *>(&m_peer),
+            &m_peer_len
+        );
+    }
+
+    ssize_t send(std::array<char, MAX_SIZE> &buf, std::size_t len)
+    {
+        return ::sendto(
+            m_client,
+            buf.data(),
+            len,
+            0,
+            connected ? nullptr : reinterpret_cast<struct sockaddr *>(&m_peer),
+            connected ? 0 : m_peer_len
+        );
+    }
+
+    int recv_fd()
+    {
+        static_assert(T::domain == AF_UNIX, "only Unix domain sockets can pass fds");
+        return ::recv_fd(m_client);
+    }
+
+    // Echoes everything received until the client closes the connection (or
+    // for datagram sockets, sends an empty datagram).
+
+    void echo()
+    {
+        std::array<char, MAX_SIZE> buf;
+
+        while (true) {
+            auto len = recv(buf);
+
+            if (len == -1) {
+                throw std::runtime_error(strerror(errno));
+            }
+
+            if (len == 0) {
+                break;
+            }
+
+            if (send(buf, static_cast<std::size_t>(len)) == -1) {
+                throw std::runtime_error(strerror(errno));
+            }
+        }
+    }
+
+    ~myserver()
+    {
+        if (connected && m_client != -1) {
+            close(m_client);
+        }
+
+        close(m_fd);
+    }
+};
+
+template<typename T>
+class myclient
+{
+    int m_fd{};
+    struct sockaddr_storage m_addr{};
+
+public:
+
+    myclient()
+    {
+        if (m_fd = ::socket(T::domain, T::type, 0); m_fd == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        if (connect() == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        if constexpr (T::domain == AF_INET && T::type == SOCK_STREAM) {
+            int on = 1;
+            ::setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+    }
+
+    // A socket from socketpair() is already connected, so the client only
+    // needs to take ownership of it.
+
+    explicit myclient(int fd) :
+        m_fd{fd}
+    {
+        static_assert(T::domain == AF_UNIX, "socketpair() requires AF_UNIX");
+    }
+
+    int connect()
+    {
+        return ::connect(
+            m_fd,
+            reinterpret_cast<struct sockaddr *>(&m_addr),
+            T::address(m_addr, false)
+        );
+    }
+
+    ssize_t send(const char *buf, std::size_t len)
+    {
+        return ::send(
+            m_fd,
+            buf,
+            len,
+            0
+        );
+    }
+
+    ssize_t recv(char *buf, std::size_t len)
+    {
+        return ::recv(
+            m_fd,
+            buf,
+            len,
+            0
+        );
+    }
+
+    void send_fd(int fd)
+    {
+        static_assert(T::domain == AF_UNIX, "only Unix domain sockets can pass fds");
+        ::send_fd(m_fd, fd);
+    }
+
+    ~myclient()
+    {
+        close(m_fd);
+    }
+};
+
+#ifdef SERVER
+
+#include <iostream>
+
+template<typename T>
+void
+serve()
+{
+    myserver<T> server;
+    server.accept();
+
+    // Clients on a Unix domain socket first pass the server their stdout,
+    // which the server writes a greeting to directly.
+
+    if constexpr (T::domain == AF_UNIX) {
+        std::string msg = "Hello from the server\n";
+
+        auto fd = server.recv_fd();
+        if (::write(fd, msg.data(), msg.size()) == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        close(fd);
+    }
+
+    server.echo();
+}
+
+int
+protected_main(int argc, char** argv)
+{
+    // usage: example9_server [tcp|udp|unix|unix_seqpacket|unix_abstract]
+
+    std::string transport = argc > 1 ? argv[1] : "tcp";
+
+    if (transport == tcp::name) {
+        serve<tcp>();
+    }
+    else if (transport == udp::name) {
+        serve<udp>();
+    }
+    else if (transport == unix_stream::name) {
+        serve<unix_stream>();
+    }
+    else if (transport == unix_seqpacket::name) {
+        serve<unix_seqpacket>();
+    }
+    else if (transport == unix_abstract::name) {
+        serve<unix_abstract>();
+    }
+    else {
+        throw std::invalid_argument("unknown transport");
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int
+main(int argc, char** argv)
+{
+    try {
+        return protected_main(argc, argv);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Caught unhandled exception:\n";
+        std::cerr << " - what(): " << e.what() << '\n';
+    }
+    catch (...) {
+        std::cerr << "Caught unknown exception\n";
+    }
+
+    return EXIT_FAILURE;
+}
+
+#endif
+
+#ifdef CLIENT
+
+#include <iostream>
+
+template<typename T>
+void
+echo()
+{
+    myclient<T> client;
+
+    if constexpr (T::domain == AF_UNIX) {
+        client.send_fd(STDOUT_FILENO);
+    }
+
+    std::array<char, MAX_SIZE> buf{};
+    std::string msg = "Hello World";
+
+    client.send(msg.data(), msg.size());
+    client.recv(buf.data(), buf.size() - 1);
+
+    std::cout << buf.data() << '\n';
+
+    if constexpr (T::type == SOCK_DGRAM) {
+        client.send(nullptr, 0);
+    }
+}
+
+int
+protected_main(int argc, char** argv)
+{
+    // usage: example9_client [tcp|udp|unix|unix_seqpacket|unix_abstract]
+
+    std::string transport = argc > 1 ? argv[1] : "tcp";
+
+    if (transport == tcp::name) {
+        echo<tcp>();
+    }
+    else if (transport == udp::name) {
+        echo<udp>();
+    }
+    else if (transport == unix_stream::name) {
+        echo<unix_stream>();
+    }
+    else if (transport == unix_seqpacket::name) {
+        echo<unix_seqpacket>();
+    }
+    else if (transport == unix_abstract::name) {
+        echo<unix_abstract>();
+    }
+    else {
+        throw std::invalid_argument("unknown transport");
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int
+main(int argc, char** argv)
+{
+    try {
+        return protected_main(argc, argv);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Caught unhandled exception:\n";
+        std::cerr << " - what(): " << e.what() << '\n';
+    }
+    catch (...) {
+        std::cerr << "Caught unknown exception\n";
+    }
+
+    return EXIT_FAILURE;
+}
+
+#endif
+
+#ifdef BENCHMARK
+
+#include <chrono>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+#include <sys/wait.h>
+
+using namespace std::chrono;
+
+// Sends num messages of size bytes one at a time, waiting for each echo,
+// and prints the round trip latency. Stream sockets may return an echo in
+// pieces, so recv() is repeated until the whole message is back.
+
+template<typename T>
+void
+ping_pong(myclient<T> &client, const char *name, std::size_t num, std::size_t size)
+{
+    std::vector<char> buf(size, 'x');
+    std::vector<nanoseconds> latencies;
+
+    for (std::size_t i = 0; i < num; i++) {
+        auto stime = steady_clock::now();
+
+        if (client.send(buf.data(), buf.size()) == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        for (std::size_t left = size; left != 0;) {
+            auto len = client.recv(buf.data(), left);
+            if (len <= 0) {
+                throw std::runtime_error("echo failed");
+            }
+
+            left -= static_cast<std::size_t>(len);
+        }
+
+        latencies.push_back(steady_clock::now() - stime);
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+
+    auto percentile = [&latencies](double p) {
+        return latencies[static_cast<std::size_t>(p * static_cast<double>(latencies.size() - 1))].count();
+    };
+
+    std::cout << name << ":\n";
+    std::cout << " - p50: " << percentile(0.50) << " ns\n";
+    std::cout << " - p99: " << percentile(0.99) << " ns\n";
+}
+
+// The server runs in a child process, which signals over a pipe once it is
+// ready for the client to connect.
+
+template<typename T>
+void
+run(std::size_t num, std::size_t size)
+{
+    int ready[2];
+    if (::pipe(ready) == -1) {
+        throw std::runtime_error(strerror(errno));
+    }
+
+    if (auto pid = ::fork(); pid == 0) {
+        close(ready[0]);
+
+        try {
+            myserver<T> server;
+
+            char byte = 0;
+            if (::write(ready[1], &byte, sizeof(byte)) == -1) {
+                ::_exit(EXIT_FAILURE);
+            }
+
+            server.accept();
+            server.echo();
+        }
+        catch (...) {
+            ::_exit(EXIT_FAILURE);
+        }
+
+        ::_exit(EXIT_SUCCESS);
+    }
+    else {
+        close(ready[1]);
+
+        char byte;
+        if (::read(ready[0], &byte, sizeof(byte)) != 1) {
+            throw std::runtime_error("server failed to start");
+        }
+
+        close(ready[0]);
+
+        {
+            myclient<T> client;
+            ping_pong(client, T::name, num, size);
+
+            if constexpr (T::type == SOCK_DGRAM) {
+                client.send(nullptr, 0);
+            }
+        }
+
+        ::waitpid(pid, nullptr, 0);
+    }
+}
+
+void
+run_socketpair(std::size_t num, std::size_t size)
+{
+    int fds[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        throw std::runtime_error(strerror(errno));
+    }
+
+    if (auto pid = ::fork(); pid == 0) {
+        close(fds[0]);
+
+        std::array<char, MAX_SIZE> buf;
+        while (true) {
+            auto len = ::recv(fds[1], buf.data(), buf.size(), 0);
+            if (len <= 0 || ::send(fds[1], buf.data(), static_cast<std::size_t>(len), 0) == -1) {
+                break;
+            }
+        }
+
+        ::_exit(EXIT_SUCCESS);
+    }
+    else {
+        close(fds[1]);
+
+        {
+            myclient<unix_stream> client{fds[0]};
+            ping_pong(client, "socketpair", num, size);
+        }
+
+        ::waitpid(pid, nullptr, 0);
+    }
+}
+
+int
+protected_main(int argc, char** argv)
+{
+    std::size_t num = argc > 1 ? std::stoul(argv[1]) : 100000;
+    std::size_t size = argc > 2 ? std::stoul(argv[2]) : 64;
+
+    if (num == 0 || size == 0 || size > MAX_SIZE) {
+        throw std::invalid_argument("invalid number of messages or size");
+    }
+
+    run<tcp>(num, size);
+    run<udp>(num, size);
+    run<unix_stream>(num, size);
+    run<unix_seqpacket>(num, size);
+    run<unix_abstract>(num, size);
+    run_socketpair(num, size);
+
+    ::unlink(unix_stream::path);
+    ::unlink(unix_seqpacket::path);
+
+    return EXIT_SUCCESS;
+}
+
+int
+main(int argc, char** argv)
+{
+    try {
+        return protected_main(argc, argv);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Caught unhandled exception:\n";
+        std::cerr << " - what(): " << e.what() << '\n';
+    }
+    catch (...) {
+        std::cerr << "Caught unknown exception\n";
+    }
+
+    return EXIT_FAILURE;
+}
+
+#endif
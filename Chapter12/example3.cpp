@@ -20,11 +20,131 @@
 // SOFTWARE.
 
 #define PORT 22000
+#define STATS_PORT 22001
 #define MAX_SIZE 0x1000
+#define MAX_QUEUED 0x100000
+#define SEGMENT_SIZE 0x4000000
 
-#ifdef SERVER
+// -----------------------------------------------------------------------------
+// Log Segments
+// -----------------------------------------------------------------------------
+
+#if defined(SERVER) || defined(BENCHMARK) || defined(TAIL)
+
+#include <atomic>
+#include <string>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+// A log store is a series of fixed-size segment files (server_log.0,
+// server_log.1, ...) that are mapped into memory. Each record in a segment
+// is a 4 byte length followed by the record's data, padded to 8 bytes. The
+// length is written last, so a length of 0 (segments are zero filled when
+// they are allocated) means the record has not been committed yet, while
+// RECORD_PAD means the rest of the segment is unused and the next record is
+// at the start of the next segment.
+
+constexpr uint32_t RECORD_PAD = 0xFFFFFFFF;
+
+constexpr std::size_t
+record_size(std::size_t len)
+{ return (sizeof(uint32_t) + len + 7) & ~std::size_t(7); }
+
+inline std::atomic<uint32_t> &
+record_length(char *ptr)
+{
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t));
+    return *reinterpret_cast<std::atomic<uint32_t> *>(ptr);
+}
+
+std::string
+segment_path(const std::string &prefix, std::size_t index)
+{ return prefix + '.' + std::to_string(index); }
+
+class log_segment
+{
+public:
+
+    // A writable segment is created (or reopened) and allocated up front
+    // with fallocate(), so that writing to the mapping never has to extend
+    // the file. A reader maps an existing segment read-only. The file is
+    // closed again as soon as it is mapped, since the mapping keeps a
+    // reference to it of its own.
+
+    log_segment(const std::string &path, std::size_t size, bool writable) :
+        m_size{size}
+    {
+        auto flags = writable ? O_RDWR | O_CREAT : O_RDONLY;
+        auto fd = ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+
+        if (fd == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        auto error = 0;
+
+        if (writable && ::fallocate(fd, 0, 0, static_cast<off_t>(size)) == -1) {
+            if (errno != EOPNOTSUPP || ::ftruncate(fd, static_cast<off_t>(size)) == -1) {
+                error = errno;
+            }
+        }
+
+        auto prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+        auto ptr = MAP_FAILED;
+
+        if (error == 0) {
+            if (ptr = ::mmap(nullptr, size, prot, MAP_SHARED, fd, 0); ptr == MAP_FAILED) {
+                error = errno;
+            }
+        }
+
+        close(fd);
+
+        if (error != 0) {
+            throw std::runtime_error(strerror(error));
+        }
+
+        m_data = static_cast<char *>(ptr);
+    }
+
+    log_segment(const log_segment &) = delete;
+    log_segment &operator=(const log_segment &) = delete;
+
+    char *data() const
+    { return m_data; }
+
+    std::size_t size() const
+    { return m_size; }
+
+    ~log_segment()
+    {
+        ::munmap(m_data, m_size);
+    }
+
+private:
+
+    char *m_data{};
+    std::size_t m_size{};
+};
+
+#endif
+
+#if defined(SERVER) || defined(BENCHMARK)
 
 #include <array>
+#include <deque>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <iterator>
+#include <algorithm>
+#include <functional>
 #include <unordered_map>
 
 #include <sstream>
@@ -32,50 +152,425 @@
 #include <iostream>
 
 #include <mutex>
+#include <atomic>
+#include <chrono>
 #include <thread>
+#include <condition_variable>
 
+#include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
 #include <string.h>
 
+#include <sys/uio.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
-std::mutex log_mutex;
-std::fstream g_log{"server_log.txt", std::ios::out | std::ios::app};
+// -----------------------------------------------------------------------------
+// Work Stealing Deque
+// -----------------------------------------------------------------------------
+
+using task = std::function<void()>;
+
+// A Chase-Lev deque is owned by a single worker, which pushes and pops tasks
+// at the bottom without taking a lock (LIFO, which is cache friendly), while
+// other workers steal from the top (FIFO). Only the owner and thieves racing
+// for the very last task need a compare-and-swap. When the ring buffer fills
+// up, the owner replaces it with one twice as large. Old rings are kept until
+// the deque is destroyed, since a thief may still be reading from one.
 
-ssize_t
-recv(int handle, std::array<char, MAX_SIZE> &buf)
+class work_deque
 {
-    return ::recv(
-        handle,
-        buf.data(),
-        buf.size(),
-        0
-    );
-}
+    struct ring
+    {
+        explicit ring(int64_t capacity) :
+            m_capacity{capacity},
+            m_items{new std::atomic<task *>[static_cast<std::size_t>(capacity)]}
+        { }
 
-void
-log(int handle)
+        int64_t capacity() const
+        { return m_capacity; }
+
+        task *get(int64_t i) const
+        { return m_items[static_cast<std::size_t>(i & (m_capacity - 1))].load(std::memory_order_relaxed); }
+
+        void put(int64_t i, task *t)
+        { m_items[static_cast<std::size_t>(i & (m_capacity - 1))].store(t, std::memory_order_relaxed); }
+
+        int64_t m_capacity;
+        std::unique_ptr<std::atomic<task *>[]> m_items;
+    };
+
+    std::atomic<int64_t> m_top{};
+    std::atomic<int64_t> m_bottom{};
+    std::atomic<ring *> m_ring;
+
+    std::vector<std::unique_ptr<ring>> m_rings;
+
+public:
+
+    explicit work_deque(int64_t capacity = 0x100)
+    {
+        m_rings.push_back(std::make_unique<ring>(capacity));
+        m_ring.store(m_rings.back().get(), std::memory_order_relaxed);
+    }
+
+    // Owner only.
+
+    void push(task *t)
+    {
+        auto b = m_bottom.load(std::memory_order_relaxed);
+        auto top = m_top.load(std::memory_order_acquire);
+        auto r = m_ring.load(std::memory_order_relaxed);
+
+        if (b - top > r->capacity() - 1) {
+            r = grow(r, top, b);
+        }
+
+        r->put(b, t);
+
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    // Owner only.
+
+    task *pop()
+    {
+        auto b = m_bottom.load(std::memory_order_relaxed) - 1;
+        auto r = m_ring.load(std::memory_order_relaxed);
+
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        auto top = m_top.load(std::memory_order_relaxed);
+
+        if (top > b) {
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        auto t = r->get(b);
+
+        if (top == b) {
+            if (!m_top.compare_exchange_strong(
+                    top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            {
+                t = nullptr;
+            }
+
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+        }
+
+        return t;
+    }
+
+    // Any thread.
+
+    task *steal()
+    {
+        auto top = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto b = m_bottom.load(std::memory_order_acquire);
+
+        if (top >= b) {
+            return nullptr;
+        }
+
+        auto t = m_ring.load(std::memory_order_acquire)->get(top);
+
+        if (!m_top.compare_exchange_strong(
+                top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        {
+            return nullptr;
+        }
+
+        return t;
+    }
+
+private:
+
+    ring *grow(ring *r, int64_t top, int64_t b)
+    {
+        auto bigger = std::make_unique<ring>(r->capacity() * 2);
+
+        for (auto i = top; i < b; i++) {
+            bigger->put(i, r->get(i));
+        }
+
+        m_rings.push_back(std::move(bigger));
+        m_ring.store(m_rings.back().get(), std::memory_order_release);
+
+        return m_rings.back().get();
+    }
+};
+
+// -----------------------------------------------------------------------------
+// Thread Pool
+// -----------------------------------------------------------------------------
+
+// A fixed number of workers, each with its own work_deque. Tasks submitted
+// by a worker go on that worker's deque, while tasks submitted by any other
+// thread go on a shared injection queue. A worker looks for work in its own
+// deque first, then in the injection queue, and finally steals from the
+// other workers. Workers with nothing to do sleep on a condition variable,
+// which submit() only signals when a worker is actually asleep.
+
+class thread_pool
 {
-    while(true)
+    struct worker
+    {
+        work_deque deque;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<worker>> m_workers;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<task *> m_injected;
+
+    std::atomic<int64_t> m_pending{};
+    std::atomic<int64_t> m_sleepers{};
+    std::atomic<bool> m_stop{};
+
+    static thread_local thread_pool *t_pool;
+    static thread_local std::size_t t_index;
+
+public:
+
+    explicit thread_pool(std::size_t num = std::thread::hardware_concurrency())
     {
-        std::array<char, MAX_SIZE> buf{};
+        num = std::max<std::size_t>(num, 1);
+
+        for (std::size_t i = 0; i < num; i++) {
+            m_workers.push_back(std::make_unique<worker>());
+        }
+
+        for (std::size_t i = 0; i < num; i++) {
+            m_workers[i]->thread = std::thread{&thread_pool::run, this, i};
+        }
+    }
 
-        if (auto len = recv(handle, buf); len != 0) {
-            std::unique_lock lock(log_mutex);
+    thread_pool(const thread_pool &) = delete;
+    thread_pool &operator=(const thread_pool &) = delete;
 
-            g_log.write(buf.data(), len);
-            std::clog.write(buf.data(), len);
+    template<typename F>
+    void submit(F &&func)
+    {
+        auto t = new task{std::forward<F>(func)};
 
-            g_log.flush();
+        if (t_pool == this) {
+            m_workers[t_index]->deque.push(t);
         }
         else {
-            break;
+            std::lock_guard lock(m_mutex);
+            m_injected.push_back(t);
+        }
+
+        m_pending++;
+
+        if (m_sleepers > 0) {
+            std::lock_guard lock(m_mutex);
+            m_cv.notify_one();
         }
     }
 
-    close(handle);
-}
+    std::size_t size() const
+    { return m_workers.size(); }
+
+    // Waits for the workers to finish any task they are running. Tasks that
+    // have not started yet are discarded.
+
+    ~thread_pool()
+    {
+        {
+            std::lock_guard lock(m_mutex);
+            m_stop = true;
+        }
+
+        m_cv.notify_all();
+
+        for (const auto &w : m_workers) {
+            w->thread.join();
+        }
+
+        for (const auto &w : m_workers) {
+            while (auto t = w->deque.pop()) {
+                delete t;
+            }
+        }
+
+        for (auto t : m_injected) {
+            delete t;
+        }
+    }
+
+private:
+
+    void run(std::size_t index)
+    {
+        t_pool = this;
+        t_index = index;
+
+        std::minstd_rand rand{static_cast<unsigned>(index)};
+
+        while (!m_stop) {
+            if (auto t = find(index, rand)) {
+                m_pending--;
+
+                (*t)();
+                delete t;
+
+                continue;
+            }
+
+            std::unique_lock lock(m_mutex);
+
+            m_sleepers++;
+            m_cv.wait(lock, [&]{ return m_stop || m_pending > 0; });
+            m_sleepers--;
+        }
+    }
+
+    task *find(std::size_t index, std::minstd_rand &rand)
+    {
+        if (auto t = m_workers[index]->deque.pop()) {
+            return t;
+        }
+
+        {
+            std::lock_guard lock(m_mutex);
+
+            if (!m_injected.empty()) {
+                auto t = m_injected.front();
+                m_injected.pop_front();
+
+                return t;
+            }
+        }
+
+        auto num = m_workers.size();
+        auto start = rand() % num;
+
+        for (std::size_t i = 0; i < num; i++) {
+            if (auto victim = (start + i) % num; victim != index) {
+                if (auto t = m_workers[victim]->deque.steal()) {
+                    return t;
+                }
+            }
+        }
+
+        return nullptr;
+    }
+};
+
+thread_local thread_pool *thread_pool::t_pool{};
+thread_local std::size_t thread_pool::t_index{};
+
+// -----------------------------------------------------------------------------
+// Poller
+// -----------------------------------------------------------------------------
+
+// Instead of a thread blocking in recv() for every connection, a single
+// poller thread waits for any connection to become readable using epoll,
+// and submits a task to the thread pool to service it. EPOLLONESHOT disarms
+// a connection once it has been reported, so only one task at a time ever
+// services a given connection, and the task re-arms it once it is done. The
+// handler returns false once the connection has been closed, in which case
+// the poller deletes it. A handler that throws is treated the same way, after
+// the error is reported, so that one bad connection cannot take down the
+// worker (and with it, the whole server).
+
+template<typename C>
+class poller
+{
+public:
+
+    using handler_t = std::function<bool(C &)>;
+
+    poller(thread_pool &pool, handler_t handler) :
+        m_pool{pool},
+        m_handler{std::move(handler)}
+    {
+        if (m_fd = ::epoll_create1(EPOLL_CLOEXEC); m_fd == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+    }
+
+    void add(C *c)
+    { ctl(EPOLL_CTL_ADD, c); }
+
+    [[noreturn]] void run()
+    {
+        std::array<struct epoll_event, 64> events;
+
+        while (true) {
+            auto num = ::epoll_wait(m_fd, events.data(), events.size(), -1);
+
+            if (num == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                throw std::runtime_error(strerror(errno));
+            }
+
+            for (auto i = 0; i < num; i++) {
+                auto c = static_cast<C *>(events[static_cast<std::size_t>(i)].data.ptr);
+
+                m_pool.submit([this, c]{
+                    auto open = false;
+
+                    try {
+                        open = m_handler(*c);
+                    }
+                    catch (const std::exception &e) {
+                        std::cerr << "closing connection: " << e.what() << '\n';
+                    }
+
+                    if (open) {
+                        ctl(EPOLL_CTL_MOD, c);
+                    }
+                    else {
+                        ::epoll_ctl(m_fd, EPOLL_CTL_DEL, c->fd, nullptr);
+                        close(c->fd);
+
+                        delete c;
+                    }
+                });
+            }
+        }
+    }
+
+    ~poller()
+    {
+        close(m_fd);
+    }
+
+private:
+
+    void ctl(int op, C *c)
+    {
+        struct epoll_event event{};
+
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        event.data.ptr = c;
+
+        if (::epoll_ctl(m_fd, op, c->fd, &event) == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+    }
+
+    int m_fd{};
+    thread_pool &m_pool;
+    handler_t m_handler;
+};
+
+// -----------------------------------------------------------------------------
+// Server
+// -----------------------------------------------------------------------------
 
 class myserver
 {
@@ -90,56 +585,858 @@ public:
             throw std::runtime_error(strerror(errno));
         }
 
-        m_addr.sin_family = AF_INET;
-        m_addr.sin_port = htons(port);
-        m_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        m_addr.sin_family = AF_INET;
+        m_addr.sin_port = htons(port);
+        m_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+        if (bind() == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+    }
+
+    int bind()
+    {
+        return ::bind(
+            m_fd,
+            reinterpret_cast<struct sockaddr *>(&m_addr),
+            sizeof(m_addr)
+        );
+    }
+
+    uint16_t port()
+    {
+        struct sockaddr_in addr{};
+        socklen_t len = sizeof(addr);
+
+        if (::getsockname(m_fd, reinterpret_cast<struct sockaddr *>(&addr), &len) == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        return ntohs(addr.sin_port);
+    }
+
+    void listen()
+    {
+        if (::listen(m_fd, SOMAXCONN) == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+    }
+
+    int accept()
+    {
+        if (int c = ::accept(m_fd, nullptr, nullptr); c != -1) {
+            return c;
+        }
+
+        throw std::runtime_error(strerror(errno));
+    }
+
+    ~myserver()
+    {
+        close(m_fd);
+    }
+};
+
+using buffer = std::array<char, MAX_SIZE>;
+
+// Receive buffers are handed out from a pool each time a connection is
+// serviced, and are returned to the pool afterwards so that the next
+// connection can reuse them. Buffers are never zeroed, as only the bytes
+// returned by recv() are ever read.
+
+class buffer_pool
+{
+public:
+
+    std::unique_ptr<buffer> acquire()
+    {
+        std::unique_lock lock(m_mutex);
+
+        if (m_free.empty()) {
+            return std::unique_ptr<buffer>(new buffer);
+        }
+
+        auto buf = std::move(m_free.back());
+        m_free.pop_back();
+
+        return buf;
+    }
+
+    void release(std::unique_ptr<buffer> buf)
+    {
+        std::unique_lock lock(m_mutex);
+        m_free.push_back(std::move(buf));
+    }
+
+private:
+
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<buffer>> m_free;
+};
+
+buffer_pool g_buffers;
+
+// -----------------------------------------------------------------------------
+// Statistics
+// -----------------------------------------------------------------------------
+
+struct server_stats
+{
+    std::atomic<uint64_t> connections{};
+    std::atomic<uint64_t> queued_bytes{};
+    std::atomic<uint64_t> written_bytes{};
+    std::atomic<uint64_t> dropped_bytes{};
+    std::atomic<uint64_t> dropped_chunks{};
+    std::atomic<uint64_t> blocked{};
+    std::atomic<uint64_t> writes{};
+    std::atomic<uint64_t> syncs{};
+};
+
+server_stats g_stats;
+
+std::string
+stats_report()
+{
+    std::stringstream ss;
+
+    ss << "connections: " << g_stats.connections << '\n';
+    ss << "queued_bytes: " << g_stats.queued_bytes << '\n';
+    ss << "written_bytes: " << g_stats.written_bytes << '\n';
+    ss << "dropped_bytes: " << g_stats.dropped_bytes << '\n';
+    ss << "dropped_chunks: " << g_stats.dropped_chunks << '\n';
+    ss << "blocked: " << g_stats.blocked << '\n';
+    ss << "writes: " << g_stats.writes << '\n';
+    ss << "syncs: " << g_stats.syncs << '\n';
+
+    return ss.str();
+}
+
+// -----------------------------------------------------------------------------
+// Connection Queues
+// -----------------------------------------------------------------------------
+
+// Each connection's reader pushes what it receives onto its own queue, which
+// holds at most MAX_QUEUED bytes, and a single writer thread drains every
+// queue to disk. A slow disk write therefore never stalls a reader while it
+// holds a lock that other readers need. When the writer falls behind and a
+// queue fills up, the overflow policy decides what happens:
+//
+// - block: the reader waits for room, which pushes back on the client
+//   through TCP flow control (nothing is lost)
+// - drop_oldest: the oldest queued data is discarded to make room
+// - drop_newest: the data that was just received is discarded
+
+enum class overflow_policy
+{
+    block,
+    drop_oldest,
+    drop_newest
+};
+
+class log_writer;
+
+class connection_queue
+{
+public:
+
+    connection_queue(overflow_policy policy, log_writer &writer) :
+        m_policy{policy},
+        m_writer{writer}
+    { }
+
+    void push(const char *buf, std::size_t len);
+
+    // Moves everything that is queued into chunks, returning the number of
+    // bytes that were moved.
+
+    std::size_t pop(std::deque<std::string> &chunks)
+    {
+        std::unique_lock lock(m_mutex);
+
+        auto bytes = m_bytes;
+        std::move(m_chunks.begin(), m_chunks.end(), std::back_inserter(chunks));
+
+        m_chunks.clear();
+        m_bytes = 0;
+
+        m_not_full.notify_all();
+        return bytes;
+    }
+
+    void close()
+    {
+        std::unique_lock lock(m_mutex);
+        m_closed = true;
+    }
+
+    bool done()
+    {
+        std::unique_lock lock(m_mutex);
+        return m_closed && m_chunks.empty();
+    }
+
+private:
+
+    void drop(std::size_t len)
+    {
+        g_stats.dropped_bytes += len;
+        g_stats.dropped_chunks++;
+    }
+
+    overflow_policy m_policy;
+    log_writer &m_writer;
+
+    std::mutex m_mutex;
+    std::condition_variable m_not_full;
+
+    std::deque<std::string> m_chunks;
+    std::size_t m_bytes{};
+    bool m_closed{};
+};
+
+// -----------------------------------------------------------------------------
+// Log Writer
+// -----------------------------------------------------------------------------
+
+// The durability mode decides when the writer calls fdatasync(), which is
+// the point at which logged data is known to be on disk:
+//
+// - none: data is written to the page cache, and the kernel decides when it
+//   reaches the disk (lost if the machine crashes, but not if the server
+//   does)
+// - group: everything the writer has drained is written using as few
+//   writev() calls as possible, and fdatasync() is called once max_bytes
+//   have been written or max_delay has passed since the last one, so that a
+//   single sync commits the data of many messages (group commit)
+// - always: every chunk is written and synced on its own before the next
+//   one, which is what a logger without group commit has to do to make the
+//   same guarantee
+
+enum class durability
+{
+    none,
+    group,
+    always
+};
+
+struct commit_policy
+{
+    durability mode{durability::none};
+    std::size_t max_bytes{0x100000};
+    std::chrono::milliseconds max_delay{10};
+};
+
+class log_writer
+{
+public:
+
+    explicit log_writer(const char *path, bool echo = true) :
+        m_echo{echo}
+    {
+        if (m_fd = ::open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644); m_fd == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+    }
+
+    std::shared_ptr<connection_queue> add(overflow_policy policy)
+    {
+        auto queue = std::make_shared<connection_queue>(policy, *this);
+
+        std::unique_lock lock(m_mutex);
+        m_queues.push_back(queue);
+
+        return queue;
+    }
+
+    void notify()
+    {
+        std::unique_lock lock(m_mutex);
+
+        m_work = true;
+        m_cv.notify_one();
+    }
+
+    // Tells run() to return once it has drained every queue. This should
+    // only be called after every queue has been closed.
+
+    void stop()
+    {
+        std::unique_lock lock(m_mutex);
+
+        m_stop = true;
+        m_cv.notify_one();
+    }
+
+    void run(commit_policy policy = {})
+    {
+        using namespace std::chrono;
+
+        std::deque<std::string> chunks;
+        std::vector<std::shared_ptr<connection_queue>> queues;
+
+        std::size_t unsynced{};
+        auto last_sync = steady_clock::now();
+
+        while (true) {
+            auto stop = false;
+
+            // While there is data that has not been synced yet, the writer
+            // wakes up no later than max_delay after the last sync, even if
+            // no new data arrives.
+
+            {
+                std::unique_lock lock(m_mutex);
+                auto ready = [&]{ return m_work || m_stop; };
+
+                if (unsynced == 0) {
+                    m_cv.wait(lock, ready);
+                }
+                else {
+                    m_cv.wait_until(lock, last_sync + policy.max_delay, ready);
+                }
+
+                m_work = false;
+                stop = m_stop;
+                queues = m_queues;
+            }
+
+            std::size_t bytes{};
+            for (const auto &queue : queues) {
+                bytes += queue->pop(chunks);
+            }
+
+            if (policy.mode == durability::always) {
+                for (const auto &chunk : chunks) {
+                    write(chunk);
+                    sync();
+                }
+            }
+            else {
+                write(chunks);
+
+                if (policy.mode == durability::group) {
+                    unsynced += bytes;
+                }
+            }
+
+            g_stats.queued_bytes -= bytes;
+            g_stats.written_bytes += bytes;
+
+            chunks.clear();
+
+            if (unsynced != 0) {
+                auto now = steady_clock::now();
+
+                if (stop || unsynced >= policy.max_bytes || now - last_sync >= policy.max_delay) {
+                    sync();
+
+                    unsynced = 0;
+                    last_sync = now;
+                }
+            }
+
+            // Queues of connections that have closed are removed once they
+            // have been completely drained.
+
+            std::unique_lock lock(m_mutex);
+            m_queues.erase(
+                std::remove_if(m_queues.begin(), m_queues.end(),
+                    [](const auto &queue) { return queue->done(); }),
+                m_queues.end()
+            );
+
+            if (stop && m_queues.empty()) {
+                return;
+            }
+        }
+    }
+
+    ~log_writer()
+    {
+        close(m_fd);
+    }
+
+private:
+
+    void write(const std::string &chunk)
+    {
+        struct iovec iov = {const_cast<char *>(chunk.data()), chunk.size()};
+        write(m_fd, &iov, 1);
+
+        if (m_echo) {
+            iov = {const_cast<char *>(chunk.data()), chunk.size()};
+            write(STDERR_FILENO, &iov, 1);
+        }
+    }
+
+    void write(const std::deque<std::string> &chunks)
+    {
+        if (chunks.empty()) {
+            return;
+        }
+
+        auto iovs = [&chunks] {
+            std::vector<struct iovec> iovs;
+            iovs.reserve(chunks.size());
+
+            for (const auto &chunk : chunks) {
+                iovs.push_back({const_cast<char *>(chunk.data()), chunk.size()});
+            }
+
+            return iovs;
+        };
+
+        auto iov = iovs();
+        write(m_fd, iov.data(), iov.size());
+
+        if (m_echo) {
+            iov = iovs();
+            write(STDERR_FILENO, iov.data(), iov.size());
+        }
+    }
+
+    // Writes an entire I/O vector, IOV_MAX entries at a time, resuming after
+    // any partial write. The vector is consumed in the process.
+
+    void write(int fd, struct iovec *iov, std::size_t num)
+    {
+        while (num != 0) {
+            auto len = ::writev(fd, iov, static_cast<int>(std::min<std::size_t>(num, IOV_MAX)));
+
+            if (len == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                throw std::runtime_error(strerror(errno));
+            }
+
+            g_stats.writes++;
+
+            for (auto left = static_cast<std::size_t>(len); num != 0 && left != 0;) {
+                if (left < iov->iov_len) {
+                    iov->iov_base = static_cast<char *>(iov->iov_base) + left;
+                    iov->iov_len -= left;
+                    break;
+                }
+
+                left -= iov->iov_len;
+                iov++;
+                num--;
+            }
+        }
+    }
+
+    void sync()
+    {
+        if (::fdatasync(m_fd) == -1) {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        g_stats.syncs++;
+    }
+
+    int m_fd{};
+    bool m_echo;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+
+    bool m_work{};
+    bool m_stop{};
+    std::vector<std::shared_ptr<connection_queue>> m_queues;
+};
+
+void
+connection_queue::push(const char *buf, std::size_t len)
+{
+    {
+        std::unique_lock lock(m_mutex);
+
+        if (m_bytes + len > MAX_QUEUED) {
+            switch (m_policy) {
+                case overflow_policy::block:
+                    g_stats.blocked++;
+                    m_not_full.wait(lock, [&]{ return m_bytes + len <= MAX_QUEUED; });
+                    break;
+
+                case overflow_policy::drop_oldest:
+                    while (!m_chunks.empty() && m_bytes + len > MAX_QUEUED) {
+                        auto size = m_chunks.front().size();
+
+                        drop(size);
+                        m_bytes -= size;
+                        g_stats.queued_bytes -= size;
+
+                        m_chunks.pop_front();
+                    }
+                    break;
+
+                case overflow_policy::drop_newest:
+                    drop(len);
+                    return;
+            }
+        }
+
+        m_chunks.emplace_back(buf, len);
+
+        m_bytes += len;
+        g_stats.queued_bytes += len;
+    }
+
+    m_writer.notify();
+}
+
+
+// -----------------------------------------------------------------------------
+// Log Store
+// -----------------------------------------------------------------------------
+
+// Instead of handing data to a writer thread, producers append records to
+// the mapped segments directly. Space is reserved with a single fetch-add on
+// the segment's offset, after which each producer copies its record in
+// without any further synchronization. The one producer whose reservation
+// runs past the end of a segment pads it out and rolls over to a new
+// segment, while any other producer that overflowed waits for it to do so.
+// If the new segment cannot be created (for example, when the disk is
+// full), the store is marked as failed, and every append from then on
+// throws instead of waiting for a roll that will never happen.
+//
+// Data reaches the disk when the kernel writes the dirty pages back, which
+// is the same guarantee as durability::none. A segment is unmapped once it
+// has been replaced and the last producer still writing to it is done. To
+// know when that is, each segment counts its references: one for the store
+// while the segment is current, plus one for each producer in the middle of
+// an append. A producer only takes a reference while the count is not yet
+// zero, so it can never start on a segment that is gone. The segment
+// objects themselves (a few dozen bytes each) are kept, since a producer
+// may have loaded a pointer to one that it has not taken a reference to
+// yet.
+
+class log_store
+{
+    struct segment
+    {
+        segment(const std::string &path, std::size_t size) :
+            map{std::make_unique<log_segment>(path, size, true)}
+        { }
+
+        std::unique_ptr<log_segment> map;
+        std::atomic<std::size_t> reserved{};
+        std::atomic<std::size_t> refs{1};
+    };
+
+public:
+
+    explicit log_store(std::string prefix, std::size_t segment_size = SEGMENT_SIZE) :
+        m_prefix{std::move(prefix)},
+        m_segment_size{segment_size}
+    {
+        // When reopening an existing log, appending starts on a new segment.
+        // If the server crashed, the newest segment may contain a reservation
+        // that was never committed, and as its length is unknown, so are the
+        // offsets of any records after it. Its first empty slot is padded
+        // instead, so that readers move on to the new segment.
+
+        if (::access(segment_path(m_prefix, 0).c_str(), F_OK) == 0) {
+            while (::access(segment_path(m_prefix, m_index + 1).c_str(), F_OK) == 0) {
+                m_index++;
+            }
+
+            log_segment last{segment_path(m_prefix, m_index++), m_segment_size, true};
+
+            for (std::size_t offset = 0; offset + sizeof(uint32_t) <= m_segment_size;) {
+                auto &len = record_length(last.data() + offset);
+
+                if (len == 0) {
+                    len.store(RECORD_PAD, std::memory_order_release);
+                    break;
+                }
+
+                if (len == RECORD_PAD) {
+                    break;
+                }
+
+                offset += record_size(len);
+            }
+        }
+
+        auto seg = std::make_unique<segment>(segment_path(m_prefix, m_index), m_segment_size);
+
+        m_current = seg.get();
+        m_segments.push_back(std::move(seg));
+    }
+
+    void append(const char *buf, std::size_t len)
+    {
+        auto size = record_size(len);
+
+        if (size > m_segment_size) {
+            throw std::invalid_argument("record larger than a segment");
+        }
+
+        while (true) {
+            check();
+
+            auto seg = m_current.load(std::memory_order_acquire);
+            if (!acquire(seg)) {
+                continue;
+            }
+
+            auto offset = seg->reserved.fetch_add(size, std::memory_order_relaxed);
+
+            if (offset + size <= m_segment_size) {
+                auto ptr = seg->map->data() + offset;
+
+                memcpy(ptr + sizeof(uint32_t), buf, len);
+                record_length(ptr).store(static_cast<uint32_t>(len), std::memory_order_release);
+
+                release(seg);
+
+                g_stats.written_bytes += len;
+                return;
+            }
+
+            if (offset <= m_segment_size) {
+                roll(seg, offset);
+                continue;
+            }
+
+            release(seg);
+
+            while (m_current.load(std::memory_order_acquire) == seg) {
+                check();
+                std::this_thread::yield();
+            }
+        }
+    }
+
+private:
+
+    void check()
+    {
+        if (m_failed.load(std::memory_order_acquire)) {
+            throw std::runtime_error("log store failed to roll over to a new segment");
+        }
+    }
+
+    bool acquire(segment *seg)
+    {
+        auto refs = seg->refs.load(std::memory_order_relaxed);
+
+        do {
+            if (refs == 0) {
+                return false;
+            }
+        }
+        while (!seg->refs.compare_exchange_weak(refs, refs + 1, std::memory_order_acquire));
+
+        return true;
+    }
+
+    void release(segment *seg)
+    {
+        if (seg->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            seg->map.reset();
+        }
+    }
+
+    // Takes over the caller's reference to seg. Once the new segment has
+    // been published, the store's reference to seg is dropped as well.
+
+    void roll(segment *seg, std::size_t offset)
+    {
+        if (offset + sizeof(uint32_t) <= m_segment_size) {
+            record_length(seg->map->data() + offset).store(RECORD_PAD, std::memory_order_release);
+        }
+
+        // The new segment is only published once everything else has been
+        // updated, as the next roll can happen as soon as it is.
+
+        std::unique_ptr<segment> next;
+
+        try {
+            next = std::make_unique<segment>(segment_path(m_prefix, ++m_index), m_segment_size);
+        }
+        catch (...) {
+            m_failed.store(true, std::memory_order_release);
+            release(seg);
+            throw;
+        }
+
+        auto ptr = next.get();
+
+        m_segments.push_back(std::move(next));
+        m_current.store(ptr, std::memory_order_release);
+
+        release(seg);
+        release(seg);
+    }
+
+    std::string m_prefix;
+    std::size_t m_segment_size;
+
+    std::size_t m_index{};
+    std::atomic<segment *> m_current{};
+    std::atomic<bool> m_failed{};
+    std::vector<std::unique_ptr<segment>> m_segments;
+};
+
+#endif
+
+#ifdef SERVER
+
+log_writer g_writer{"server_log.txt"};
+std::unique_ptr<log_store> g_store;
+
+// -----------------------------------------------------------------------------
+// Connections
+// -----------------------------------------------------------------------------
+
+// The connection's queue is closed when the poller deletes it, whether the
+// client closed the connection or servicing it failed, so that the log
+// writer always gets to drop the queue.
+
+struct connection
+{
+    int fd;
+    std::shared_ptr<connection_queue> queue;
+
+    ~connection()
+    {
+        if (queue) {
+            queue->close();
+            g_writer.notify();
+        }
+
+        g_stats.connections--;
+    }
+};
+
+// Services a readable connection by reading everything that is available
+// without blocking. Returns false once the client has closed the connection.
+
+bool
+service(connection &c)
+{
+    auto buf = g_buffers.acquire();
+    auto open = true;
+
+    while (true) {
+        auto len = ::recv(c.fd, buf->data(), buf->size(), MSG_DONTWAIT);
+
+        if (len > 0) {
+            if (g_store) {
+                g_store->append(buf->data(), static_cast<std::size_t>(len));
+            }
+            else {
+                c.queue->push(buf->data(), static_cast<std::size_t>(len));
+            }
+
+            continue;
+        }
+
+        if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+
+        open = false;
+        break;
+    }
+
+    g_buffers.release(std::move(buf));
+    return open;
+}
+
+int
+protected_main(int argc, char** argv)
+{
+    // usage: example3_server [block|drop_oldest|drop_newest] [none|group|always] [file|mmap]
+    //
+    // With the mmap backend, connections append to the log store directly,
+    // so neither the overflow policy nor the durability mode apply. The
+    // store is read using example3_tail.
+
+    auto policy = overflow_policy::block;
+    auto commit = commit_policy{};
+
+    if (argc > 1) {
+        if (std::string arg = argv[1]; arg == "drop_oldest") {
+            policy = overflow_policy::drop_oldest;
+        }
+        else if (arg == "drop_newest") {
+            policy = overflow_policy::drop_newest;
+        }
+        else if (arg != "block") {
+            throw std::invalid_argument("unknown overflow policy");
+        }
+    }
+
+    if (argc > 2) {
+        if (std::string arg = argv[2]; arg == "group") {
+            commit.mode = durability::group;
+        }
+        else if (arg == "always") {
+            commit.mode = durability::always;
+        }
+        else if (arg != "none") {
+            throw std::invalid_argument("unknown durability mode");
+        }
+    }
 
-        if (bind() == -1) {
-            throw std::runtime_error(strerror(errno));
+    if (argc > 3) {
+        if (std::string arg = argv[3]; arg == "mmap") {
+            g_store = std::make_unique<log_store>("server_log");
+        }
+        else if (arg != "file") {
+            throw std::invalid_argument("unknown backend");
         }
     }
 
-    int bind()
-    {
-        return ::bind(
-            m_fd,
-            reinterpret_cast<struct sockaddr *>(&m_addr),
-            sizeof(m_addr)
-        );
+    myserver server{PORT};
+    myserver stats{STATS_PORT};
+
+    server.listen();
+    stats.listen();
+
+    if (!g_store) {
+        std::thread{[commit]{ g_writer.run(commit); }}.detach();
     }
 
-    void listen()
-    {
-        if (::listen(m_fd, 0) == -1) {
-            throw std::runtime_error(strerror(errno));
-        }
+    // The stats endpoint sends a plain text report to anyone that connects
+    // to STATS_PORT (for example, using "nc localhost 22001"), and then
+    // closes the connection.
 
+    std::thread{[&stats]{
         while (true) {
-            if (int c = ::accept(m_fd, nullptr, nullptr); c != -1) {
-                std::thread t{log, c};
-                t.detach();
+            auto c = stats.accept();
+            auto report = stats_report();
 
-                continue;
-            }
-
-            throw std::runtime_error(strerror(errno));
+            ::send(c, report.data(), report.size(), MSG_NOSIGNAL);
+            close(c);
         }
-    }
+    }}.detach();
 
-    ~myserver()
-    {
-        close(m_fd);
-    }
-};
+    // Connections are serviced by a fixed-size thread pool, instead of a
+    // new thread for every connection. Note that with the block policy, a
+    // full queue blocks the worker that is servicing it.
 
-int
-protected_main(int argc, char** argv)
-{
-    (void) argc;
-    (void) argv;
+    thread_pool pool;
+    poller<connection> connections{pool, service};
 
-    myserver server{PORT};
-    server.listen();
+    std::thread{[&connections]{ connections.run(); }}.detach();
+
+    while (true) {
+        auto c = server.accept();
+        g_stats.connections++;
+
+        if (g_store) {
+            connections.add(new connection{c, nullptr});
+        }
+        else {
+            connections.add(new connection{c, g_writer.add(policy)});
+        }
+    }
 }
 
 int
@@ -292,4 +1589,427 @@ main(int argc, char** argv)
     return EXIT_FAILURE;
 }
 
-#endif
\ No newline at end of file
+#endif
+// -----------------------------------------------------------------------------
+// Benchmark
+// -----------------------------------------------------------------------------
+
+#ifdef BENCHMARK
+
+#include <chrono>
+#include <iomanip>
+#include <string_view>
+
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+using namespace std::chrono;
+
+struct storm_stats
+{
+    std::atomic<uint64_t> closed{};
+    std::atomic<uint64_t> threads{};
+    std::atomic<uint64_t> peak_threads{};
+    std::atomic<uint64_t> bytes{};
+};
+
+storm_stats g_storm;
+
+void
+thread_started()
+{
+    auto threads = ++g_storm.threads;
+    auto peak = g_storm.peak_threads.load();
+
+    while (threads > peak && !g_storm.peak_threads.compare_exchange_weak(peak, threads));
+}
+
+// Reads from a connection until the client closes it.
+
+void
+drain(int fd)
+{
+    std::array<char, MAX_SIZE> buf;
+
+    while (true) {
+        auto len = ::recv(fd, buf.data(), buf.size(), 0);
+        if (len <= 0) {
+            break;
+        }
+
+        g_storm.bytes += static_cast<uint64_t>(len);
+    }
+
+    close(fd);
+    g_storm.closed++;
+}
+
+struct storm_connection
+{
+    int fd;
+};
+
+bool
+drain_available(storm_connection &c)
+{
+    std::array<char, MAX_SIZE> buf;
+
+    while (true) {
+        auto len = ::recv(c.fd, buf.data(), buf.size(), MSG_DONTWAIT);
+
+        if (len > 0) {
+            g_storm.bytes += static_cast<uint64_t>(len);
+            continue;
+        }
+
+        if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+
+        g_storm.closed++;
+        return false;
+    }
+}
+
+// Each client thread repeatedly opens a burst of connections, writes a small
+// message on each of them, and then closes them all, so that the server sees
+// many short-lived connections arriving at once.
+
+void
+client(uint16_t port, std::size_t rounds, std::size_t burst)
+{
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    std::array<char, 64> msg{};
+    std::vector<int> fds;
+
+    for (std::size_t i = 0; i < rounds; i++) {
+        for (std::size_t j = 0; j < burst; j++) {
+            auto fd = ::socket(AF_INET, SOCK_STREAM, 0);
+            if (fd == -1) {
+                throw std::runtime_error(strerror(errno));
+            }
+
+            if (::connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == -1) {
+                throw std::runtime_error(strerror(errno));
+            }
+
+            if (::send(fd, msg.data(), msg.size(), 0) == -1) {
+                throw std::runtime_error(strerror(errno));
+            }
+
+            fds.push_back(fd);
+        }
+
+        // Closing with SO_LINGER set to 0 resets the connection instead of
+        // leaving it in TIME_WAIT, so a long storm does not run out of
+        // ephemeral ports.
+
+        for (auto fd : fds) {
+            struct linger l{1, 0};
+            ::setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+
+            close(fd);
+        }
+
+        fds.clear();
+    }
+}
+
+template<typename FUNC>
+void
+storm(const char *name, std::size_t clients, std::size_t rounds, std::size_t burst, FUNC func)
+{
+    if (auto pid = ::fork(); pid == 0) {
+        try {
+            myserver server{0};
+            server.listen();
+
+            std::thread{func, std::ref(server)}.detach();
+
+            auto total = clients * rounds * burst;
+            auto stime = steady_clock::now();
+
+            std::vector<std::thread> threads;
+            for (std::size_t i = 0; i < clients; i++) {
+                threads.emplace_back(client, server.port(), rounds, burst);
+            }
+
+            for (auto &t : threads) {
+                t.join();
+            }
+
+            while (g_storm.closed < total) {
+                std::this_thread::sleep_for(milliseconds(1));
+            }
+
+            auto etime = steady_clock::now();
+            auto secs = duration_cast<duration<double>>(etime - stime).count();
+
+            struct rusage usage{};
+            ::getrusage(RUSAGE_SELF, &usage);
+
+            std::cout << std::fixed << std::setprecision(0);
+            std::cout << name << ":\n";
+            std::cout << " - connections/sec: " << static_cast<double>(total) / secs << '\n';
+            std::cout << " - peak server threads: " << g_storm.peak_threads << '\n';
+            std::cout << " - peak rss: " << usage.ru_maxrss << " KB" << std::endl;
+        }
+        catch (const std::exception &e) {
+            std::cerr << name << ": " << e.what() << '\n';
+            ::_exit(EXIT_FAILURE);
+        }
+
+        ::_exit(EXIT_SUCCESS);
+    }
+    else {
+        ::waitpid(pid, nullptr, 0);
+    }
+}
+
+// Each producer pushes num messages onto its own connection queue, and a
+// single writer drains them to a file using the given commit policy.
+
+void
+commit(const char *name, commit_policy policy, std::size_t producers, std::size_t num)
+{
+    constexpr const char *path = "example3_benchmark.log";
+    constexpr std::string_view msg = "\033[1;32mDEBUG\033[0m: Hello World\n";
+
+    g_stats.writes = 0;
+    g_stats.syncs = 0;
+
+    {
+        log_writer writer{path, false};
+
+        auto stime = steady_clock::now();
+        std::thread t{[&writer, policy]{ writer.run(policy); }};
+
+        std::vector<std::thread> threads;
+        for (std::size_t i = 0; i < producers; i++) {
+            threads.emplace_back([&writer, num, msg]{
+                auto queue = writer.add(overflow_policy::block);
+
+                for (std::size_t j = 0; j < num; j++) {
+                    queue->push(msg.data(), msg.size());
+                }
+
+                queue->close();
+                writer.notify();
+            });
+        }
+
+        for (auto &t : threads) {
+            t.join();
+        }
+
+        writer.stop();
+        t.join();
+
+        auto etime = steady_clock::now();
+        auto secs = duration_cast<duration<double>>(etime - stime).count();
+        auto total = static_cast<double>(producers * num);
+
+        std::cout << std::fixed << std::setprecision(0);
+        std::cout << name << ":\n";
+        std::cout << " - msgs/sec: " << total / secs << '\n';
+        std::cout << std::setprecision(2);
+        std::cout << " - msgs/write: " << total / static_cast<double>(std::max<uint64_t>(g_stats.writes, 1)) << '\n';
+
+        if (g_stats.syncs != 0) {
+            std::cout << " - msgs/sync: " << total / static_cast<double>(g_stats.syncs) << '\n';
+        }
+    }
+
+    ::unlink(path);
+}
+
+// The same workload as commit(), except that each producer appends its
+// messages to a log store itself. Small segments are used so that the
+// store rolls over many times.
+
+void
+store(const char *name, std::size_t producers, std::size_t num)
+{
+    constexpr const char *prefix = "example3_benchmark";
+    constexpr std::string_view msg = "\033[1;32mDEBUG\033[0m: Hello World\n";
+
+    double secs{};
+
+    {
+        log_store store{prefix, 0x100000};
+
+        auto stime = steady_clock::now();
+
+        std::vector<std::thread> threads;
+        for (std::size_t i = 0; i < producers; i++) {
+            threads.emplace_back([&store, num, msg]{
+                for (std::size_t j = 0; j < num; j++) {
+                    store.append(msg.data(), msg.size());
+                }
+            });
+        }
+
+        for (auto &t : threads) {
+            t.join();
+        }
+
+        auto etime = steady_clock::now();
+        secs = duration_cast<duration<double>>(etime - stime).count();
+    }
+
+    std::size_t segments{};
+    while (::unlink(segment_path(prefix, segments).c_str()) == 0) {
+        segments++;
+    }
+
+    std::cout << std::fixed << std::setprecision(0);
+    std::cout << name << ":\n";
+    std::cout << " - msgs/sec: " << static_cast<double>(producers * num) / secs << '\n';
+    std::cout << " - segments: " << segments << '\n';
+}
+
+int
+protected_main(int argc, char** argv)
+{
+    std::size_t clients = argc > 1 ? std::stoul(argv[1]) : 8;
+    std::size_t rounds = argc > 2 ? std::stoul(argv[2]) : 100;
+    std::size_t burst = argc > 3 ? std::stoul(argv[3]) : 64;
+    std::size_t num = argc > 4 ? std::stoul(argv[4]) : 10000;
+
+    storm("thread per connection", clients, rounds, burst, [](myserver &server) {
+        while (true) {
+            auto c = server.accept();
+            thread_started();
+
+            std::thread{[c]{
+                drain(c);
+                g_storm.threads--;
+            }}.detach();
+        }
+    });
+
+    storm("thread pool", clients, rounds, burst, [](myserver &server) {
+        thread_pool pool;
+        poller<storm_connection> connections{pool, drain_available};
+
+        g_storm.peak_threads = pool.size() + 1;
+        std::thread{[&connections]{ connections.run(); }}.detach();
+
+        while (true) {
+            connections.add(new storm_connection{server.accept()});
+        }
+    });
+
+    // Syncing every message is much slower than the other modes, so it is
+    // given a tenth of the messages.
+
+    commit("no sync", commit_policy{durability::none}, clients, num);
+    commit("sync per message", commit_policy{durability::always}, clients, num / 10);
+    commit("group commit", commit_policy{durability::group}, clients, num);
+    store("mmap store", clients, num);
+
+    return EXIT_SUCCESS;
+}
+
+int
+main(int argc, char** argv)
+{
+    try {
+        return protected_main(argc, argv);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Caught unhandled exception:\n";
+        std::cerr << " - what(): " << e.what() << '\n';
+    }
+    catch (...) {
+        std::cerr << "Caught unknown exception\n";
+    }
+
+    return EXIT_FAILURE;
+}
+
+#endif
+
+// -----------------------------------------------------------------------------
+// Tail
+// -----------------------------------------------------------------------------
+
+#ifdef TAIL
+
+#include <chrono>
+#include <thread>
+#include <iostream>
+
+#include <sys/stat.h>
+
+// Follows a log store written by "example3_server ... mmap", reading the
+// records straight out of the mapped segments, and moving on to the next
+// segment whenever it reaches the end of one.
+
+int
+protected_main(int argc, char** argv)
+{
+    // usage: example3_tail [prefix] [first segment]
+
+    std::string prefix = argc > 1 ? argv[1] : "server_log";
+    std::size_t index = argc > 2 ? std::stoul(argv[2]) : 0;
+
+    auto idle = []{
+        std::cout.flush();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    };
+
+    while (true) {
+        auto path = segment_path(prefix, index++);
+
+        // A segment is only mapped once the server has allocated all of it,
+        // as touching a page past the end of the file would raise SIGBUS.
+
+        struct stat st{};
+        while (::stat(path.c_str(), &st) == -1 || static_cast<std::size_t>(st.st_size) < SEGMENT_SIZE) {
+            idle();
+        }
+
+        log_segment seg{path, SEGMENT_SIZE, false};
+
+        for (std::size_t offset = 0; offset + sizeof(uint32_t) <= seg.size();) {
+            auto ptr = seg.data() + offset;
+            auto len = record_length(ptr).load(std::memory_order_acquire);
+
+            if (len == 0) {
+                idle();
+                continue;
+            }
+
+            if (len == RECORD_PAD) {
+                break;
+            }
+
+            std::cout.write(ptr + sizeof(uint32_t), len);
+            offset += record_size(len);
+        }
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    try {
+        return protected_main(argc, argv);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Caught unhandled exception:\n";
+        std::cerr << " - what(): " << e.what() << '\n';
+    }
+    catch (...) {
+        std::cerr << "Caught unknown exception\n";
+    }
+
+    return EXIT_FAILURE;
+}
+
+#endif
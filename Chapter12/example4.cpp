@@ -0,0 +1,296 @@
+//
+// Copyright (C) 2018 Rian Quinn <rianquinn@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "mpsc_queue.h"
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <iostream>
+#include <condition_variable>
+
+// -----------------------------------------------------------------------------
+// Tests
+// -----------------------------------------------------------------------------
+
+#ifdef TEST
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+
+TEST_CASE("fifo order")
+{
+    mpsc_queue<int, 4> queue;
+
+    CHECK(queue.capacity() == 4);
+    CHECK(!queue.try_pop());
+
+    for (auto i = 0; i < 4; i++) {
+        CHECK(queue.try_push(i));
+    }
+
+    CHECK(!queue.try_push(4));
+
+    for (auto i = 0; i < 4; i++) {
+        CHECK(queue.try_pop() == i);
+    }
+
+    CHECK(!queue.try_pop());
+}
+
+TEST_CASE("wraps around")
+{
+    mpsc_queue<int, 2> queue;
+
+    for (auto i = 0; i < 100; i++) {
+        CHECK(queue.try_push(i));
+        CHECK(queue.try_pop() == i);
+    }
+}
+
+TEST_CASE("move only values")
+{
+    mpsc_queue<std::unique_ptr<std::string>, 4> queue;
+
+    auto val = std::make_unique<std::string>("hello");
+    CHECK(queue.try_push(std::move(val)));
+    CHECK(val == nullptr);
+
+    auto ptr = queue.pop();
+    CHECK(*ptr == "hello");
+}
+
+TEST_CASE("failed push leaves value untouched")
+{
+    mpsc_queue<std::unique_ptr<int>, 2> queue;
+
+    CHECK(queue.try_push(std::make_unique<int>(1)));
+    CHECK(queue.try_push(std::make_unique<int>(2)));
+
+    auto val = std::make_unique<int>(3);
+    CHECK(!queue.try_push(std::move(val)));
+    CHECK(val != nullptr);
+}
+
+TEST_CASE("remaining values are destroyed")
+{
+    auto val = std::make_shared<int>(42);
+
+    {
+        mpsc_queue<std::shared_ptr<int>, 8> queue;
+
+        for (auto i = 0; i < 5; i++) {
+            CHECK(queue.try_push(val));
+        }
+
+        CHECK(val.use_count() == 6);
+    }
+
+    CHECK(val.use_count() == 1);
+}
+
+TEST_CASE("pop waits for a push")
+{
+    mpsc_queue<int, 4> queue;
+
+    std::thread t{[&queue] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        queue.push(42);
+    }};
+
+    CHECK(queue.pop() == 42);
+    t.join();
+}
+
+// Many producers push through a small queue, so that producers regularly
+// find it full and have to wait for the consumer. Every value must arrive
+// exactly once, and each producer's values must arrive in the order they
+// were pushed.
+
+TEST_CASE("contention")
+{
+    constexpr std::size_t producers = 16;
+    constexpr std::size_t num = 20000;
+
+    mpsc_queue<std::pair<std::size_t, std::size_t>, 16> queue;
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < producers; i++) {
+        threads.emplace_back([&queue, i] {
+            for (std::size_t j = 0; j < num; j++) {
+                queue.push(std::make_pair(i, j));
+            }
+        });
+    }
+
+    auto in_order = true;
+    std::vector<std::size_t> next(producers);
+
+    for (std::size_t i = 0; i < producers * num; i++) {
+        auto [producer, val] = queue.pop();
+
+        if (val != next[producer]++) {
+            in_order = false;
+        }
+    }
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    CHECK(in_order);
+    CHECK(!queue.try_pop());
+
+    for (const auto &n : next) {
+        CHECK(n == num);
+    }
+}
+
+#endif
+
+// -----------------------------------------------------------------------------
+// Benchmark
+// -----------------------------------------------------------------------------
+
+#ifdef BENCHMARK
+
+#include <chrono>
+#include <iomanip>
+
+// The same blocking queue implemented the usual way, with a mutex, a
+// condition variable and a std::deque.
+
+template<typename T>
+class locked_queue
+{
+public:
+
+    void push(T val)
+    {
+        {
+            std::lock_guard lock(m_mutex);
+            m_queue.push_back(std::move(val));
+        }
+
+        m_cv.notify_one();
+    }
+
+    T pop()
+    {
+        std::unique_lock lock(m_mutex);
+        m_cv.wait(lock, [this]{ return !m_queue.empty(); });
+
+        auto val = std::move(m_queue.front());
+        m_queue.pop_front();
+
+        return val;
+    }
+
+private:
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<T> m_queue;
+};
+
+// Pushes num values in total, split evenly across the producers, and returns
+// the number of values the consumer received per second.
+
+template<typename Q>
+double
+run(std::size_t producers, std::size_t num)
+{
+    using namespace std::chrono;
+
+    Q queue;
+    auto per_producer = num / producers;
+
+    auto stime = steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < producers; i++) {
+        threads.emplace_back([&queue, per_producer] {
+            for (std::size_t j = 0; j < per_producer; j++) {
+                queue.push(j);
+            }
+        });
+    }
+
+    std::size_t sum{};
+    for (std::size_t i = 0; i < per_producer * producers; i++) {
+        sum += queue.pop();
+    }
+
+    auto etime = steady_clock::now();
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    if (sum != producers * (per_producer * (per_producer - 1) / 2)) {
+        throw std::runtime_error("lost values");
+    }
+
+    auto secs = duration_cast<duration<double>>(etime - stime).count();
+    return static_cast<double>(per_producer * producers) / secs;
+}
+
+int
+protected_main(int argc, char** argv)
+{
+    std::size_t num = argc > 1 ? std::stoul(argv[1]) : 1000000;
+
+    std::cout << std::fixed << std::setprecision(0);
+    std::cout << std::setw(10) << "producers"
+              << std::setw(16) << "mutex+deque"
+              << std::setw(16) << "mpsc_queue" << '\n';
+
+    for (std::size_t producers = 1; producers <= 32; producers *= 2) {
+        std::cout << std::setw(10) << producers
+                  << std::setw(16) << run<locked_queue<std::size_t>>(producers, num)
+                  << std::setw(16) << run<mpsc_queue<std::size_t, 0x400>>(producers, num)
+                  << '\n';
+    }
+
+    std::cout << "(values/sec)\n";
+    return EXIT_SUCCESS;
+}
+
+int
+main(int argc, char** argv)
+{
+    try {
+        return protected_main(argc, argv);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Caught unhandled exception:\n";
+        std::cerr << " - what(): " << e.what() << '\n';
+    }
+    catch (...) {
+        std::cerr << "Caught unknown exception\n";
+    }
+
+    return EXIT_FAILURE;
+}
+
+#endif
@@ -0,0 +1,258 @@
+//
+// Copyright (C) 2018 Rian Quinn <rianquinn@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <atomic>
+#include <memory>
+#include <new>
+#include <optional>
+#include <utility>
+
+#include <climits>
+#include <cstdint>
+
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// -----------------------------------------------------------------------------
+// Event Count
+// -----------------------------------------------------------------------------
+
+// An event count lets a thread sleep until some condition that is checked
+// without a lock becomes true, without the thread that makes it true having
+// to take a lock either. A waiter first calls prepare_wait(), then checks
+// the condition once more, and only calls wait() if it is still false. If
+// notify() is called anywhere in between, the epoch will have changed and
+// wait() returns right away, so a wakeup can never be lost.
+//
+// The notifier clears the waiters flag as it wakes everyone up, so once the
+// waiters have been woken, further calls to notify() are just a fence and a
+// load until somebody prepares to wait again. This matters when the waiting
+// thread is slow to get scheduled, as otherwise every push or pop in the
+// meantime would make a futex system call of its own.
+
+class eventcount
+{
+public:
+
+    uint32_t prepare_wait()
+    {
+        m_waiters.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        return m_epoch.load(std::memory_order_acquire);
+    }
+
+    void wait(uint32_t epoch)
+    {
+        while (m_epoch.load(std::memory_order_acquire) == epoch) {
+            futex(FUTEX_WAIT_PRIVATE, epoch);
+        }
+    }
+
+    void notify()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (m_waiters.load(std::memory_order_relaxed) &&
+            m_waiters.exchange(false, std::memory_order_relaxed))
+        {
+            m_epoch.fetch_add(1, std::memory_order_release);
+            futex(FUTEX_WAKE_PRIVATE, INT_MAX);
+        }
+    }
+
+private:
+
+    void futex(int op, uint32_t val)
+    {
+        static_assert(sizeof(m_epoch) == sizeof(uint32_t));
+
+        ::syscall(
+            SYS_futex, reinterpret_cast<uint32_t *>(&m_epoch), op, val, nullptr, nullptr, 0
+        );
+    }
+
+    std::atomic<uint32_t> m_epoch{};
+    std::atomic<bool> m_waiters{};
+};
+
+// -----------------------------------------------------------------------------
+// Multi-Producer, Single-Consumer Queue
+// -----------------------------------------------------------------------------
+
+// A bounded lock-free queue (based on Dmitry Vyukov's bounded MPMC queue)
+// that any number of threads can push to, but only one thread may pop from.
+// Each cell carries a sequence number that tells a producer whether the cell
+// is free for the position it is trying to claim, and tells the consumer
+// whether the cell has been filled yet. Producers claim positions with a
+// compare-and-swap on the tail, and the consumer owns the head outright, so
+// it needs no atomic read-modify-write at all.
+//
+// try_push() and try_pop() never block. push() waits while the queue is
+// full and pop() waits while it is empty, both sleeping on a futex through
+// an eventcount rather than spinning.
+
+template<typename T, std::size_t N>
+class mpsc_queue
+{
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "N must be a power of two");
+
+    struct cell
+    {
+        std::atomic<std::size_t> seq;
+        alignas(T) unsigned char data[sizeof(T)];
+    };
+
+public:
+
+    mpsc_queue() :
+        m_cells{new cell[N]}
+    {
+        for (std::size_t i = 0; i < N; i++) {
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    mpsc_queue(const mpsc_queue &) = delete;
+    mpsc_queue &operator=(const mpsc_queue &) = delete;
+
+    ~mpsc_queue()
+    {
+        while (try_pop());
+    }
+
+    // Any thread. Returns false if the queue is full, in which case val is
+    // left untouched.
+
+    template<typename U>
+    bool try_push(U &&val)
+    {
+        auto pos = m_tail.load(std::memory_order_relaxed);
+
+        while (true) {
+            auto &c = m_cells[pos & (N - 1)];
+            auto seq = c.seq.load(std::memory_order_acquire);
+            auto diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+
+            if (diff == 0) {
+                if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    new (c.data) T(std::forward<U>(val));
+                    c.seq.store(pos + 1, std::memory_order_release);
+
+                    m_not_empty.notify();
+                    return true;
+                }
+            }
+            else if (diff < 0) {
+                return false;
+            }
+            else {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Any thread. A failed try_push() leaves val untouched, so it is safe to
+    // forward it again.
+
+    template<typename U>
+    void push(U &&val)
+    {
+        while (!try_push(std::forward<U>(val))) {
+            auto epoch = m_not_full.prepare_wait();
+
+            if (try_push(std::forward<U>(val))) {
+                return;
+            }
+
+            m_not_full.wait(epoch);
+        }
+    }
+
+    // Consumer only.
+
+    std::optional<T> try_pop()
+    {
+        auto &c = m_cells[m_head & (N - 1)];
+
+        if (c.seq.load(std::memory_order_acquire) != m_head + 1) {
+            return {};
+        }
+
+        auto ptr = std::launder(reinterpret_cast<T *>(c.data));
+
+        std::optional<T> val{std::move(*ptr)};
+        ptr->~T();
+
+        c.seq.store(m_head + N, std::memory_order_release);
+        m_head++;
+
+        // Waiting producers are only woken once half of the queue is free,
+        // so that they all find room when they wake up, rather than fighting
+        // over a single free cell. A producer that found the queue full will
+        // always see such a point, as the consumer still had a full queue to
+        // pop from.
+
+        if ((m_head & (N / 2 - 1)) == 0) {
+            m_not_full.notify();
+        }
+
+        return val;
+    }
+
+    // Consumer only.
+
+    T pop()
+    {
+        while (true) {
+            if (auto val = try_pop()) {
+                return std::move(*val);
+            }
+
+            auto epoch = m_not_empty.prepare_wait();
+
+            if (auto val = try_pop()) {
+                return std::move(*val);
+            }
+
+            m_not_empty.wait(epoch);
+        }
+    }
+
+    constexpr std::size_t capacity() const
+    { return N; }
+
+private:
+
+    std::unique_ptr<cell[]> m_cells;
+
+    alignas(64) std::atomic<std::size_t> m_tail{};
+    alignas(64) std::size_t m_head{};
+
+    alignas(64) eventcount m_not_empty;
+    alignas(64) eventcount m_not_full;
+};
+
+#endif